@@ -1,5 +1,8 @@
 #pragma once
+#include <memory>
 #include <ncurses.h>
+#include "libkoulouri/librarystore.h"
+#include "libkoulouri/librarywatcher.h"
 #include "libkoulouri/metahandler.h"
 #include "libkoulouri/player.h"
 
@@ -16,18 +19,26 @@ public:
     int main();
     int renderBaseUi(WindowType winType);
     void handleInternalQueue();
+    bool syncLibrary();
     static void cleanup();
 private:
+    void forgetTrack(const Track &track);
+
     AudioPlayer player;
-    const Track *currentTrack;
+    const Track *currentTrack = nullptr;
+    const Track *nextTrack = nullptr; // handed to player.queueNext(), not playing yet
+    size_t trackChanges = 0;
     size_t queueIndex;
     std::vector<const Track*> queue;
     bool running = true;
+    bool showStats = false; // audio callback timings in the bottom border - toggled with 's'
     WindowType windowType;
     std::string userInput;
 
     MetaHandler mhandler = MetaHandler();
     MetaCache mcache = MetaCache();
+    LibraryStore library; // what the track list shows - rebuilt from `mcache` whenever it changes
+    std::unique_ptr<LibraryWatcher> watcher; // null if inotify isn't available
 
     int maxy;
     int maxx;
@@ -1,8 +1,11 @@
 #ifndef QtMainWindow_H
 #define QtMainWindow_H
 
+#include <memory>
+#include "libkoulouri/librarywatcher.h"
 #include "libkoulouri/metahandler.h"
 #include "libkoulouri/player.h"
+#include <QFuture>
 #include <QMainWindow>
 #include <qtimer.h>
 
@@ -32,12 +35,16 @@ public:
     Logger logger;
     MetaHandler mhandler;
     MetaCache mcache;
+    std::unique_ptr<LibraryWatcher> watcher; // null if inotify isn't available
     const std::string PATH;
     bool hasseen_conversionMessage = false;
 
     void initializePlaybackUI();
+    void startLibraryUpdates();
     void updateProgressBar();
     QTimer *progressUpdateTimer;
+    QTimer *libraryTimer = nullptr; // applies library changes picked up by `watcher`, once the library is scanned
+    QFuture<void> libraryUpdate; // the startup scan or an apply, on a pool thread
 
     ~QtMainWindow();
 
@@ -1,32 +1,79 @@
 #include "FormatTools.h"
+#include "mappedfile.h"
 
 #include <algorithm>
+#include <cmath>
 #include <iostream>
+#include <iterator>
 
 // audio tools
 
+// Volume adjustment is dispatched to the fastest kernels the CPU supports (see volumekernels.cpp).
+
 // Adjust volume of an Int16 vector
 void AudioTools::adjustVolumeInt16(const int16_t* input, int16_t* output, const size_t samples, const float volumePercent) {
-    float gain = volumePercent / 100.0f;
-    for (size_t i = 0; i < samples; ++i) {
-        int scaled = static_cast<int>(input[i] * gain);
-        output[i] = static_cast<int16_t>(std::clamp(scaled, INT16_MIN, INT16_MAX));
-    }
+    activeKernels().int16(input, output, samples, volumePercent / 100.0f);
 }
 // Adjust volume of an Int32 vector
 void AudioTools::adjustVolumeInt32(const int32_t* input, int32_t* output, const size_t samples, const float volumePercent) {
-    float gain = volumePercent / 100.0f;
-    for (size_t i = 0; i < samples; ++i) {
-        int64_t scaled = input[i] * gain;
-        output[i] = static_cast<int32_t>(std::clamp(scaled, static_cast<int64_t>(INT32_MIN), static_cast<int64_t>(INT32_MAX)));
-    }
+    activeKernels().int32(input, output, samples, volumePercent / 100.0f);
 }
 // Adjust volume of an Float32 vector
 void AudioTools::adjustVolumeFloat32(const float* input, float* output, const size_t samples, const float volumePercent) {
-    float gain = volumePercent / 100.0f;
+    activeKernels().float32(input, output, samples, volumePercent / 100.0f);
+}
+
+/**
+ * Convert floats to 16-bit ints with TPDF dither, so the quantization error becomes a constant noise floor
+ * rather than distortion that follows the signal.
+ * @param input Samples in -1..1
+ * @param output Where to write the converted samples (may not overlap `input`)
+ * @param samples The amount of samples to convert
+ * @param seed Dither noise state - carried over between calls, so consecutive blocks don't repeat the same noise
+ */
+void AudioTools::ditherToInt16(const float* input, int16_t* output, const size_t samples, uint32_t &seed) {
+    // xorshift32 - cheap, and plenty random for noise that's a single LSB wide
+    auto next = [&seed] {
+        seed ^= seed << 13;
+        seed ^= seed >> 17;
+        seed ^= seed << 5;
+        return static_cast<float>(seed) * (1.0f / 4294967296.0f);
+    };
     for (size_t i = 0; i < samples; ++i) {
-        float scaled = input[i] * gain;
-        output[i] = std::clamp(scaled, -1.0f, 1.0f);
+        // the difference of two uniform values is triangular, spanning +-1 LSB
+        const float dithered = input[i] * 32767.0f + (next() - next());
+        output[i] = static_cast<int16_t>(std::clamp(std::lround(dithered), static_cast<long>(INT16_MIN), static_cast<long>(INT16_MAX)));
+    }
+}
+
+/**
+ * Get the gains of both tracks at a point of a crossfade.
+ * @param curve The shape of the fade
+ * @param progress How far into the fade we are (0 = only the old track, 1 = only the new one)
+ * @param fadeOut Gain for the outgoing track
+ * @param fadeIn Gain for the incoming track
+ */
+void AudioTools::crossfadeGains(const CrossfadeCurve curve, float progress, float &fadeOut, float &fadeIn) {
+    progress = std::clamp(progress, 0.0f, 1.0f);
+    switch (curve) {
+        case CrossfadeCurve::Linear: {
+            fadeOut = 1.0f - progress;
+            fadeIn = progress;
+            break;
+        }
+        case CrossfadeCurve::EqualPower: {
+            constexpr float halfPi = 1.57079632679f;
+            fadeOut = std::cos(progress * halfPi);
+            fadeIn = std::sin(progress * halfPi);
+            break;
+        }
+        case CrossfadeCurve::Logarithmic: {
+            // -60dB..0dB, shifted so both ends land exactly on silence/unity
+            constexpr float floor = 0.001f;
+            fadeOut = (std::pow(10.0f, -3.0f * progress) - floor) / (1.0f - floor);
+            fadeIn = (std::pow(10.0f, -3.0f * (1.0f - progress)) - floor) / (1.0f - floor);
+            break;
+        }
     }
 }
 
@@ -38,29 +85,46 @@ void AudioTools::adjustVolumeFloat32(const float* input, float* output, const si
  * @param samples The size of the buffer
  */
 void AudioBuffer::allocate(size_t samples) {
+    mapping.reset();
+    // emplace frees the old vector before the new one is allocated, so it can be reused straight away
     switch (format) {
         case FormatType::Int16: {
-                data = std::vector<int16_t>(samples);
-                break;
-            }
-            case FormatType::Int24:
-            [[fallthrough]];
-            case FormatType::Int32: {
-                data = std::vector<int32_t>(samples);
-                break;
-            case FormatType::Float32: {
-                data = std::vector<float>(samples);
-                break;
-            }
+            data.emplace<SampleVector<int16_t>>(samples);
+            break;
+        }
+        case FormatType::Int24: {
+            data.emplace<SampleVector<Packed24>>(samples);
+            break;
+        }
+        case FormatType::Int32: {
+            data.emplace<SampleVector<int32_t>>(samples);
+            break;
+        }
+        case FormatType::Float32: {
+            data.emplace<SampleVector<float>>(samples);
+            break;
         }
     }
 }
 
+/**
+ * Use samples mapped straight from a file instead of the internal vector.
+ *
+ * The file must already hold samples in the buffer's format and the host's byte order. Mapped buffers are
+ * read-only - only the const `raw()` may be used to access them. Calling `allocate()` or `clear()` drops the mapping.
+ * @param file The mapped region holding the samples
+ */
+void AudioBuffer::map(std::shared_ptr<const MappedFile> file) {
+    data = SampleVector<float>(); // don't keep a stale vector alongside the mapping
+    mapping = std::move(file);
+}
+
 /**
  * Get the internal vector's size.
- * @return The size of the internal vector
+ * @return The size of the internal vector (or mapping), in samples
  */
 size_t AudioBuffer::size() const {
+    if (mapping) return mapping->size() / FormatTools::sampleSize(format);
     return std::visit([](const auto& vec) {
         return vec.size();
     }, data);
@@ -71,6 +135,7 @@ size_t AudioBuffer::size() const {
  * @return Whether the internal vector is empty
  */
 bool AudioBuffer::empty() const {
+    if (mapping) return mapping->size() == 0;
     return std::visit([](const auto& vec) {
         return vec.empty();
     }, data);
@@ -83,6 +148,7 @@ bool AudioBuffer::empty() const {
  * To free that memory, you must reallocate, resize, or delete this object.
  */
 void AudioBuffer::clear() {
+    mapping.reset();
     std::visit([](auto& vec) {
         vec.clear();
     }, data);
@@ -106,18 +172,54 @@ void AudioBuffer::resize(size_t samples, const bool shrink) {
 }
 
 
+/**
+ * Convert a Float32 buffer into (dithered) Int16, halving its memory use.
+ *
+ * Meant for lossy sources, whose noise floor is far above what 16 bits can resolve anyway.
+ * @param seed Starting state of the dither noise
+ * @return Whether the buffer was converted. Only unmapped Float32 buffers are
+ */
+bool AudioBuffer::compact(uint32_t seed) {
+    if (format != FormatType::Float32 || mapping) return false;
+
+    const SampleVector<float> &source = std::get<SampleVector<float>>(data);
+    SampleVector<int16_t> converted(source.size());
+    AudioTools::ditherToInt16(source.data(), converted.data(), source.size(), seed);
+
+    format = FormatType::Int16;
+    data = std::move(converted);
+    return true;
+}
+
 // Return the internal vector in Int16 form.
-std::vector<int16_t>& AudioBuffer::getInt16Buffer() {
-    return std::get<std::vector<int16_t>>(data);
+SampleVector<int16_t>& AudioBuffer::getInt16Buffer() {
+    return std::get<SampleVector<int16_t>>(data);
+};
+// Return the internal vector in (packed) Int24 form.
+SampleVector<Packed24>& AudioBuffer::getInt24Buffer() {
+    return std::get<SampleVector<Packed24>>(data);
 };
 // Return the internal vector in Int32 form.
-std::vector<int32_t>& AudioBuffer::getInt32Buffer() {
-    return std::get<std::vector<int32_t>>(data);
+SampleVector<int32_t>& AudioBuffer::getInt32Buffer() {
+    return std::get<SampleVector<int32_t>>(data);
 };
 // Return the internal vector in Float(32) form.
-std::vector<float>& AudioBuffer::getFloat32Buffer() {
-    return std::get<std::vector<float>>(data);
+SampleVector<float>& AudioBuffer::getFloat32Buffer() {
+    return std::get<SampleVector<float>>(data);
 };
+// Return a pointer to the start of the internal vector, regardless of its type.
+void* AudioBuffer::raw() {
+    return std::visit([](auto& vec) -> void* {
+        return vec.data();
+    }, data);
+}
+// Return a read-only pointer to the start of the samples, regardless of their type or whether they are mapped.
+const void* AudioBuffer::raw() const {
+    if (mapping) return mapping->data();
+    return std::visit([](const auto& vec) -> const void* {
+        return vec.data();
+    }, data);
+}
 
 
 /**
@@ -126,16 +228,30 @@ std::vector<float>& AudioBuffer::getFloat32Buffer() {
  * @param buffer The buffer to read into
  * @param frames How much data to read
  * @param format The format of the file being read
+ * @param channels The amount of channels in the file
  * @return How many frames were successfully read
  */
-sf_count_t FormatReader::read(SNDFILE *file, AudioBuffer *buffer, sf_count_t frames, FormatType format) {
+sf_count_t FormatReader::read(SNDFILE *file, AudioBuffer *buffer, sf_count_t frames, FormatType format, const int channels) {
     switch (format) {
         // native support
         case FormatType::Int16: {
             return sf_readf_short(file, buffer->getInt16Buffer().data(), frames);
         }
-        // no support - converted into Int32
-        case FormatType::Int24:
+        // no packed support - read as Int32 a block at a time, so the whole file never exists unpacked
+        case FormatType::Int24: {
+            int32_t block[4096];
+            const sf_count_t blockFrames = std::max<sf_count_t>(static_cast<sf_count_t>(std::size(block)) / channels, 1);
+            const auto pack = AudioTools::activeKernels().pack24;
+            Packed24 *out = buffer->getInt24Buffer().data();
+            sf_count_t framesRead = 0;
+            while (framesRead < frames) {
+                const sf_count_t got = sf_readf_int(file, block, std::min(blockFrames, frames - framesRead));
+                if (got <= 0) break;
+                pack(block, out + framesRead * channels, static_cast<size_t>(got) * channels);
+                framesRead += got;
+            }
+            return framesRead;
+        }
         // native support
         case FormatType::Int32: {
             return sf_readf_int(file, buffer->getInt32Buffer().data(), frames);
@@ -169,10 +285,50 @@ FormatType FormatTools::fromLibsndfile(const int format) {
     }
 }
 
-// Convert FormatType into a 'pa<format>' type.
-std::map<FormatType, PaSampleFormat> FormatTools::toPortAudio = {
-    {FormatType::Int16, paInt16},
-    {FormatType::Int24, paInt32}, // padded 24 bit
-    {FormatType::Int32, paInt32}, // true 32 bit
-    {FormatType::Float32, paFloat32}
-};
+/**
+ * Whether a libsndfile format integer describes a lossy codec.
+ * @param format The libsndfile format integer
+ * @return True for MPEG audio, Vorbis and Opus
+ */
+bool FormatTools::isLossy(const int format) {
+    switch (format & SF_FORMAT_SUBMASK) {
+        case SF_FORMAT_MPEG_LAYER_I:
+        case SF_FORMAT_MPEG_LAYER_II:
+        case SF_FORMAT_MPEG_LAYER_III:
+        case SF_FORMAT_VORBIS:
+        case SF_FORMAT_OPUS:
+            return true;
+        default:
+            return false;
+    }
+}
+
+/**
+ * Get the size (in bytes) of a single sample of a FormatType, as stored in an AudioBuffer.
+ * @param format The FormatType to check
+ * @return The size of one sample
+ */
+size_t FormatTools::sampleSize(const FormatType format) {
+    switch (format) {
+        case FormatType::Int16: return sizeof(int16_t);
+        case FormatType::Int24: return sizeof(Packed24);
+        case FormatType::Int32: return sizeof(int32_t);
+        case FormatType::Float32: return sizeof(float);
+    }
+    return sizeof(float);
+}
+
+/**
+ * Convert a FormatType into its 'pa<format>' equivalent.
+ * @param format The FormatType to convert
+ * @return The PortAudio sample format the FormatType is played as
+ */
+PaSampleFormat FormatTools::toPortAudio(const FormatType format) {
+    switch (format) {
+        case FormatType::Int16: return SampleTraits<FormatType::Int16>::paFormat;
+        case FormatType::Int24: return SampleTraits<FormatType::Int24>::paFormat; // packed 24 bit
+        case FormatType::Int32: return SampleTraits<FormatType::Int32>::paFormat; // true 32 bit
+        case FormatType::Float32: return SampleTraits<FormatType::Float32>::paFormat;
+    }
+    return paFloat32;
+}
@@ -1,12 +1,16 @@
 #pragma once
+#include <cstdint>
 #include <functional>
 #include <map>
+#include <memory>
 #include <portaudio.h>
 #include <sndfile.h>
 #include <string>
 #include <variant>
 #include <vector>
 
+#include "bufferpool.h"
+
 enum class FormatType {
     Int16,
     Int24,
@@ -14,52 +18,172 @@ enum class FormatType {
     Float32
 };
 
+/**
+ * A single packed 24-bit sample - three bytes, least significant first (the layout of 24-bit WAV data and paInt24).
+ *
+ * Only used for storage and output. Anything doing arithmetic on samples unpacks them into the top 24 bits of an
+ * int32 first (see `VolumeKernels::unpack24`), which is also how libsndfile hands 24-bit audio out as ints.
+ */
+struct Packed24 {
+    uint8_t bytes[3];
+
+    [[nodiscard]] int32_t toInt32() const {
+        return static_cast<int32_t>(static_cast<uint32_t>(bytes[0]) << 8 | static_cast<uint32_t>(bytes[1]) << 16 |
+                                    static_cast<uint32_t>(bytes[2]) << 24);
+    }
+    static Packed24 fromInt32(const int32_t value) {
+        const auto bits = static_cast<uint32_t>(value);
+        return {{static_cast<uint8_t>(bits >> 8), static_cast<uint8_t>(bits >> 16), static_cast<uint8_t>(bits >> 24)}};
+    }
+};
+static_assert(sizeof(Packed24) == 3, "Packed24 must not be padded");
+
+// Sample storage comes from BufferPool, so consecutive tracks reuse memory (see SampleVector).
 using RawBuffer = std::variant<
-    std::vector<int16_t>,
-    std::vector<int32_t>,
-    std::vector<float>
+    SampleVector<int16_t>,
+    SampleVector<Packed24>,
+    SampleVector<int32_t>,
+    SampleVector<float>
 >;
 
 static std::map<FormatType, std::string> formatTypeString = {
     {FormatType::Int16, "16-bit int"},
-    {FormatType::Int24, "24-bit int (converted to 32-bit int)"},
+    {FormatType::Int24, "24-bit int (packed)"},
     {FormatType::Int32, "32-bit int"},
     {FormatType::Float32, "32-bit float"}
 };
 
+/**
+ * How decoded audio is held in memory.
+ */
+enum class StoragePolicy {
+    Exact, // keep samples exactly as decoded
+    Compact // store lossy sources as TPDF-dithered 16-bit ints instead of 32-bit floats - half the memory
+};
+
+/**
+ * Gain curves used when crossfading between two tracks.
+ */
+enum class CrossfadeCurve {
+    Linear, // gains sum to 1 - dips slightly in perceived loudness halfway through
+    EqualPower, // sine/cosine - constant perceived loudness for uncorrelated material
+    Logarithmic // linear in decibels (60dB range) - fast initial drop, long tail
+};
+
+/**
+ * A set of volume and mixing kernels (one per sample type), all sharing the same instruction set.
+ *
+ * Gains are linear (1.0 = unchanged). Output saturates to the format's range. Mixers take one gain per sample for
+ * each input, and may write over either input.
+ * Packed 24-bit samples are converted to and from the top 24 bits of an int32 by `unpack24`/`pack24`.
+ */
+struct VolumeKernels {
+    const char* name;
+    void (*int16)(const int16_t* input, int16_t* output, size_t samples, float gain);
+    void (*int24)(const Packed24* input, Packed24* output, size_t samples, float gain);
+    void (*int32)(const int32_t* input, int32_t* output, size_t samples, float gain);
+    void (*float32)(const float* input, float* output, size_t samples, float gain);
+    void (*unpack24)(const Packed24* input, int32_t* output, size_t samples);
+    void (*pack24)(const int32_t* input, Packed24* output, size_t samples);
+    void (*mixInt16)(const int16_t* a, const int16_t* b, const float* gainA, const float* gainB, int16_t* output, size_t samples);
+    void (*mixInt24)(const Packed24* a, const Packed24* b, const float* gainA, const float* gainB, Packed24* output, size_t samples);
+    void (*mixInt32)(const int32_t* a, const int32_t* b, const float* gainA, const float* gainB, int32_t* output, size_t samples);
+    void (*mixFloat32)(const float* a, const float* b, const float* gainA, const float* gainB, float* output, size_t samples);
+};
+
 class AudioTools {
 public:
+    static const VolumeKernels& activeKernels();
+    static std::vector<VolumeKernels> supportedKernels();
+
     static void adjustVolumeInt16(const int16_t* input, int16_t* output, size_t samples, float volumePercent);
     static void adjustVolumeInt32(const int32_t* input, int32_t* output, size_t samples, float volumePercent);
     static void adjustVolumeFloat32(const float* input, float* output, size_t samples, float volumePercent);
+
+    static void ditherToInt16(const float* input, int16_t* output, size_t samples, uint32_t &seed);
+    static void crossfadeGains(CrossfadeCurve curve, float progress, float &fadeOut, float &fadeIn);
+};
+
+/**
+ * Compile-time description of how a FormatType is stored and played, so per-format code (like the audio callback)
+ * can be written once as a template and instantiated for every format.
+ *
+ * `Type` is the in-memory sample type, `paFormat` the matching PortAudio sample format, `volume` the matching
+ * VolumeKernels member and `mix` the matching VolumeKernels mixer.
+ */
+template<FormatType Format>
+struct SampleTraits;
+
+template<>
+struct SampleTraits<FormatType::Int16> {
+    using Type = int16_t;
+    static constexpr PaSampleFormat paFormat = paInt16;
+    static constexpr auto volume = &VolumeKernels::int16;
+    static constexpr auto mix = &VolumeKernels::mixInt16;
+};
+
+template<>
+struct SampleTraits<FormatType::Int24> { // packed - devices without paInt24 support get it unpacked to paInt32
+    using Type = Packed24;
+    static constexpr PaSampleFormat paFormat = paInt24;
+    static constexpr auto volume = &VolumeKernels::int24;
+    static constexpr auto mix = &VolumeKernels::mixInt24;
 };
 
+template<>
+struct SampleTraits<FormatType::Int32> {
+    using Type = int32_t;
+    static constexpr PaSampleFormat paFormat = paInt32;
+    static constexpr auto volume = &VolumeKernels::int32;
+    static constexpr auto mix = &VolumeKernels::mixInt32;
+};
+
+template<>
+struct SampleTraits<FormatType::Float32> {
+    using Type = float;
+    static constexpr PaSampleFormat paFormat = paFloat32;
+    static constexpr auto volume = &VolumeKernels::float32;
+    static constexpr auto mix = &VolumeKernels::mixFloat32;
+};
+
+class MappedFile;
+
 class AudioBuffer {
     public:
     FormatType format;
     RawBuffer data;
 
-    std::vector<int16_t>& getInt16Buffer();
-    std::vector<int32_t>& getInt32Buffer();
-    std::vector<float>& getFloat32Buffer();
+    SampleVector<int16_t>& getInt16Buffer();
+    SampleVector<Packed24>& getInt24Buffer();
+    SampleVector<int32_t>& getInt32Buffer();
+    SampleVector<float>& getFloat32Buffer();
+    void* raw();
+    [[nodiscard]] const void* raw() const;
 
     void allocate(size_t samples);
+    void map(std::shared_ptr<const MappedFile> file);
+    [[nodiscard]] bool mapped() const { return mapping != nullptr; };
+    [[nodiscard]] const MappedFile* getMapping() const { return mapping.get(); };
     [[nodiscard]] size_t size() const;
     [[nodiscard]] bool empty() const;
     void clear();
     void resize(size_t samples, bool shrink);
+    bool compact(uint32_t seed = 1);
 
     private:
+    std::shared_ptr<const MappedFile> mapping; // read-only samples straight from disk - replaces the vector when set
 
 };
 
 class FormatReader {
 public:
-    static sf_count_t read(SNDFILE* file, AudioBuffer* buffer, sf_count_t frames, FormatType format);
+    static sf_count_t read(SNDFILE* file, AudioBuffer* buffer, sf_count_t frames, FormatType format, int channels);
 };
 
 class FormatTools {
 public:
-    static std::map<FormatType, PaSampleFormat> toPortAudio;
+    static PaSampleFormat toPortAudio(FormatType format);
     static FormatType fromLibsndfile(int format);
+    static size_t sampleSize(FormatType format);
+    static bool isLossy(int format);
 };
@@ -0,0 +1,248 @@
+#include "audiosink.h"
+
+#include <chrono>
+
+#include "logger.h"
+
+namespace {
+std::mutex portAudioMutex;
+int portAudioUsers = 0; // successfully initialized contexts
+}
+
+PortAudioContext::PortAudioContext() {
+    std::lock_guard lock(portAudioMutex);
+    if (portAudioUsers > 0) {
+        error = paNoError;
+    } else {
+        Logger::g_log("libkoulouri", Logger::Level::DEBUG, "portaudio", "initializing PortAudio...");
+        error = Pa_Initialize();
+    }
+    if (error == paNoError) {
+        portAudioUsers++;
+    } else {
+        Logger::g_log("libkoulouri", Logger::Level::ERROR, "portaudio",
+                      std::string("Failed to initialize PortAudio: ") + Pa_GetErrorText(error));
+    }
+}
+
+PortAudioContext::~PortAudioContext() {
+    if (error != paNoError) return; // never counted
+    std::lock_guard lock(portAudioMutex);
+    if (--portAudioUsers == 0) {
+        Logger::g_log("libkoulouri", Logger::Level::DEBUG, "portaudio", "Quitting PortAudio...");
+        Pa_Terminate();
+    }
+}
+
+
+PortAudioSink::~PortAudioSink() {
+    close();
+}
+
+/**
+ * Open a stream on the default output device.
+ * @param config What the callback produces, and how much at once
+ * @param callback Called for every buffer the device needs
+ * @param userData Passed to `callback`
+ */
+PaError PortAudioSink::open(const StreamConfig &config, PaStreamCallback *callback, void *userData) {
+    if (!context.ok()) return paNotInitialized;
+    PaStreamParameters outputParams;
+    outputParams.device = Pa_GetDefaultOutputDevice();
+    const PaDeviceInfo *device = Pa_GetDeviceInfo(outputParams.device);
+    if (!device) return paDeviceUnavailable;
+    outputParams.channelCount = config.channels;
+    outputParams.sampleFormat = FormatTools::toPortAudio(config.format);
+    outputParams.suggestedLatency = config.highLatency ? device->defaultHighOutputLatency : device->defaultLowOutputLatency;
+    outputParams.hostApiSpecificStreamInfo = nullptr;
+
+    const PaError error = Pa_OpenStream(&stream, nullptr, &outputParams, config.sampleRate,
+                                        config.framesPerBuffer, paClipOff, callback, userData);
+    if (error != paNoError) {
+        stream = nullptr;
+    }
+    return error;
+}
+
+PaError PortAudioSink::start() {
+    return stream ? Pa_StartStream(stream) : paBadStreamPtr;
+}
+
+PaError PortAudioSink::stop() {
+    return stream ? Pa_StopStream(stream) : paBadStreamPtr;
+}
+
+void PortAudioSink::close() {
+    if (stream) {
+        Pa_StopStream(stream);
+        Pa_CloseStream(stream);
+        stream = nullptr;
+    }
+}
+
+bool PortAudioSink::supports(const FormatType format, const int sampleRate, const int channels) const {
+    PaStreamParameters outputParams;
+    outputParams.device = Pa_GetDefaultOutputDevice();
+    outputParams.channelCount = channels;
+    outputParams.sampleFormat = FormatTools::toPortAudio(format);
+    outputParams.suggestedLatency = 0.0;
+    outputParams.hostApiSpecificStreamInfo = nullptr;
+    return Pa_IsFormatSupported(nullptr, &outputParams, sampleRate) == paFormatIsSupported;
+}
+
+int PortAudioSink::nativeRate() const {
+    if (!context.ok()) return 0;
+    const PaDeviceInfo *device = Pa_GetDeviceInfo(Pa_GetDefaultOutputDevice());
+    return device ? static_cast<int>(device->defaultSampleRate) : 0;
+}
+
+
+/**
+ * @param rate The rate to report as native, so tracks get resampled to it. 0 takes any rate
+ * @param speed How fast the clock runs, relative to real time. 0 doesn't wait at all
+ */
+SimulatedSink::SimulatedSink(const int rate, const double speed) : rate(rate), speed(speed) {}
+
+SimulatedSink::~SimulatedSink() {
+    SimulatedSink::close();
+}
+
+PaError SimulatedSink::open(const StreamConfig &config, PaStreamCallback *streamCallback, void *streamUserData) {
+    if (config.sampleRate <= 0) return paInvalidSampleRate;
+    if (config.channels <= 0) return paInvalidChannelCount;
+    if (opened) return paStreamIsNotStopped;
+
+    // the clock keeps counting across streams, even if they run at different rates
+    if (streamConfig.sampleRate > 0) {
+        elapsed += static_cast<double>(frames.load() - streamStart) / streamConfig.sampleRate;
+    }
+    streamStart = frames.load();
+    streamConfig = config;
+    callback = streamCallback;
+    userData = streamUserData;
+    buffer.assign(config.framesPerBuffer * config.channels * FormatTools::sampleSize(config.format), 0);
+    opened = true;
+    return paNoError;
+}
+
+PaError SimulatedSink::start() {
+    if (!opened) return paBadStreamPtr;
+    std::unique_lock lock(mutex);
+    if (running) return paNoError; // already running
+    lock.unlock();
+    // the callback may have stopped the stream itself - its thread is done, but still has to be joined
+    if (worker.joinable()) {
+        worker.join();
+    }
+    lock.lock();
+    running = true;
+    worker = std::thread(&SimulatedSink::run, this);
+    return paNoError;
+}
+
+PaError SimulatedSink::stop() {
+    {
+        std::lock_guard lock(mutex);
+        running = false;
+    }
+    wake.notify_all();
+    if (worker.joinable()) {
+        worker.join();
+    }
+    return paNoError;
+}
+
+void SimulatedSink::close() {
+    stop();
+    opened = false;
+}
+
+double SimulatedSink::clock() const {
+    if (streamConfig.sampleRate <= 0) return elapsed;
+    return elapsed + static_cast<double>(frames.load(std::memory_order_relaxed) - streamStart) / streamConfig.sampleRate;
+}
+
+void SimulatedSink::run() {
+    using Clock = std::chrono::steady_clock;
+    const double period = static_cast<double>(streamConfig.framesPerBuffer) / streamConfig.sampleRate;
+    const auto start = Clock::now();
+    uint64_t callbacks = 0;
+
+    std::unique_lock lock(mutex);
+    while (running) {
+        lock.unlock();
+        const double now = clock();
+        // one buffer of "output latency" - the buffer plays once the previous one is done
+        const PaStreamCallbackTimeInfo timeInfo{0.0, now, now + period};
+        const int result = callback(nullptr, buffer.data(), streamConfig.framesPerBuffer, &timeInfo, 0, userData);
+        consume(buffer.data(), streamConfig.framesPerBuffer);
+        frames.fetch_add(streamConfig.framesPerBuffer, std::memory_order_relaxed);
+        callbacks++;
+        lock.lock();
+
+        if (result != paContinue) {
+            running = false; // like PortAudio, the stream stops itself - start() has to be called again
+            break;
+        }
+        if (speed > 0.0) {
+            const auto deadline = start + std::chrono::duration_cast<Clock::duration>(
+                std::chrono::duration<double>(callbacks * period / speed));
+            wake.wait_until(lock, deadline, [this] { return !running; });
+        }
+    }
+}
+
+
+/**
+ * @param path Where to write the WAV file. Created (or truncated) once the first stream opens
+ * @param rate The rate to report as native, so tracks get resampled to it. 0 takes the first stream's rate
+ * @param speed How fast the clock runs, relative to real time. 0 writes as fast as possible
+ */
+WavFileSink::WavFileSink(const std::string &path, const int rate, const double speed)
+    : SimulatedSink(rate, speed), path(path) {}
+
+WavFileSink::~WavFileSink() {
+    close(); // no more writes from the sink's thread past this point
+    if (file) {
+        sf_close(file);
+    }
+}
+
+PaError WavFileSink::open(const StreamConfig &config, PaStreamCallback *callback, void *userData) {
+    if (!file) {
+        info = SF_INFO{};
+        info.samplerate = config.sampleRate;
+        info.channels = config.channels;
+        switch (config.format) {
+            case FormatType::Int16: info.format = SF_FORMAT_WAV | SF_FORMAT_PCM_16; break;
+            case FormatType::Int24: info.format = SF_FORMAT_WAV | SF_FORMAT_PCM_24; break;
+            case FormatType::Int32: info.format = SF_FORMAT_WAV | SF_FORMAT_PCM_32; break;
+            case FormatType::Float32: info.format = SF_FORMAT_WAV | SF_FORMAT_FLOAT; break;
+        }
+        file = sf_open(path.c_str(), SFM_WRITE, &info);
+        if (!file) {
+            Logger::g_log("libkoulouri", Logger::Level::ERROR, "sink", "Can't write " + path + ": " + sf_strerror(nullptr));
+            return paDeviceUnavailable;
+        }
+    } else if (config.sampleRate != info.samplerate || config.channels != info.channels) {
+        Logger::g_log("libkoulouri", Logger::Level::ERROR, "sink", path + " is " + std::to_string(info.samplerate) +
+                      "Hz/" + std::to_string(info.channels) + "ch - can't append a stream that isn't");
+        return config.sampleRate != info.samplerate ? paInvalidSampleRate : paInvalidChannelCount;
+    }
+    return SimulatedSink::open(config, callback, userData);
+}
+
+// Packed 24-bit samples would need their own conversion - they're unpacked to 32-bit before they get here instead.
+bool WavFileSink::supports(const FormatType format, int, int) const {
+    return format != FormatType::Int24;
+}
+
+void WavFileSink::consume(const void *samples, const unsigned long frameCount) {
+    const auto count = static_cast<sf_count_t>(frameCount);
+    switch (config().format) {
+        case FormatType::Int16: sf_writef_short(file, static_cast<const short*>(samples), count); break;
+        case FormatType::Int32: sf_writef_int(file, static_cast<const int*>(samples), count); break;
+        case FormatType::Float32: sf_writef_float(file, static_cast<const float*>(samples), count); break;
+        case FormatType::Int24: break; // never opened with (see supports())
+    }
+}
@@ -0,0 +1,182 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <portaudio.h>
+#include <sndfile.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "FormatTools.h"
+
+/**
+ * Shared PortAudio initialization.
+ *
+ * PortAudio is initialized along with the first context and terminated with the last one, so several players in one
+ * process don't tear it down under each other. A failed initialization is logged, and `ok()` stays false.
+ */
+class PortAudioContext {
+public:
+    PortAudioContext();
+    ~PortAudioContext();
+
+    PortAudioContext(const PortAudioContext&) = delete;
+    PortAudioContext& operator=(const PortAudioContext&) = delete;
+
+    [[nodiscard]] bool ok() const { return error == paNoError; };
+
+private:
+    PaError error;
+};
+
+/**
+ * Where AudioPlayer's output goes.
+ *
+ * A sink runs a stream that keeps calling the player's audio callback for the next buffer, exactly like PortAudio
+ * does - the callback can't tell sinks apart. Errors are reported as PaError codes, whatever the sink.
+ */
+class AudioSink {
+public:
+    struct StreamConfig {
+        int sampleRate;
+        int channels;
+        FormatType format;
+        unsigned long framesPerBuffer;
+        bool highLatency; // prefer the device's default high latency over its low one
+    };
+
+    virtual ~AudioSink() = default;
+
+    virtual PaError open(const StreamConfig &config, PaStreamCallback *callback, void *userData) = 0;
+    virtual PaError start() = 0;
+    virtual PaError stop() = 0; // waits for a running callback to return
+    virtual void close() = 0;
+    [[nodiscard]] virtual bool isOpen() const = 0;
+
+    /**
+     * Whether the sink takes `format` as is. Packed 24-bit audio is unpacked to 32-bit otherwise.
+     */
+    [[nodiscard]] virtual bool supports(FormatType format, int sampleRate, int channels) const { return true; };
+    /**
+     * The rate the sink runs at natively - tracks are resampled to it. 0 if it takes any rate.
+     */
+    [[nodiscard]] virtual int nativeRate() const { return 0; };
+    [[nodiscard]] virtual const char *name() const = 0;
+};
+
+/**
+ * Plays through PortAudio's default output device.
+ */
+class PortAudioSink : public AudioSink {
+public:
+    PortAudioSink() = default;
+    ~PortAudioSink() override;
+
+    PortAudioSink(const PortAudioSink&) = delete;
+    PortAudioSink& operator=(const PortAudioSink&) = delete;
+
+    PaError open(const StreamConfig &config, PaStreamCallback *callback, void *userData) override;
+    PaError start() override;
+    PaError stop() override;
+    void close() override;
+    [[nodiscard]] bool isOpen() const override { return stream != nullptr; };
+
+    [[nodiscard]] bool supports(FormatType format, int sampleRate, int channels) const override;
+    [[nodiscard]] int nativeRate() const override;
+    [[nodiscard]] const char *name() const override { return "portaudio"; };
+
+private:
+    PortAudioContext context; // declared first, so PortAudio outlives the stream
+    PaStream *stream = nullptr;
+};
+
+/**
+ * A sink without hardware: a thread calls the audio callback on a simulated clock, so the whole playback path can
+ * run (and be timed) on machines without sound.
+ *
+ * The clock runs at `speed` times real time - 1 behaves like a device, 0 runs as fast as the CPU allows. Note the
+ * player keeps streams running (with silence) between tracks, so an unthrottled sink keeps a core busy until closed.
+ */
+class SimulatedSink : public AudioSink {
+public:
+    explicit SimulatedSink(int rate = 0, double speed = 1.0);
+    ~SimulatedSink() override;
+
+    SimulatedSink(const SimulatedSink&) = delete;
+    SimulatedSink& operator=(const SimulatedSink&) = delete;
+
+    PaError open(const StreamConfig &config, PaStreamCallback *callback, void *userData) override;
+    PaError start() override;
+    PaError stop() override;
+    void close() override;
+    [[nodiscard]] bool isOpen() const override { return opened; };
+    [[nodiscard]] int nativeRate() const override { return rate; };
+
+    [[nodiscard]] uint64_t framesConsumed() const { return frames.load(std::memory_order_relaxed); };
+    // simulated seconds played since the sink was created. Safe on the controlling thread, and on the sink's own
+    // while it runs - only open() moves the clock's base, and that needs the stream closed (the worker joined)
+    [[nodiscard]] double clock() const;
+
+protected:
+    /**
+     * Called (on the sink's thread) with every buffer the callback produced.
+     */
+    virtual void consume(const void *samples, unsigned long frameCount) {};
+    [[nodiscard]] const StreamConfig &config() const { return streamConfig; };
+
+private:
+    void run();
+
+    int rate;
+    double speed;
+    StreamConfig streamConfig{};
+    PaStreamCallback *callback = nullptr;
+    void *userData = nullptr;
+    std::vector<char> buffer; // one callback's worth of samples
+    bool opened = false;
+
+    std::thread worker;
+    std::mutex mutex; // only guards `running`, for waking the worker out of its sleep
+    std::condition_variable wake;
+    bool running = false;
+    std::atomic<uint64_t> frames{0}; // consumed in total
+    double elapsed = 0.0; // simulated seconds before the current stream was opened (rates may differ between them)
+    uint64_t streamStart = 0; // `frames` when the current stream was opened
+};
+
+/**
+ * Discards everything it's given.
+ */
+class NullSink : public SimulatedSink {
+public:
+    using SimulatedSink::SimulatedSink;
+
+    [[nodiscard]] const char *name() const override { return "null"; };
+};
+
+/**
+ * Writes everything it's given to a WAV file, silence between tracks included.
+ *
+ * The file takes the rate, channel count and sample format of the first stream opened on it. Later streams must
+ * share the rate and channel count (give the sink a native rate so tracks are resampled to it) - their samples are
+ * converted to the file's format. `open()` fails with paDeviceUnavailable if the file can't be created.
+ */
+class WavFileSink : public SimulatedSink {
+public:
+    explicit WavFileSink(const std::string &path, int rate = 0, double speed = 1.0);
+    ~WavFileSink() override;
+
+    PaError open(const StreamConfig &config, PaStreamCallback *callback, void *userData) override;
+    [[nodiscard]] bool supports(FormatType format, int sampleRate, int channels) const override;
+    [[nodiscard]] const char *name() const override { return "wav"; };
+
+protected:
+    void consume(const void *samples, unsigned long frameCount) override;
+
+private:
+    std::string path;
+    SNDFILE *file = nullptr; // opened with the first stream
+    SF_INFO info{};
+};
@@ -0,0 +1,122 @@
+#include "bufferpool.h"
+
+#include <algorithm>
+
+#include "logger.h"
+
+namespace {
+
+// Every block starts with a header holding its capacity, padded so the samples after it stay well aligned.
+constexpr size_t headerSize = 64;
+constexpr std::align_val_t blockAlignment{64};
+
+// A cached block is only handed out if it isn't wildly larger than asked for - otherwise a small scratch buffer
+// could end up sitting on the block the next full track needs.
+constexpr size_t slack = 64 * 1024;
+
+size_t &capacityOf(void *block) {
+    return *static_cast<size_t*>(block);
+}
+
+} // namespace
+
+/**
+ * The pool every AudioBuffer allocates from.
+ */
+BufferPool &BufferPool::global() {
+    // never destroyed - buffers in other static objects may still be released during shutdown
+    static BufferPool *pool = new BufferPool();
+    return *pool;
+}
+
+/**
+ * Get a block of at least `bytes` bytes - a cached one if one fits, new memory otherwise.
+ *
+ * The contents are undefined. Throws std::bad_alloc if no memory is left.
+ * @param bytes The amount of bytes needed
+ * @return The usable start of the block
+ */
+void *BufferPool::acquire(const size_t bytes) {
+    const size_t needed = (bytes + headerSize - 1) / headerSize * headerSize;
+    {
+        std::lock_guard lock(mutex);
+        if (const auto fit = idle.lower_bound(needed); fit != idle.end() && fit->first <= needed * 2 + slack) {
+            void *block = fit->second;
+            idle.erase(fit);
+            order.erase(std::find_if(order.begin(), order.end(), [block](const auto &entry) {
+                return entry.first == block;
+            }));
+            cached -= capacityOf(block);
+            live += capacityOf(block);
+            ++reused;
+            return static_cast<char*>(block) + headerSize;
+        }
+        live += needed;
+        ++fresh;
+    }
+
+    void *block = ::operator new(headerSize + needed, blockAlignment);
+    capacityOf(block) = needed;
+    return static_cast<char*>(block) + headerSize;
+}
+
+/**
+ * Hand a block back. It is cached for reuse if the budget allows, and freed otherwise.
+ * @param pointer A pointer previously returned by `acquire()`
+ */
+void BufferPool::release(void *pointer) {
+    if (!pointer) return;
+    void *block = static_cast<char*>(pointer) - headerSize;
+    const size_t capacity = capacityOf(block);
+
+    std::unique_lock lock(mutex);
+    live -= capacity;
+    if (capacity > budget) {
+        lock.unlock();
+        ::operator delete(block, blockAlignment);
+        return;
+    }
+    evictTo(budget - capacity); // oldest blocks make room for the newest
+    idle.emplace(capacity, block);
+    order.emplace_back(block, capacity);
+    cached += capacity;
+}
+
+/**
+ * Set how many bytes of idle blocks may be kept around for reuse. Anything above the new budget is freed right away.
+ * @param bytes The budget. 0 disables caching
+ */
+void BufferPool::setBudget(const uint64_t bytes) {
+    std::lock_guard lock(mutex);
+    budget = bytes;
+    evictTo(bytes);
+    Logger::g_log("libkoulouri", Logger::Level::DEBUG, "pool", "budget set to: " + std::to_string(bytes) + " bytes");
+}
+
+/**
+ * Free every cached block, e.g. when the player is about to idle for a while.
+ */
+void BufferPool::trim() {
+    std::lock_guard lock(mutex);
+    evictTo(0);
+}
+
+BufferPool::Stats BufferPool::stats() {
+    std::lock_guard lock(mutex);
+    return {budget, cached, live, reused, fresh};
+}
+
+// Free the oldest idle blocks until at most `bytes` remain cached. Must be called with the mutex held.
+void BufferPool::evictTo(const uint64_t bytes) {
+    size_t evicted = 0;
+    while (cached > bytes && evicted < order.size()) {
+        const auto [block, capacity] = order[evicted++];
+        const auto range = idle.equal_range(capacity);
+        idle.erase(std::find_if(range.first, range.second, [block = block](const auto &entry) {
+            return entry.second == block;
+        }));
+        cached -= capacity;
+        ::operator delete(block, blockAlignment);
+    }
+    order.erase(order.begin(), order.begin() + static_cast<std::ptrdiff_t>(evicted));
+}
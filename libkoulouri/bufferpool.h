@@ -0,0 +1,94 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+/**
+ * Process-wide cache of large sample allocations, so consecutive tracks reuse memory instead of faulting in fresh pages.
+ *
+ * Freed blocks are kept (up to the budget) and handed back out to the next request they can hold - a 40MB track
+ * happily reuses the 50MB block the previous one left behind. Blocks aren't zeroed on reuse, as samples are always
+ * decoded over them anyway.
+ *
+ * Thread safe, but never used from the audio callback (tracks are only created and freed by controlling threads).
+ */
+class BufferPool {
+public:
+    struct Stats {
+        uint64_t budget; // how many idle bytes may be kept for reuse
+        uint64_t cached; // idle bytes currently kept
+        uint64_t live; // bytes currently handed out
+        uint64_t reused; // requests served from the cache
+        uint64_t fresh; // requests that needed new memory
+    };
+
+    static BufferPool &global();
+
+    void *acquire(size_t bytes);
+    void release(void *block);
+
+    void setBudget(uint64_t bytes);
+    void trim();
+    [[nodiscard]] Stats stats();
+
+    BufferPool(const BufferPool&) = delete;
+    BufferPool& operator=(const BufferPool&) = delete;
+
+private:
+    BufferPool() = default;
+
+    void evictTo(uint64_t bytes);
+
+    std::mutex mutex;
+    std::multimap<size_t, void*> idle; // capacity -> block, so the tightest fit is a lower_bound away
+    std::vector<std::pair<void*, size_t>> order; // idle blocks, oldest first - evicted in this order
+    uint64_t budget = 512ull * 1024 * 1024;
+    uint64_t cached = 0;
+    uint64_t live = 0;
+    uint64_t reused = 0;
+    uint64_t fresh = 0;
+};
+
+/**
+ * Allocator backing AudioBuffer's vectors with BufferPool.
+ *
+ * Also default-initializes elements instead of value-initializing them, so `std::vector<T>(n)` doesn't spend time
+ * zeroing memory (and faulting it in) just for the decoder to overwrite it.
+ */
+template<typename T>
+struct PoolAllocator {
+    using value_type = T;
+
+    PoolAllocator() = default;
+    template<typename U>
+    PoolAllocator(const PoolAllocator<U>&) noexcept {}
+
+    T *allocate(const size_t n) {
+        return static_cast<T*>(BufferPool::global().acquire(n * sizeof(T)));
+    }
+    void deallocate(T *p, size_t) noexcept {
+        BufferPool::global().release(p);
+    }
+
+    template<typename U>
+    void construct(U *p) noexcept(std::is_nothrow_default_constructible_v<U>) {
+        ::new (static_cast<void*>(p)) U; // default-init - no zeroing
+    }
+    template<typename U, typename... Args>
+    void construct(U *p, Args&&... args) {
+        ::new (static_cast<void*>(p)) U(std::forward<Args>(args)...);
+    }
+
+    template<typename U>
+    bool operator==(const PoolAllocator<U>&) const noexcept { return true; }
+    template<typename U>
+    bool operator!=(const PoolAllocator<U>&) const noexcept { return false; }
+};
+
+template<typename T>
+using SampleVector = std::vector<T, PoolAllocator<T>>;
@@ -0,0 +1,182 @@
+#include "callbackstats.h"
+
+#include <algorithm>
+#include <cstdio>
+
+namespace {
+
+size_t bucketFor(const uint64_t nanos) {
+    const uint64_t micros = nanos / 1000;
+    if (micros < 2) return 0;
+    const size_t log2 = 63 - __builtin_clzll(micros);
+    return std::min(log2, CallbackStats::BucketCount - 1);
+}
+
+// The first bucket starts at 0, as it also takes callbacks that finished in under a microsecond.
+uint64_t bucketStartMicros(const size_t bucket) {
+    return bucket == 0 ? 0 : uint64_t{1} << bucket;
+}
+
+} // namespace
+
+CallbackStats::Scope::Scope(CallbackStats &stats, const PaStreamCallbackFlags statusFlags,
+                            const PaStreamCallbackTimeInfo *timeInfo)
+    : stats(stats), start(Clock::now()) {
+    if (statusFlags & paOutputUnderflow) stats.underflows.fetch_add(1, std::memory_order_relaxed);
+    if (statusFlags & paOutputOverflow) stats.overflows.fetch_add(1, std::memory_order_relaxed);
+    // hosts that don't keep time report zeroes here
+    if (timeInfo && timeInfo->outputBufferDacTime > timeInfo->currentTime) {
+        stats.outputLatency.store(timeInfo->outputBufferDacTime - timeInfo->currentTime, std::memory_order_relaxed);
+    }
+}
+
+CallbackStats::Scope::~Scope() {
+    const auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start);
+    stats.record(static_cast<uint64_t>(elapsed.count()));
+}
+
+CallbackStats::CallbackStats() {
+    reset();
+}
+
+/**
+ * Record how full the streaming ring buffer is as the callback reads from it.
+ * @param available Samples ready to be read
+ * @param capacity Samples the ring can hold
+ */
+void CallbackStats::recordFill(const size_t available, const size_t capacity) {
+    const auto permille = static_cast<uint32_t>(capacity ? std::min(available, capacity) * 1000 / capacity : 1000);
+    fillPermille.store(permille, std::memory_order_relaxed);
+    // only the callback writes this, so there's no need for a CAS
+    if (permille < minFillPermille.load(std::memory_order_relaxed)) {
+        minFillPermille.store(permille, std::memory_order_relaxed);
+    }
+}
+
+/**
+ * Set the callback's deadline, from the stream's buffer size. Called whenever a stream opens.
+ */
+void CallbackStats::setPeriod(const unsigned long framesPerBuffer, const int sampleRate) {
+    periodNanos.store(sampleRate > 0 ? static_cast<uint64_t>(framesPerBuffer) * 1000000000ull / sampleRate : 0,
+                      std::memory_order_relaxed);
+}
+
+/**
+ * Start counting from zero again. The period is kept, as it belongs to the open stream.
+ */
+void CallbackStats::reset() {
+    for (auto &bucket : histogram) {
+        bucket.store(0, std::memory_order_relaxed);
+    }
+    callbacks.store(0, std::memory_order_relaxed);
+    underflows.store(0, std::memory_order_relaxed);
+    overflows.store(0, std::memory_order_relaxed);
+    starved.store(0, std::memory_order_relaxed);
+    totalNanos.store(0, std::memory_order_relaxed);
+    maxNanos.store(0, std::memory_order_relaxed);
+    outputLatency.store(0.0, std::memory_order_relaxed);
+    fillPermille.store(1000, std::memory_order_relaxed);
+    minFillPermille.store(1000, std::memory_order_relaxed);
+}
+
+/**
+ * Copy out the current measurements. Counters are read one by one, so a snapshot taken mid-callback may be off by
+ * that one callback.
+ */
+CallbackStats::Snapshot CallbackStats::snapshot() const {
+    Snapshot result{};
+    for (size_t i = 0; i < BucketCount; ++i) {
+        result.histogram[i] = histogram[i].load(std::memory_order_relaxed);
+    }
+    result.callbacks = callbacks.load(std::memory_order_relaxed);
+    result.underflows = underflows.load(std::memory_order_relaxed);
+    result.overflows = overflows.load(std::memory_order_relaxed);
+    result.starved = starved.load(std::memory_order_relaxed);
+    result.totalNanos = totalNanos.load(std::memory_order_relaxed);
+    result.maxNanos = maxNanos.load(std::memory_order_relaxed);
+    result.periodNanos = periodNanos.load(std::memory_order_relaxed);
+    result.outputLatency = outputLatency.load(std::memory_order_relaxed);
+    result.fillLevel = fillPermille.load(std::memory_order_relaxed) / 1000.0;
+    result.minFillLevel = minFillPermille.load(std::memory_order_relaxed) / 1000.0;
+    return result;
+}
+
+void CallbackStats::record(const uint64_t nanos) {
+    histogram[bucketFor(nanos)].fetch_add(1, std::memory_order_relaxed);
+    callbacks.fetch_add(1, std::memory_order_relaxed);
+    totalNanos.fetch_add(nanos, std::memory_order_relaxed);
+    if (nanos > maxNanos.load(std::memory_order_relaxed)) {
+        maxNanos.store(nanos, std::memory_order_relaxed);
+    }
+}
+
+double CallbackStats::Snapshot::averageMicros() const {
+    return callbacks ? static_cast<double>(totalNanos) / callbacks / 1000.0 : 0.0;
+}
+
+/**
+ * Estimate a callback time percentile from the histogram.
+ * @param percentile 0-100
+ * @return The upper bound (in microseconds) of the bucket the percentile falls into - the histogram can't be more
+ * precise than that. The last bucket has no upper bound, so the slowest callback is reported instead.
+ */
+double CallbackStats::Snapshot::percentileMicros(const double percentile) const {
+    if (!callbacks) return 0.0;
+    const auto rank = static_cast<uint64_t>(std::clamp(percentile, 0.0, 100.0) / 100.0 * callbacks);
+    uint64_t seen = 0;
+    for (size_t i = 0; i < BucketCount - 1; ++i) {
+        seen += histogram[i];
+        if (seen > rank || seen == callbacks) {
+            return std::min(static_cast<double>(bucketStartMicros(i + 1)), maxNanos / 1000.0);
+        }
+    }
+    return maxNanos / 1000.0;
+}
+
+/**
+ * Average share of the deadline spent inside the callback (1 = every callback used its whole period).
+ */
+double CallbackStats::Snapshot::load() const {
+    return periodNanos ? averageMicros() * 1000.0 / periodNanos : 0.0;
+}
+
+/**
+ * One line overview, short enough for a status bar.
+ */
+std::string CallbackStats::Snapshot::summary() const {
+    char line[256];
+    std::snprintf(line, sizeof(line),
+                  "cb %.2fms avg / %.2fms p99 / %.2fms max (%.0f%% load) | xruns %llu under, %llu over, %llu starved | fill %.0f%% (min %.0f%%)",
+                  averageMicros() / 1000.0, percentileMicros(99.0) / 1000.0, maxNanos / 1e6, load() * 100.0,
+                  static_cast<unsigned long long>(underflows), static_cast<unsigned long long>(overflows),
+                  static_cast<unsigned long long>(starved), fillLevel * 100.0, minFillLevel * 100.0);
+    std::string result = line;
+    if (outputLatency > 0.0) {
+        std::snprintf(line, sizeof(line), " | latency %.1fms", outputLatency * 1000.0);
+        result += line;
+    }
+    return result;
+}
+
+/**
+ * Multi-line dump of the histogram, one non-empty bucket per line.
+ */
+std::string CallbackStats::Snapshot::histogramString() const {
+    std::string result;
+    char line[96];
+    for (size_t i = 0; i < BucketCount; ++i) {
+        if (!histogram[i]) continue;
+        const double share = callbacks ? 100.0 * histogram[i] / callbacks : 0.0;
+        if (i == BucketCount - 1) {
+            std::snprintf(line, sizeof(line), "  >= %6lluus: %10llu (%5.1f%%)\n",
+                          static_cast<unsigned long long>(bucketStartMicros(i)),
+                          static_cast<unsigned long long>(histogram[i]), share);
+        } else {
+            std::snprintf(line, sizeof(line), "  < %7lluus: %10llu (%5.1f%%)\n",
+                          static_cast<unsigned long long>(bucketStartMicros(i + 1)),
+                          static_cast<unsigned long long>(histogram[i]), share);
+        }
+        result += line;
+    }
+    return result;
+}
@@ -0,0 +1,85 @@
+#pragma once
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <portaudio.h>
+#include <string>
+
+/**
+ * Lock-free measurements of the audio callback, for tuning buffer sizes.
+ *
+ * Only the callback records (a handful of relaxed atomic adds per call - it never locks, allocates or logs);
+ * any thread may take a `snapshot()` at any time. Resetting while a stream runs may lose the callback in flight.
+ */
+class CallbackStats {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    // bucket i holds callbacks that took [2^i, 2^(i+1)) microseconds - the first also takes anything faster,
+    // the last anything slower (~32ms and up)
+    static constexpr size_t BucketCount = 16;
+
+    struct Snapshot {
+        uint64_t callbacks; // callbacks recorded
+        uint64_t underflows; // paOutputUnderflow - the device ran out of audio (audible gap)
+        uint64_t overflows; // paOutputOverflow - the device got more than it could take
+        uint64_t starved; // callbacks padded with silence because the decoder fell behind
+        uint64_t totalNanos; // time spent inside the callback
+        uint64_t maxNanos; // slowest callback
+        uint64_t periodNanos; // how long one callback's worth of audio lasts - the callback's deadline
+        double outputLatency; // seconds between the last callback and its audio reaching the DAC, if the host reports it
+        double fillLevel; // streaming ring buffer fill on the last callback, 0-1 (buffered tracks are always full)
+        double minFillLevel; // lowest fill seen
+        std::array<uint64_t, BucketCount> histogram;
+
+        [[nodiscard]] double averageMicros() const;
+        [[nodiscard]] double percentileMicros(double percentile) const;
+        [[nodiscard]] double load() const;
+        [[nodiscard]] std::string summary() const;
+        [[nodiscard]] std::string histogramString() const;
+    };
+
+    /**
+     * Times a callback from construction to destruction, and counts the status flags PortAudio passed it.
+     */
+    class Scope {
+    public:
+        Scope(CallbackStats &stats, PaStreamCallbackFlags statusFlags, const PaStreamCallbackTimeInfo *timeInfo);
+        ~Scope();
+
+        Scope(const Scope&) = delete;
+        Scope& operator=(const Scope&) = delete;
+
+    private:
+        CallbackStats &stats;
+        Clock::time_point start;
+    };
+
+    CallbackStats();
+
+    void recordFill(size_t available, size_t capacity);
+    void countStarved() { starved.fetch_add(1, std::memory_order_relaxed); };
+    void setPeriod(unsigned long framesPerBuffer, int sampleRate);
+    void reset();
+    [[nodiscard]] Snapshot snapshot() const;
+
+    CallbackStats(const CallbackStats&) = delete;
+    CallbackStats& operator=(const CallbackStats&) = delete;
+
+private:
+    void record(uint64_t nanos);
+
+    std::array<std::atomic<uint64_t>, BucketCount> histogram{};
+    std::atomic<uint64_t> callbacks{0};
+    std::atomic<uint64_t> underflows{0};
+    std::atomic<uint64_t> overflows{0};
+    std::atomic<uint64_t> starved{0};
+    std::atomic<uint64_t> totalNanos{0};
+    std::atomic<uint64_t> maxNanos{0};
+    std::atomic<uint64_t> periodNanos{0};
+    std::atomic<double> outputLatency{0.0};
+    std::atomic<uint32_t> fillPermille{1000};
+    std::atomic<uint32_t> minFillPermille{1000};
+};
@@ -0,0 +1,51 @@
+#include "latency.h"
+
+#include <algorithm>
+#include <cmath>
+
+/**
+ * Get the settings a profile stands for.
+ */
+LatencySettings LatencySettings::forProfile(const LatencyProfile profile) {
+    switch (profile) {
+        case LatencyProfile::LowLatency: return {256, false, 1.0, 1.0, std::chrono::milliseconds(5)};
+        case LatencyProfile::Balanced: return {1024, false, 3.0, 3.0, std::chrono::milliseconds(10)};
+        // decode in bursts, then sleep - the ring still holds seconds of audio when the decoder next looks
+        case LatencyProfile::PowerSaving: return {4096, true, 10.0, 4.0, std::chrono::milliseconds(250)};
+    }
+    return forProfile(LatencyProfile::Balanced);
+}
+
+const char *LatencySettings::name(const LatencyProfile profile) {
+    switch (profile) {
+        case LatencyProfile::LowLatency: return "low-latency";
+        case LatencyProfile::Balanced: return "balanced";
+        case LatencyProfile::PowerSaving: return "power-saving";
+    }
+    return "unknown";
+}
+
+/**
+ * Convert the decoder settings to samples of a track.
+ * @param sampleRate The rate the decoder's ring buffer holds
+ * @param channels The amount of interleaved channels
+ */
+StreamDecoder::Pacing LatencySettings::pacing(const int sampleRate, const int channels) const {
+    StreamDecoder::Pacing result;
+    result.aheadSamples = static_cast<size_t>(decodeAhead * sampleRate) * channels;
+    result.refillSamples = static_cast<size_t>(refillBelow * sampleRate) * channels;
+    result.poll = decoderPoll;
+    return result;
+}
+
+/**
+ * How many chunks a decoder's ring buffer needs to hold this profile's decode-ahead. Never fewer than Balanced
+ * needs, so switching to it mid-track always has room.
+ * @param sampleRate The rate the decoder's ring buffer holds
+ * @param chunkFrames The decoder's chunk size
+ */
+size_t LatencySettings::ringChunks(const int sampleRate, const size_t chunkFrames) const {
+    const double seconds = std::max(decodeAhead, forProfile(LatencyProfile::Balanced).decodeAhead);
+    // one more chunk than the decode-ahead, as the decoder only writes whole chunks
+    return static_cast<size_t>(std::ceil(seconds * sampleRate / chunkFrames)) + 1;
+}
@@ -0,0 +1,30 @@
+#pragma once
+#include <chrono>
+
+#include "streamdecoder.h"
+
+/**
+ * Trade-off between responsiveness and how often playback wakes the CPU.
+ */
+enum class LatencyProfile {
+    LowLatency, // 256 frame callbacks, 1s decoded ahead - snappy seeking and volume, ~4x the wakeups of Balanced
+    Balanced, // 1024 frame callbacks, 3s decoded ahead
+    PowerSaving // 4096 frame callbacks, 10s decoded ahead in bursts - for headless boxes
+};
+
+/**
+ * What a LatencyProfile sets up: the output stream's buffering, and how streaming decoders pace themselves.
+ */
+struct LatencySettings {
+    unsigned long framesPerBuffer; // frames handed to each audio callback
+    bool highLatency; // suggest the device's default high latency, rather than its low one
+    double decodeAhead; // seconds a streaming decoder keeps decoded ahead of the play head
+    double refillBelow; // seconds left before a topped up decoder starts decoding again
+    std::chrono::milliseconds decoderPoll; // how often an idle decoder checks on its ring buffer
+
+    static LatencySettings forProfile(LatencyProfile profile);
+    static const char *name(LatencyProfile profile);
+
+    [[nodiscard]] StreamDecoder::Pacing pacing(int sampleRate, int channels) const;
+    [[nodiscard]] size_t ringChunks(int sampleRate, size_t chunkFrames) const;
+};
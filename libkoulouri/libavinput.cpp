@@ -0,0 +1,251 @@
+#include "libavinput.h"
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libavutil/samplefmt.h>
+}
+
+#include "logger.h"
+
+namespace {
+
+// Interleave one decoded frame into 32-bit floats, whatever layout and sample type the codec produced.
+template<typename T, typename Convert>
+void interleave(const AVFrame *frame, const bool planar, const int channels, float *out, Convert convert) {
+    for (int i = 0; i < frame->nb_samples; ++i) {
+        for (int c = 0; c < channels; ++c) {
+            const T *sample = planar ? reinterpret_cast<const T *>(frame->extended_data[c]) + i
+                                     : reinterpret_cast<const T *>(frame->extended_data[0]) + i * channels + c;
+            *out++ = convert(*sample);
+        }
+    }
+}
+
+} // namespace
+
+/**
+ * Open a file and prepare its first audio stream for decoding.
+ * @param path The file to decode
+ */
+LibavInput::LibavInput(const std::string &path) {
+    // the destructor doesn't run if we throw, so free whatever was allocated so far first
+    auto fail = [this](const std::string &message) {
+        release();
+        return std::runtime_error(message);
+    };
+
+    if (avformat_open_input(&formatContext, path.c_str(), nullptr, nullptr) < 0) {
+        throw fail("libav could not open the file: " + path);
+    }
+    if (avformat_find_stream_info(formatContext, nullptr) < 0) {
+        throw fail("libav could not read stream info: " + path);
+    }
+
+    const AVCodec *codec = nullptr;
+    streamIndex = av_find_best_stream(formatContext, AVMEDIA_TYPE_AUDIO, -1, -1, &codec, 0);
+    if (streamIndex < 0 || !codec) throw fail("No decodable audio stream: " + path);
+
+    const AVStream *stream = formatContext->streams[streamIndex];
+    codecContext = avcodec_alloc_context3(codec);
+    if (!codecContext || avcodec_parameters_to_context(codecContext, stream->codecpar) < 0
+        || avcodec_open2(codecContext, codec, nullptr) < 0) {
+        throw fail("libav could not open the decoder: " + path);
+    }
+
+    packet = av_packet_alloc();
+    frame = av_frame_alloc();
+    if (!packet || !frame) throw fail("libav ran out of memory");
+
+    channels = codecContext->ch_layout.nb_channels;
+    sampleRate = codecContext->sample_rate;
+    if (channels <= 0 || sampleRate <= 0) throw fail("Audio stream has no channels/sample rate: " + path);
+
+    // libsndfile needs to know how long the stream is up front - take the container's word for it
+    if (stream->duration != AV_NOPTS_VALUE) {
+        totalFrames = av_rescale_q(stream->duration, stream->time_base, AVRational{1, sampleRate});
+    } else if (formatContext->duration != AV_NOPTS_VALUE) {
+        totalFrames = av_rescale(formatContext->duration, sampleRate, AV_TIME_BASE);
+    }
+    if (totalFrames <= 0) throw fail("Audio stream has no known duration: " + path);
+}
+
+LibavInput::~LibavInput() {
+    release();
+}
+
+void LibavInput::release() {
+    av_frame_free(&frame);
+    av_packet_free(&packet);
+    avcodec_free_context(&codecContext);
+    avformat_close_input(&formatContext);
+}
+
+/**
+ * Open the decoded audio with libsndfile.
+ *
+ * The returned handle reads from this object, so it must be closed (`sf_close`) before this object is destroyed.
+ * @param info Filled with the stream's details
+ * @return A libsndfile handle reading 32-bit float samples
+ */
+SNDFILE *LibavInput::open(SF_INFO &info) {
+    info = SF_INFO{};
+    info.samplerate = sampleRate;
+    info.channels = channels;
+    info.format = SF_FORMAT_RAW | SF_FORMAT_FLOAT | SF_ENDIAN_CPU;
+
+    io = {ioLength, ioSeek, ioRead, ioWrite, ioTell};
+    SNDFILE *file = sf_open_virtual(&io, SFM_READ, &info, this);
+    if (!file) throw std::runtime_error("libsndfile rejected the decoded stream: " + std::string(sf_strerror(nullptr)));
+    return file;
+}
+
+// virtual I/O - byte offsets into the (never materialized) stream of decoded samples
+
+sf_count_t LibavInput::ioLength(void *userData) {
+    const auto *self = static_cast<LibavInput *>(userData);
+    return self->totalFrames * self->channels * static_cast<sf_count_t>(sizeof(float));
+}
+
+sf_count_t LibavInput::ioSeek(const sf_count_t offset, const int whence, void *userData) {
+    auto *self = static_cast<LibavInput *>(userData);
+    sf_count_t target = offset;
+    if (whence == SEEK_CUR) target += self->position;
+    if (whence == SEEK_END) target += ioLength(userData);
+
+    if (target != self->position && !self->seekTo(std::max<sf_count_t>(target, 0))) {
+        return -1; // still where it was
+    }
+    return self->position;
+}
+
+sf_count_t LibavInput::ioRead(void *ptr, const sf_count_t count, void *userData) {
+    auto *self = static_cast<LibavInput *>(userData);
+    auto *out = static_cast<char *>(ptr);
+
+    sf_count_t copied = 0;
+    while (copied < count) {
+        if (self->pendingOffset >= self->pending.size()) {
+            if (!self->decodeFrame()) break; // end of stream
+            self->appendFrame();
+            continue;
+        }
+        const size_t available = self->pending.size() - self->pendingOffset;
+        const size_t toCopy = std::min(static_cast<size_t>(count - copied), available);
+        std::memcpy(out + copied, self->pending.data() + self->pendingOffset, toCopy);
+        self->pendingOffset += toCopy;
+        copied += static_cast<sf_count_t>(toCopy);
+    }
+
+    self->position += copied;
+    return copied;
+}
+
+sf_count_t LibavInput::ioWrite(const void *, sf_count_t, void *) {
+    return 0; // read only
+}
+
+sf_count_t LibavInput::ioTell(void *userData) {
+    return static_cast<LibavInput *>(userData)->position;
+}
+
+// Decode the next frame into `frame`. Returns false once the stream is exhausted.
+bool LibavInput::decodeFrame() {
+    while (true) {
+        const int received = avcodec_receive_frame(codecContext, frame);
+        if (received == 0) return true;
+        if (received != AVERROR(EAGAIN) || flushing) return false; // drained (or broken)
+
+        if (av_read_frame(formatContext, packet) < 0) {
+            flushing = true;
+            avcodec_send_packet(codecContext, nullptr); // no more packets - drain what the decoder holds
+            continue;
+        }
+        if (packet->stream_index == streamIndex) {
+            avcodec_send_packet(codecContext, packet); // a broken packet only costs us that packet
+        }
+        av_packet_unref(packet);
+    }
+}
+
+// Convert `frame` into interleaved floats at the end of `pending`.
+void LibavInput::appendFrame() {
+    if (pendingOffset >= pending.size()) {
+        pending.clear();
+        pendingOffset = 0;
+    }
+    if (frame->ch_layout.nb_channels != channels) {
+        Logger::g_log("libkoulouri", Logger::Level::WARNING, "libav", "Channel count changed mid-stream, dropping frame!");
+        return;
+    }
+
+    const size_t oldSize = pending.size();
+    pending.resize(oldSize + static_cast<size_t>(frame->nb_samples) * channels * sizeof(float));
+    float *out = reinterpret_cast<float *>(pending.data() + oldSize);
+
+    const auto format = static_cast<AVSampleFormat>(frame->format);
+    const bool planar = av_sample_fmt_is_planar(format);
+    switch (av_get_packed_sample_fmt(format)) {
+        case AV_SAMPLE_FMT_U8:
+            interleave<uint8_t>(frame, planar, channels, out, [](const uint8_t v) { return (v - 128) / 128.0f; });
+            break;
+        case AV_SAMPLE_FMT_S16:
+            interleave<int16_t>(frame, planar, channels, out, [](const int16_t v) { return v / 32768.0f; });
+            break;
+        case AV_SAMPLE_FMT_S32:
+            interleave<int32_t>(frame, planar, channels, out, [](const int32_t v) { return v / 2147483648.0f; });
+            break;
+        case AV_SAMPLE_FMT_S64:
+            interleave<int64_t>(frame, planar, channels, out, [](const int64_t v) { return v / 9223372036854775808.0f; });
+            break;
+        case AV_SAMPLE_FMT_FLT:
+            interleave<float>(frame, planar, channels, out, [](const float v) { return v; });
+            break;
+        case AV_SAMPLE_FMT_DBL:
+            interleave<double>(frame, planar, channels, out, [](const double v) { return static_cast<float>(v); });
+            break;
+        default:
+            Logger::g_log("libkoulouri", Logger::Level::WARNING, "libav", "Unsupported sample format, dropping frame!");
+            pending.resize(oldSize);
+            break;
+    }
+}
+
+// Move to a byte offset: seek the demuxer to the closest earlier point, then decode forwards up to the target.
+// Timestamps count from the stream's start time, frames from 0. Returns false (and stays put) if the demuxer can't seek.
+bool LibavInput::seekTo(const sf_count_t byte) {
+    const sf_count_t frameBytes = channels * static_cast<sf_count_t>(sizeof(float));
+    const sf_count_t targetFrame = byte / frameBytes;
+    const AVStream *stream = formatContext->streams[streamIndex];
+    const int64_t startTime = stream->start_time == AV_NOPTS_VALUE ? 0 : stream->start_time;
+
+    const int64_t timestamp = startTime + av_rescale_q(targetFrame, AVRational{1, sampleRate}, stream->time_base);
+    if (av_seek_frame(formatContext, streamIndex, timestamp, AVSEEK_FLAG_BACKWARD) < 0) {
+        Logger::g_log("libkoulouri", Logger::Level::ERROR, "libav", "Seek failed!");
+        return false;
+    }
+    avcodec_flush_buffers(codecContext);
+    pending.clear();
+    pendingOffset = 0;
+    flushing = false;
+    position = byte;
+
+    // the demuxer lands on a packet boundary at or before the target - drop whatever comes before it
+    while (decodeFrame()) {
+        const int64_t pts = frame->best_effort_timestamp;
+        const sf_count_t frameStart = pts == AV_NOPTS_VALUE
+            ? targetFrame
+            : av_rescale_q(pts - startTime, stream->time_base, AVRational{1, sampleRate});
+        if (frameStart + frame->nb_samples <= targetFrame) continue;
+
+        appendFrame();
+        pendingOffset = std::min(static_cast<size_t>(std::max<sf_count_t>(targetFrame - frameStart, 0) * frameBytes
+                                                     + byte % frameBytes), pending.size());
+        return true;
+    }
+    return true; // past the end - reads come back empty
+}
@@ -0,0 +1,57 @@
+#pragma once
+#include <cstdint>
+#include <sndfile.h>
+#include <string>
+#include <vector>
+
+struct AVFormatContext;
+struct AVCodecContext;
+struct AVPacket;
+struct AVFrame;
+
+/**
+ * In-process decoder for files libsndfile can't read (m4a, aac, wma, ...), built on libavformat/libavcodec.
+ *
+ * Decoded audio is handed to libsndfile as a raw 32-bit float stream through its virtual I/O interface, so the
+ * rest of the player (buffered reads, StreamDecoder, seeking) treats it like any other SNDFILE.
+ *
+ * Only available when libkoulouri is built with libav (HAS_LIBAV). Throws std::runtime_error if the file
+ * can't be opened or holds no decodable audio.
+ */
+class LibavInput {
+public:
+    explicit LibavInput(const std::string &path);
+    ~LibavInput();
+
+    LibavInput(const LibavInput&) = delete;
+    LibavInput& operator=(const LibavInput&) = delete;
+
+    SNDFILE *open(SF_INFO &info);
+
+private:
+    static sf_count_t ioLength(void *userData);
+    static sf_count_t ioSeek(sf_count_t offset, int whence, void *userData);
+    static sf_count_t ioRead(void *ptr, sf_count_t count, void *userData);
+    static sf_count_t ioWrite(const void *ptr, sf_count_t count, void *userData);
+    static sf_count_t ioTell(void *userData);
+
+    void release();
+    bool decodeFrame();
+    void appendFrame();
+    bool seekTo(sf_count_t byte);
+
+    AVFormatContext *formatContext = nullptr;
+    AVCodecContext *codecContext = nullptr;
+    AVPacket *packet = nullptr;
+    AVFrame *frame = nullptr;
+    int streamIndex = -1;
+    int channels = 0;
+    int sampleRate = 0;
+    sf_count_t totalFrames = 0; // estimated from the container's duration
+
+    std::vector<char> pending; // decoded (interleaved float) bytes not handed to libsndfile yet
+    size_t pendingOffset = 0;
+    sf_count_t position = 0; // byte offset of the next read
+    bool flushing = false; // demuxer is exhausted - draining the decoder
+    SF_VIRTUAL_IO io{};
+};
@@ -0,0 +1,221 @@
+#include "librarystore.h"
+
+#include <algorithm>
+#include <charconv>
+#include <cstring>
+#include <numeric>
+#include <stdexcept>
+
+namespace {
+// Track ids are hashes printed in hex (see generateTrackID()).
+uint64_t parseKey(const std::string_view id) {
+    uint64_t key = 0;
+    std::from_chars(id.data(), id.data() + id.size(), key, 16);
+    return key;
+}
+}
+
+StringPool::StringPool() {
+    strings.emplace_back();
+    ids.emplace(std::string_view(), 0);
+}
+
+/**
+ * The id of `value`, adding it if it's new.
+ */
+StringPool::Id StringPool::intern(const std::string_view value) {
+    if (const auto it = ids.find(value); it != ids.end()) return it->second;
+
+    char *stored;
+    if (value.size() > BlockSize / 4) {
+        // a block of its own - the current one is left as it is, rare enough not to matter
+        blocks.push_back(std::make_unique<char[]>(value.size()));
+        blockBytes += value.size();
+        blockUsed = BlockSize;
+        stored = blocks.back().get();
+    } else {
+        if (BlockSize - blockUsed < value.size()) {
+            blocks.push_back(std::make_unique<char[]>(BlockSize));
+            blockBytes += BlockSize;
+            blockUsed = 0;
+        }
+        stored = blocks.back().get() + blockUsed;
+        blockUsed += value.size();
+    }
+    std::memcpy(stored, value.data(), value.size());
+
+    const auto id = static_cast<Id>(strings.size());
+    strings.emplace_back(stored, value.size());
+    ids.emplace(strings.back(), id);
+    return id;
+}
+
+/**
+ * Every string's place in alphabetical order, by id - sorting on these compares integers instead of strings.
+ */
+std::vector<uint32_t> StringPool::ranks() const {
+    std::vector<Id> order(strings.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::sort(order.begin(), order.end(), [this](const Id a, const Id b) { return strings[a] < strings[b]; });
+
+    std::vector<uint32_t> rank(strings.size());
+    for (size_t i = 0; i < order.size(); i++) {
+        rank[order[i]] = static_cast<uint32_t>(i);
+    }
+    return rank;
+}
+
+/**
+ * Bytes held, roughly - the lookup table's nodes are estimated.
+ */
+size_t StringPool::memoryUsage() const {
+    return blockBytes + blocks.capacity() * sizeof(blocks[0]) + strings.capacity() * sizeof(std::string_view) +
+           ids.bucket_count() * sizeof(void*) + ids.size() * (sizeof(std::string_view) + sizeof(Id) + 2 * sizeof(void*));
+}
+
+
+std::string_view LibraryStore::TrackRef::filePath() const { return store->text(store->paths[row]); }
+std::string_view LibraryStore::TrackRef::title() const { return store->text(store->titles[row]); }
+std::string_view LibraryStore::TrackRef::artist() const { return store->pool[store->artists[row]]; }
+std::string_view LibraryStore::TrackRef::album() const { return store->pool[store->albums[row]]; }
+std::string_view LibraryStore::TrackRef::genre() const { return store->pool[store->genres[row]]; }
+int LibraryStore::TrackRef::trackNumber() const { return store->trackNumbers[row]; }
+uint64_t LibraryStore::TrackRef::key() const { return store->keys[row]; }
+
+std::string LibraryStore::TrackRef::id() const {
+    char buffer[16];
+    const auto result = std::to_chars(buffer, buffer + sizeof(buffer), store->keys[row], 16);
+    return {buffer, result.ptr};
+}
+
+/**
+ * Snapshot every track in a cache. A cache that's still only a loaded file is read straight from the mapping.
+ */
+LibraryStore::LibraryStore(const MetaCache &cache) {
+    if (const MetaCacheFile *file = cache.mappedFile()) {
+        addAll(*file);
+        return;
+    }
+    reserve(cache.getCache().size());
+    for (const auto &[id, track] : cache.getCache()) {
+        add(track.filePath, track.title, track.artist, track.album, track.genre, track.id, track.trackNumber);
+    }
+    sortKeys();
+}
+
+/**
+ * Load straight from a cache file, without going through Track objects - the quickest way to a browsable library
+ * on startup.
+ */
+LibraryStore::LibraryStore(const MetaCacheFile &file) {
+    addAll(file);
+}
+
+/**
+ * Look a track up by its id (as in Track::id).
+ */
+std::optional<LibraryStore::TrackRef> LibraryStore::find(const std::string_view id) const {
+    const uint64_t key = parseKey(id);
+    const auto it = std::lower_bound(keyOrder.begin(), keyOrder.end(), key,
+                                     [this](const Index row, const uint64_t value) { return keys[row] < value; });
+    if (it == keyOrder.end() || keys[*it] != key) return std::nullopt;
+    return (*this)[*it];
+}
+
+/**
+ * Sort the store via a custom callback.
+ * @param key Whether the first track goes before the second
+ * @return Every track's index, in order
+ */
+std::vector<LibraryStore::Index> LibraryStore::sortBy(const std::function<bool(const TrackRef&, const TrackRef&)> &key) const {
+    std::vector<Index> order(size());
+    std::iota(order.begin(), order.end(), 0);
+    std::sort(order.begin(), order.end(), [&](const Index a, const Index b) { return key((*this)[a], (*this)[b]); });
+    return order;
+}
+
+/**
+ * Every track's index, by artist, then album, then track number. Sorts packed integer keys built from the
+ * artists' and albums' alphabetical ranks, so strings are only compared to break ties between titles.
+ */
+std::vector<LibraryStore::Index> LibraryStore::sortByArtist() const {
+    struct SortKey {
+        uint64_t group; // artist rank, then album rank
+        int32_t trackNumber;
+        Index row;
+    };
+
+    const std::vector<uint32_t> rank = pool.ranks();
+    std::vector<SortKey> sortKeys(size());
+    for (Index row = 0; row < size(); row++) {
+        sortKeys[row] = {static_cast<uint64_t>(rank[artists[row]]) << 32 | rank[albums[row]], trackNumbers[row], row};
+    }
+    std::sort(sortKeys.begin(), sortKeys.end(), [this](const SortKey &a, const SortKey &b) {
+        if (a.group != b.group) return a.group < b.group;
+        if (a.trackNumber != b.trackNumber) return a.trackNumber < b.trackNumber;
+        return text(titles[a.row]) < text(titles[b.row]);
+    });
+
+    std::vector<Index> order(size());
+    for (size_t i = 0; i < sortKeys.size(); i++) {
+        order[i] = sortKeys[i].row;
+    }
+    return order;
+}
+
+/**
+ * Bytes held by the store, roughly.
+ */
+size_t LibraryStore::memoryUsage() const {
+    return pool.memoryUsage() + textData.capacity() +
+           paths.capacity() * sizeof(Text) + titles.capacity() * sizeof(Text) +
+           (artists.capacity() + albums.capacity() + genres.capacity()) * sizeof(StringPool::Id) +
+           trackNumbers.capacity() * sizeof(int32_t) + keys.capacity() * sizeof(uint64_t) +
+           keyOrder.capacity() * sizeof(Index);
+}
+
+void LibraryStore::reserve(const size_t tracks) {
+    paths.reserve(tracks);
+    titles.reserve(tracks);
+    artists.reserve(tracks);
+    albums.reserve(tracks);
+    genres.reserve(tracks);
+    trackNumbers.reserve(tracks);
+    keys.reserve(tracks);
+    keyOrder.reserve(tracks);
+}
+
+void LibraryStore::addAll(const MetaCacheFile &file) {
+    reserve(file.size());
+    for (size_t i = 0; i < file.size(); i++) {
+        const MetaCacheFile::Entry entry = file[i];
+        add(entry.filePath, entry.title, entry.artist, entry.album, entry.genre, entry.id, entry.trackNumber);
+    }
+    sortKeys();
+}
+
+void LibraryStore::sortKeys() {
+    std::sort(keyOrder.begin(), keyOrder.end(), [this](const Index a, const Index b) { return keys[a] < keys[b]; });
+}
+
+void LibraryStore::add(const std::string_view filePath, const std::string_view title, const std::string_view artist,
+                       const std::string_view album, const std::string_view genre, const std::string_view id,
+                       const int trackNumber) {
+    keyOrder.push_back(static_cast<Index>(keys.size()));
+    paths.push_back(append(filePath));
+    titles.push_back(append(title));
+    artists.push_back(pool.intern(artist));
+    albums.push_back(pool.intern(album));
+    genres.push_back(pool.intern(genre));
+    trackNumbers.push_back(trackNumber);
+    keys.push_back(parseKey(id));
+}
+
+LibraryStore::Text LibraryStore::append(const std::string_view value) {
+    if (textData.size() + value.size() > UINT32_MAX) {
+        throw std::runtime_error("Library too large for a LibraryStore: paths and titles exceed 4 GiB");
+    }
+    const Text at{static_cast<uint32_t>(textData.size()), static_cast<uint32_t>(value.size())};
+    textData.append(value);
+    return at;
+}
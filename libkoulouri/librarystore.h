@@ -0,0 +1,127 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "metacachefile.h"
+#include "metahandler.h"
+
+/**
+ * Stores every distinct string once and hands out small ids for them. Id 0 is always the empty string.
+ *
+ * Strings live in fixed blocks that never move, so the views handed out stay valid as long as the pool does.
+ */
+class StringPool {
+public:
+    using Id = uint32_t;
+
+    StringPool();
+
+    StringPool(const StringPool&) = delete;
+    StringPool& operator=(const StringPool&) = delete;
+    StringPool(StringPool&&) = default;
+    StringPool& operator=(StringPool&&) = default;
+
+    Id intern(std::string_view value);
+    [[nodiscard]] std::string_view operator[](Id id) const { return strings[id]; };
+    [[nodiscard]] size_t size() const { return strings.size(); };
+
+    [[nodiscard]] std::vector<uint32_t> ranks() const;
+    [[nodiscard]] size_t memoryUsage() const;
+
+    static constexpr size_t BlockSize = 64 * 1024;
+
+private:
+    std::vector<std::unique_ptr<char[]>> blocks;
+    size_t blockUsed = BlockSize; // of the last block - full, so the first string allocates one
+    size_t blockBytes = 0; // allocated, over every block
+    std::vector<std::string_view> strings; // id -> string, pointing into `blocks`
+    std::unordered_map<std::string_view, Id> ids;
+};
+
+/**
+ * A compact, read-only snapshot of a library, for browsing it.
+ *
+ * Tracks are rows across contiguous columns (structure of arrays): artists, albums and genres are interned into a
+ * StringPool and stored as ids, paths and titles are packed into one text buffer, and ids are kept as the 64-bit
+ * hashes they're printed from. A track costs 44 bytes plus its path and title, against several hundred for
+ * a Track in a MetaCache, and sorting or filtering only touches the columns involved.
+ *
+ * The store doesn't follow the cache - build a new one after the cache changes. Throws std::runtime_error if the
+ * paths and titles add up to more than 4 GiB.
+ */
+class LibraryStore {
+public:
+    using Index = uint32_t;
+
+    /**
+     * A track in the store - a pointer and a row, cheap to copy. Valid as long as the store is, and isn't moved.
+     */
+    class TrackRef {
+    public:
+        [[nodiscard]] std::string_view filePath() const;
+        [[nodiscard]] std::string_view title() const;
+        [[nodiscard]] std::string_view artist() const;
+        [[nodiscard]] std::string_view album() const;
+        [[nodiscard]] std::string_view genre() const;
+        [[nodiscard]] int trackNumber() const;
+        [[nodiscard]] uint64_t key() const; // the id, as a number
+        [[nodiscard]] std::string id() const; // as in Track::id
+        [[nodiscard]] Index index() const { return row; };
+
+    private:
+        friend class LibraryStore;
+        TrackRef(const LibraryStore *store, const Index row) : store(store), row(row) {};
+
+        const LibraryStore *store;
+        Index row;
+    };
+
+    LibraryStore() = default;
+    explicit LibraryStore(const MetaCache &cache);
+    explicit LibraryStore(const MetaCacheFile &file);
+
+    [[nodiscard]] size_t size() const { return keys.size(); };
+    [[nodiscard]] TrackRef operator[](const Index index) const { return {this, index}; };
+    [[nodiscard]] std::optional<TrackRef> find(std::string_view id) const;
+
+    [[nodiscard]] std::vector<Index> sortBy(const std::function<bool(const TrackRef&, const TrackRef&)> &key) const;
+    [[nodiscard]] std::vector<Index> sortByArtist() const;
+
+    [[nodiscard]] const StringPool &names() const { return pool; };
+    [[nodiscard]] size_t memoryUsage() const;
+
+private:
+    struct Text {
+        uint32_t offset;
+        uint32_t length;
+    };
+
+    void reserve(size_t tracks);
+    void addAll(const MetaCacheFile &file);
+    void sortKeys();
+    void add(std::string_view filePath, std::string_view title, std::string_view artist, std::string_view album,
+             std::string_view genre, std::string_view id, int trackNumber);
+    Text append(std::string_view value);
+    [[nodiscard]] std::string_view text(const Text &at) const { return {textData.data() + at.offset, at.length}; };
+
+    StringPool pool; // artists, albums and genres
+
+    // one entry per track, in every column
+    std::vector<Text> paths;
+    std::vector<Text> titles;
+    std::vector<StringPool::Id> artists;
+    std::vector<StringPool::Id> albums;
+    std::vector<StringPool::Id> genres;
+    std::vector<int32_t> trackNumbers;
+    std::vector<uint64_t> keys;
+
+    std::string textData; // paths and titles, back to back
+    std::vector<Index> keyOrder; // rows sorted by key, for `find()`
+};
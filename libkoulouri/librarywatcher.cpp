@@ -0,0 +1,243 @@
+#include "librarywatcher.h"
+
+#include <cerrno>
+#include <climits>
+#include <cstring>
+#include <filesystem>
+#include <poll.h>
+#include <stdexcept>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+#include "logger.h"
+
+namespace fs = std::filesystem;
+
+namespace {
+// directories report everything that can add, change or remove a track below them
+constexpr uint32_t watchMask = IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO |
+                               IN_DELETE_SELF | IN_ONLYDIR;
+}
+
+/**
+ * Start watching. The cache isn't touched until `apply()` is called.
+ * @param roots The music directories to watch, recursively
+ */
+LibraryWatcher::LibraryWatcher(std::vector<std::string> roots) : roots(std::move(roots)) {
+    fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (fd == -1) {
+        throw std::runtime_error(std::string("inotify_init1 failed: ") + strerror(errno));
+    }
+    for (std::string &root : this->roots) {
+        // events report paths built from the watched directory - keep them in the same shape as the scanned ones
+        while (root.size() > 1 && root.back() == '/') root.pop_back();
+        watchTree(root, false);
+    }
+    lastEvent = Clock::now();
+    worker = std::thread(&LibraryWatcher::run, this);
+}
+
+LibraryWatcher::~LibraryWatcher() {
+    running.store(false);
+    if (worker.joinable()) {
+        worker.join();
+    }
+    close(fd); // drops every watch along with it
+}
+
+/**
+ * @brief Merge what changed on disk into the cache.
+ *
+ * Does nothing until no event has come in for the settle time (half a second by default), so a copy or a tag
+ * editor's burst of writes is handled as one batch, and files aren't read while they're still being written.
+ * Call from the thread that owns `cache`.
+ * @param handler Reads the tags of new and changed files
+ * @param cache The cache to update
+ * @return What changed
+ */
+LibraryWatcher::Batch LibraryWatcher::apply(MetaHandler &handler, MetaCache &cache) {
+    std::unordered_set<std::string> changedFiles, removedFiles;
+    std::vector<std::string> trees;
+    bool rescan = false;
+    {
+        std::lock_guard lock(mutex);
+        if (Clock::now() - lastEvent < settleTime.load()) return {};
+        changedFiles.swap(changed);
+        removedFiles.swap(removed);
+        trees.swap(removedTrees);
+        std::swap(rescan, overflowed);
+    }
+
+    Batch batch;
+    if (rescan) {
+        // events were lost - only a walk can tell what happened, but file stamps keep it to the changed files
+        Logger::g_log("libkoulouri", Logger::Level::WARNING, "watcher", "inotify queue overflowed - rescanning library...");
+        for (const std::string &root : roots) {
+            std::error_code error;
+            if (fs::is_directory(root, error)) {
+                handler.populateMetaCache(root, &cache, nullptr, MetaHandler::ScanMode::Incremental);
+            }
+        }
+        batch.rescanned = true;
+    }
+
+    for (const std::string &tree : trees) {
+        batch.removed += cache.removeFiles([&](const std::string &path) { return MetaHandler::isInside(path, tree); });
+    }
+    if (!removedFiles.empty()) {
+        batch.removed += cache.removeFiles([&](const std::string &path) { return removedFiles.count(path) > 0; });
+    }
+    if (!changedFiles.empty()) {
+        const std::vector<std::string> files(changedFiles.begin(), changedFiles.end());
+        handler.refreshFiles(files, &cache);
+        batch.refreshed = files.size();
+    }
+
+    if (!batch.empty()) {
+        Logger::g_log("libkoulouri", Logger::Level::DEBUG, "watcher", "Applied library changes: " +
+                      std::to_string(batch.refreshed) + " refreshed, " + std::to_string(batch.removed) + " removed");
+    }
+    return batch;
+}
+
+/**
+ * Whether anything is waiting for `apply()`, settled or not.
+ */
+bool LibraryWatcher::pending() const {
+    std::lock_guard lock(mutex);
+    return !changed.empty() || !removed.empty() || !removedTrees.empty() || overflowed;
+}
+
+/**
+ * How many directories are being watched. Each costs a kernel watch (see /proc/sys/fs/inotify/max_user_watches).
+ */
+size_t LibraryWatcher::watchCount() const {
+    std::lock_guard lock(watchesMutex);
+    return watches.size();
+}
+
+void LibraryWatcher::run() {
+    // room for a batch of events, names included
+    alignas(inotify_event) char buffer[64 * (sizeof(inotify_event) + NAME_MAX + 1)];
+    pollfd descriptor{fd, POLLIN, 0};
+
+    while (running.load()) {
+        // wake up now and then to check whether we're done - cheaper than a second descriptor to poll on
+        const int ready = poll(&descriptor, 1, 250);
+        if (ready <= 0) continue;
+
+        while (true) {
+            const ssize_t length = read(fd, buffer, sizeof(buffer));
+            if (length <= 0) break; // EAGAIN - drained
+            handleEvents(buffer, static_cast<size_t>(length));
+        }
+    }
+}
+
+void LibraryWatcher::handleEvents(const char *buffer, const size_t length) {
+    for (size_t offset = 0; offset < length;) {
+        const auto *event = reinterpret_cast<const inotify_event*>(buffer + offset);
+        offset += sizeof(inotify_event) + event->len;
+
+        if (event->mask & IN_Q_OVERFLOW) {
+            {
+                std::lock_guard lock(mutex);
+                overflowed = true;
+                lastEvent = Clock::now();
+            }
+            // directories created while events were being dropped have no watch yet
+            for (const std::string &root : roots) {
+                watchTree(root, false);
+            }
+            continue;
+        }
+
+        std::string directory;
+        {
+            const auto watch = watches.find(event->wd);
+            if (watch == watches.end()) continue; // already unwatched
+            directory = watch->second;
+        }
+        if (event->mask & IN_IGNORED) { // the watch is gone - removed, or its directory deleted
+            std::lock_guard lock(watchesMutex);
+            watches.erase(event->wd);
+            continue;
+        }
+        if (event->len == 0) continue; // about the directory itself - its parent reports what matters
+
+        const std::string path = directory + "/" + event->name;
+        if (event->mask & IN_ISDIR) {
+            if (event->mask & (IN_CREATE | IN_MOVED_TO)) {
+                watchTree(path, true);
+            } else if (event->mask & (IN_DELETE | IN_MOVED_FROM)) {
+                // a moved directory keeps its watches, under a path that no longer exists - drop them all
+                unwatchTree(path);
+                std::lock_guard lock(mutex);
+                removedTrees.push_back(path);
+                lastEvent = Clock::now();
+            }
+        } else if (event->mask & (IN_CLOSE_WRITE | IN_MOVED_TO)) {
+            fileChanged(path);
+        } else if (event->mask & IN_CREATE) {
+            // hard links and empty files never get written - wait for the write if there is one, the settle time covers it
+            fileChanged(path);
+        } else if (event->mask & (IN_DELETE | IN_MOVED_FROM)) {
+            fileRemoved(path);
+        }
+    }
+}
+
+// Watch `directory` and everything below it. With `announce`, every file found is queued as changed - they may
+// have been created before the watch was in place.
+void LibraryWatcher::watchTree(const std::string &directory, const bool announce) {
+    auto watch = [&](const std::string &path) {
+        const int wd = inotify_add_watch(fd, path.c_str(), watchMask);
+        if (wd == -1) {
+            Logger::g_log("libkoulouri", Logger::Level::WARNING, "watcher",
+                          "Can't watch " + path + ": " + strerror(errno));
+            return;
+        }
+        std::lock_guard lock(watchesMutex);
+        watches[wd] = path;
+    };
+
+    std::error_code error;
+    if (!fs::is_directory(directory, error)) return;
+    watch(directory);
+    for (auto it = fs::recursive_directory_iterator(directory, fs::directory_options::skip_permission_denied, error);
+         !error && it != fs::recursive_directory_iterator(); it.increment(error)) {
+        if (it->is_directory(error)) {
+            watch(it->path().string());
+        } else if (announce && it->is_regular_file(error)) {
+            fileChanged(it->path().string());
+        }
+    }
+}
+
+void LibraryWatcher::unwatchTree(const std::string &directory) {
+    std::lock_guard lock(watchesMutex);
+    for (auto it = watches.begin(); it != watches.end();) {
+        if (MetaHandler::isInside(it->second, directory)) {
+            inotify_rm_watch(fd, it->first);
+            it = watches.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+void LibraryWatcher::fileChanged(const std::string &path) {
+    if (!MetaHandler::isSupported(path)) return;
+    std::lock_guard lock(mutex);
+    removed.erase(path);
+    changed.insert(path);
+    lastEvent = Clock::now();
+}
+
+void LibraryWatcher::fileRemoved(const std::string &path) {
+    if (!MetaHandler::isSupported(path)) return;
+    std::lock_guard lock(mutex);
+    changed.erase(path);
+    removed.insert(path);
+    lastEvent = Clock::now();
+}
@@ -0,0 +1,77 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "metahandler.h"
+
+/**
+ * Keeps a MetaCache in step with the music directories on disk, through inotify.
+ *
+ * A background thread watches every directory below the roots (adding watches as directories appear) and collects
+ * what changed. Nothing touches the cache from there: frontends call `apply()` from their own thread - on a timer,
+ * or in their main loop - which merges everything that has settled since the last call in one batch. If the
+ * kernel's event queue overflows, the batch falls back to an incremental rescan of the roots.
+ *
+ * Throws std::runtime_error if inotify isn't available.
+ */
+class LibraryWatcher {
+public:
+    /**
+     * What an `apply()` call did to the cache.
+     */
+    struct Batch {
+        size_t refreshed = 0; // files re-read, as they were added, changed or moved in
+        size_t removed = 0; // tracks removed
+        bool rescanned = false; // the roots were rescanned, as events were lost - the counts above don't include it
+
+        [[nodiscard]] bool empty() const { return refreshed == 0 && removed == 0 && !rescanned; };
+    };
+
+    explicit LibraryWatcher(std::vector<std::string> roots);
+    ~LibraryWatcher();
+
+    LibraryWatcher(const LibraryWatcher&) = delete;
+    LibraryWatcher& operator=(const LibraryWatcher&) = delete;
+
+    Batch apply(MetaHandler &handler, MetaCache &cache);
+    [[nodiscard]] bool pending() const;
+
+    void setSettleTime(std::chrono::milliseconds time) { settleTime.store(time); };
+    [[nodiscard]] size_t watchCount() const;
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    void run();
+    void handleEvents(const char *buffer, size_t length);
+    void watchTree(const std::string &directory, bool announce);
+    void unwatchTree(const std::string &directory);
+    void fileChanged(const std::string &path);
+    void fileRemoved(const std::string &path);
+
+    std::vector<std::string> roots;
+    int fd = -1;
+
+    // owned by the watcher thread
+    std::unordered_map<int, std::string> watches; // watch descriptor -> directory
+    mutable std::mutex watchesMutex; // only for `watchCount()`
+
+    // handed over to `apply()`
+    mutable std::mutex mutex;
+    std::unordered_set<std::string> changed; // files to (re)read
+    std::unordered_set<std::string> removed; // files to drop
+    std::vector<std::string> removedTrees; // directories whose files to drop
+    bool overflowed = false;
+    Clock::time_point lastEvent;
+    std::atomic<std::chrono::milliseconds> settleTime{std::chrono::milliseconds(500)};
+
+    std::atomic<bool> running{true};
+    std::thread worker;
+};
@@ -0,0 +1,105 @@
+#include "mappedfile.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/**
+ * Map `length` bytes of a file, starting at `offset`.
+ *
+ * The mapping is advised for sequential access, and the first few megabytes are read ahead right away.
+ * @param path The file to map
+ * @param offset Where the region starts, in bytes (doesn't have to be page aligned)
+ * @param length The size of the region, in bytes
+ */
+MappedFile::MappedFile(const std::string &path, const size_t offset, const size_t length) : length(length) {
+    const int fd = open(path.c_str(), O_RDONLY);
+    if (fd == -1) throw std::runtime_error("Failed to open file for mapping: " + path);
+
+    struct stat st{};
+    if (fstat(fd, &st) == -1 || offset + length > static_cast<size_t>(st.st_size)) {
+        close(fd);
+        throw std::runtime_error("Mapped region is past the end of the file: " + path);
+    }
+
+    // mmap wants a page aligned offset - map from the page the region starts in
+    const size_t pageSize = sysconf(_SC_PAGESIZE);
+    const size_t alignedOffset = offset - offset % pageSize;
+    mappedLength = length + (offset - alignedOffset);
+
+    base = mmap(nullptr, mappedLength, PROT_READ, MAP_PRIVATE, fd, static_cast<off_t>(alignedOffset));
+    close(fd); // the mapping keeps its own reference to the file
+    if (base == MAP_FAILED) {
+        base = nullptr;
+        throw std::runtime_error("Failed to map file: " + path);
+    }
+    start = static_cast<const char *>(base) + (offset - alignedOffset);
+
+    madvise(base, mappedLength, MADV_SEQUENTIAL);
+    prefetch(0);
+}
+
+MappedFile::~MappedFile() {
+    if (base) {
+        munmap(base, mappedLength);
+    }
+}
+
+/**
+ * Ask the kernel to start reading part of the region in the background (e.g. right after a seek), so touching
+ * it later doesn't have to wait for the disk.
+ * @param offset Where to start, in bytes from the start of the region
+ * @param bytes How much to read ahead
+ */
+void MappedFile::prefetch(size_t offset, size_t bytes) const {
+    if (!base || offset >= length) return;
+    bytes = std::min(bytes, length - offset);
+
+    // madvise wants a page aligned address as well
+    const size_t pageSize = sysconf(_SC_PAGESIZE);
+    const auto address = reinterpret_cast<uintptr_t>(start + offset);
+    const uintptr_t aligned = address - address % pageSize;
+    madvise(reinterpret_cast<void *>(aligned), bytes + (address - aligned), MADV_WILLNEED);
+}
+
+/**
+ * Locate the sample data of a RIFF/WAVE file.
+ * @param path The file to search
+ * @param offset Set to where the 'data' chunk's samples start, in bytes
+ * @param length Set to the size of the 'data' chunk, in bytes
+ * @return Whether a 'data' chunk was found
+ */
+bool MappedFile::findWavData(const std::string &path, size_t &offset, size_t &length) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file) return false;
+
+    // chunk sizes are always little endian
+    auto readU32 = [](const unsigned char *bytes) {
+        return static_cast<uint32_t>(bytes[0]) | static_cast<uint32_t>(bytes[1]) << 8 |
+               static_cast<uint32_t>(bytes[2]) << 16 | static_cast<uint32_t>(bytes[3]) << 24;
+    };
+
+    unsigned char header[12];
+    if (!file.read(reinterpret_cast<char *>(header), sizeof(header))) return false;
+    if (std::memcmp(header, "RIFF", 4) != 0 || std::memcmp(header + 8, "WAVE", 4) != 0) return false;
+
+    size_t position = sizeof(header);
+    unsigned char chunk[8];
+    while (file.read(reinterpret_cast<char *>(chunk), sizeof(chunk))) {
+        const uint32_t chunkSize = readU32(chunk + 4);
+        if (std::memcmp(chunk, "data", 4) == 0) {
+            offset = position + sizeof(chunk);
+            length = chunkSize;
+            return true;
+        }
+        position += sizeof(chunk) + chunkSize + (chunkSize & 1); // chunks are padded to an even size
+        file.seekg(static_cast<std::streamoff>(position));
+    }
+    return false;
+}
@@ -0,0 +1,35 @@
+#pragma once
+#include <cstddef>
+#include <string>
+
+/**
+ * Read-only memory mapping of a region of a file.
+ *
+ * Pages are only read from disk once touched, so mapping is constant time regardless of the region's size,
+ * and the memory is shared with the page cache instead of being copied onto the heap.
+ *
+ * Throws std::runtime_error if the file can't be opened or mapped.
+ */
+class MappedFile {
+public:
+    MappedFile(const std::string &path, size_t offset, size_t length);
+    ~MappedFile();
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    [[nodiscard]] const void *data() const { return start; };
+    [[nodiscard]] size_t size() const { return length; };
+
+    static constexpr size_t readAhead = 8 * 1024 * 1024; // enough for playback to start without waiting on the disk
+
+    void prefetch(size_t offset, size_t bytes = readAhead) const;
+
+    static bool findWavData(const std::string &path, size_t &offset, size_t &length);
+
+private:
+    void *base = nullptr; // page aligned start of the mapping
+    size_t mappedLength = 0;
+    const char *start = nullptr; // start of the requested region, inside the mapping
+    size_t length = 0;
+};
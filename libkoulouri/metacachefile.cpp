@@ -0,0 +1,240 @@
+#include "metacachefile.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <stdexcept>
+#include <vector>
+
+namespace {
+constexpr char fileMagic[8] = {'K', 'O', 'U', 'L', 'M', 'E', 'T', 'A'};
+constexpr uint32_t byteOrderMark = 0x01020304; // reads back differently on a machine of the other endianness
+
+struct Header {
+    char magic[8];
+    uint32_t version;
+    uint32_t byteOrder;
+    uint64_t fileSize; // the whole file - anything else means it was cut short
+    uint64_t trackCount;
+    uint64_t recordsOffset;
+    uint64_t stringsOffset;
+    uint64_t stringsSize;
+    uint64_t checksum; // of everything after the header
+};
+static_assert(sizeof(Header) == 64);
+
+// Strings are offsets into the string table, each pointing at a 32-bit length followed by the bytes.
+struct Record {
+    uint32_t filePath;
+    uint32_t title;
+    uint32_t artist;
+    uint32_t album;
+    uint32_t genre;
+    uint32_t id;
+    int32_t trackNumber;
+    uint32_t reserved; // keeps the stamp 8-byte aligned
+    int64_t mtime;
+    uint64_t size;
+    uint64_t inode;
+};
+static_assert(sizeof(Record) == 56);
+
+// FNV-1a, a word at a time - only guards against damage, and has to keep up with the disk on a cold start
+uint64_t checksum(const unsigned char *data, const size_t size) {
+    uint64_t hash = 14695981039346656037ull;
+    size_t i = 0;
+    for (; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t)) {
+        uint64_t word;
+        std::memcpy(&word, data + i, sizeof(word));
+        hash = (hash ^ word) * 1099511628211ull;
+    }
+    for (; i < size; i++) {
+        hash = (hash ^ data[i]) * 1099511628211ull;
+    }
+    return hash;
+}
+
+std::runtime_error invalid(const std::string &path, const std::string &reason) {
+    return std::runtime_error(path + ": " + reason);
+}
+}
+
+/**
+ * Map a cache file and check it's whole. Only the header and checksum are read - records are decoded when asked for.
+ * @param path The cache file, as written by `write()`
+ */
+MetaCacheFile::MetaCacheFile(const std::string &path) {
+    std::error_code error;
+    const uintmax_t fileSize = std::filesystem::file_size(path, error);
+    if (error) throw invalid(path, error.message());
+    if (fileSize < sizeof(Header)) throw invalid(path, "too short for a cache header");
+
+    file = std::make_unique<MappedFile>(path, 0, fileSize);
+    const auto *data = static_cast<const unsigned char*>(file->data());
+
+    Header header{};
+    std::memcpy(&header, data, sizeof(header));
+    if (!std::equal(fileMagic, fileMagic + sizeof(fileMagic), header.magic)) throw invalid(path, "not a cache file");
+    if (header.byteOrder != byteOrderMark) throw invalid(path, "written on a machine with another byte order");
+    if (header.version != Version) throw invalid(path, "cache version " + std::to_string(header.version) +
+                                                       ", expected " + std::to_string(Version));
+    if (header.fileSize != fileSize) throw invalid(path, "truncated (" + std::to_string(fileSize) + " of " +
+                                                         std::to_string(header.fileSize) + " bytes)");
+    if (header.recordsOffset < sizeof(Header) || header.trackCount > (fileSize - header.recordsOffset) / sizeof(Record) ||
+        header.stringsOffset < header.recordsOffset + header.trackCount * sizeof(Record) ||
+        header.stringsOffset > fileSize || header.stringsSize != fileSize - header.stringsOffset) {
+        throw invalid(path, "inconsistent layout");
+    }
+    if (checksum(data + sizeof(Header), fileSize - sizeof(Header)) != header.checksum) {
+        throw invalid(path, "checksum mismatch");
+    }
+
+    records = data + header.recordsOffset;
+    strings = data + header.stringsOffset;
+    stringsSize = header.stringsSize;
+    count = static_cast<size_t>(header.trackCount);
+}
+
+/**
+ * Decode the track at `index`, from 0 to `size()`. Tracks are in id order.
+ */
+MetaCacheFile::Entry MetaCacheFile::operator[](const size_t index) const {
+    Record record{};
+    std::memcpy(&record, records + index * sizeof(Record), sizeof(record));
+
+    Entry entry;
+    entry.filePath = string(record.filePath);
+    entry.title = string(record.title);
+    entry.artist = string(record.artist);
+    entry.album = string(record.album);
+    entry.genre = string(record.genre);
+    entry.id = string(record.id);
+    entry.trackNumber = record.trackNumber;
+    entry.stamp.mtime = record.mtime;
+    entry.stamp.size = record.size;
+    entry.stamp.inode = record.inode;
+    return entry;
+}
+
+/**
+ * Look a track up by id, without decoding any other. Binary search, so O(log n) touched pages.
+ */
+std::optional<MetaCacheFile::Entry> MetaCacheFile::find(const std::string_view id) const {
+    size_t low = 0, high = count;
+    while (low < high) {
+        const size_t middle = low + (high - low) / 2;
+        uint32_t offset;
+        std::memcpy(&offset, records + middle * sizeof(Record) + offsetof(Record, id), sizeof(offset));
+        const std::string_view candidate = string(offset);
+        if (candidate == id) return (*this)[middle];
+        if (candidate < id) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return std::nullopt;
+}
+
+// The checksum vouches for the contents, but a bad offset still mustn't read past the mapping.
+std::string_view MetaCacheFile::string(const uint32_t offset) const {
+    uint32_t length;
+    if (offset > stringsSize || stringsSize - offset < sizeof(length)) return {};
+    std::memcpy(&length, strings + offset, sizeof(length));
+    if (length > stringsSize - offset - sizeof(length)) return {};
+    return {reinterpret_cast<const char*>(strings + offset + sizeof(length)), length};
+}
+
+/**
+ * @brief Write tracks out as a cache file.
+ *
+ * The file is built next to `path` and renamed over it once complete, so a crash mid-write leaves the old cache
+ * in place rather than a partial one.
+ * @param path Where to write the cache
+ * @param tracks The tracks to store, keyed by id
+ * @return Whether the file was written
+ */
+bool MetaCacheFile::write(const std::string &path, const std::unordered_map<std::string, Track> &tracks) {
+    std::vector<const Track*> sorted;
+    sorted.reserve(tracks.size());
+    for (const auto &[id, track] : tracks) {
+        sorted.push_back(&track);
+    }
+    std::sort(sorted.begin(), sorted.end(), [](const Track *a, const Track *b) { return a->id < b->id; });
+
+    std::vector<unsigned char> stringTable;
+    bool overflow = false;
+    auto append = [&](const std::string &value) -> uint32_t {
+        if (stringTable.size() + sizeof(uint32_t) + value.size() > UINT32_MAX) {
+            overflow = true;
+            return 0;
+        }
+        const auto offset = static_cast<uint32_t>(stringTable.size());
+        const auto length = static_cast<uint32_t>(value.size());
+        stringTable.insert(stringTable.end(), reinterpret_cast<const unsigned char*>(&length),
+                           reinterpret_cast<const unsigned char*>(&length) + sizeof(length));
+        stringTable.insert(stringTable.end(), value.begin(), value.end());
+        stringTable.resize((stringTable.size() + 3) & ~size_t(3), 0); // keep lengths aligned
+        return offset;
+    };
+    // only artists, albums and genres repeat across tracks - looking up paths, titles and ids would cost more than it saves
+    std::unordered_map<std::string_view, uint32_t> shared; // views into `tracks`, which outlive the table
+    auto intern = [&](const std::string &value) -> uint32_t {
+        if (const auto it = shared.find(value); it != shared.end()) return it->second;
+        const uint32_t offset = append(value);
+        shared.emplace(value, offset);
+        return offset;
+    };
+
+    // records and strings go into one buffer, so the checksum is a single pass over it
+    std::vector<unsigned char> body(sorted.size() * sizeof(Record));
+    for (size_t i = 0; i < sorted.size(); i++) {
+        const Track &track = *sorted[i];
+        Record record{};
+        record.filePath = append(track.filePath);
+        record.title = append(track.title);
+        record.artist = intern(track.artist);
+        record.album = intern(track.album);
+        record.genre = intern(track.genre);
+        record.id = append(track.id);
+        record.trackNumber = track.trackNumber;
+        record.mtime = track.stamp.mtime;
+        record.size = track.stamp.size;
+        record.inode = track.stamp.inode;
+        std::memcpy(body.data() + i * sizeof(Record), &record, sizeof(record));
+    }
+    if (overflow) return false;
+    body.insert(body.end(), stringTable.begin(), stringTable.end());
+
+    Header header{};
+    std::memcpy(header.magic, fileMagic, sizeof(fileMagic));
+    header.version = Version;
+    header.byteOrder = byteOrderMark;
+    header.fileSize = sizeof(Header) + body.size();
+    header.trackCount = sorted.size();
+    header.recordsOffset = sizeof(Header);
+    header.stringsOffset = sizeof(Header) + sorted.size() * sizeof(Record);
+    header.stringsSize = stringTable.size();
+    header.checksum = checksum(body.data(), body.size());
+
+    const std::string temporary = path + ".tmp";
+    {
+        std::ofstream out(temporary, std::ios::binary | std::ios::trunc);
+        if (!out) return false;
+        out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        out.write(reinterpret_cast<const char*>(body.data()), static_cast<std::streamsize>(body.size()));
+        if (!out.flush()) {
+            out.close();
+            std::remove(temporary.c_str());
+            return false;
+        }
+    }
+    if (std::rename(temporary.c_str(), path.c_str()) != 0) {
+        std::remove(temporary.c_str());
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,57 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+#include "mappedfile.h"
+#include "metahandler.h"
+
+/**
+ * The on-disk form of a MetaCache, read in place through a memory mapping.
+ *
+ * Layout: a fixed header (magic, version, byte order marker, sizes and a checksum of everything after it), one
+ * fixed-size record per track sorted by id, then a string table every record points into, holding each artist,
+ * album and genre once. Opening checks the header, the size and the checksum, so a truncated or corrupted file
+ * is rejected as a whole instead of being half-loaded; nothing is copied until asked for.
+ *
+ * Throws std::runtime_error (saying why) if the file can't be opened or isn't a valid cache.
+ */
+class MetaCacheFile {
+public:
+    static constexpr uint32_t Version = 1; // bumped whenever the layout changes - other versions are rejected
+
+    /**
+     * One track, as stored. The strings point into the mapping and live as long as the MetaCacheFile.
+     */
+    struct Entry {
+        std::string_view filePath;
+        std::string_view title;
+        std::string_view artist;
+        std::string_view album;
+        std::string_view genre;
+        std::string_view id;
+        int trackNumber = 0;
+        FileStamp stamp;
+    };
+
+    explicit MetaCacheFile(const std::string &path);
+
+    [[nodiscard]] size_t size() const { return count; };
+    [[nodiscard]] Entry operator[](size_t index) const;
+    [[nodiscard]] std::optional<Entry> find(std::string_view id) const;
+
+    static bool write(const std::string &path, const std::unordered_map<std::string, Track> &tracks);
+
+private:
+    [[nodiscard]] std::string_view string(uint32_t offset) const;
+
+    std::unique_ptr<MappedFile> file;
+    const unsigned char *records = nullptr;
+    const unsigned char *strings = nullptr;
+    uint64_t stringsSize = 0;
+    size_t count = 0;
+};
@@ -1,20 +1,47 @@
 #include "metahandler.h"
 #include "taglib/fileref.h"
 #include "taglib/tag.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
 #include <filesystem>
 #include <iostream>
-#include <fstream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <sys/stat.h>
+#include <thread>
+#include <unordered_set>
 
 #include "logger.h"
+#include "metacachefile.h"
+
+/**
+ * Stat a file. Gives an all-zero stamp (which matches no real file) if it can't be.
+ */
+FileStamp FileStamp::of(const std::string &path) {
+    FileStamp result;
+    struct stat info{};
+    if (::stat(path.c_str(), &info) == 0) {
+        result.mtime = static_cast<int64_t>(info.st_mtim.tv_sec) * 1000000000 + info.st_mtim.tv_nsec;
+        result.size = static_cast<uint64_t>(info.st_size);
+        result.inode = static_cast<uint64_t>(info.st_ino);
+    }
+    return result;
+}
 
 Track::Track(const std::string &path) : filePath(path) {}
 
 bool Track::load() {
+    stamp = FileStamp::of(filePath); // before reading, so a write racing the read is caught by the next scan
     TagLib::FileRef f(filePath.c_str());
     if (!f.isNull() && f.tag()) {
         title  = f.tag()->title().to8Bit(true);
         artist = f.tag()->artist().to8Bit(true);
         album  = f.tag()->album().to8Bit(true);
+        genre  = f.tag()->genre().to8Bit(true);
         trackNumber = f.tag()->track();
 
         if (title.empty() && artist.empty() && album.empty()) {
@@ -42,10 +69,12 @@ std::string generateTrackID(const Track &track) {
 
 // MetaCache
 void MetaCache::setCache(std::unordered_map<std::string, Track>&& newCache) {
+    file_.reset();
     cache_ = std::move(newCache);
 }
 
 const std::unordered_map<std::string, Track>& MetaCache::getCache() const {
+    materialize();
     return cache_;
 }
 
@@ -57,6 +86,7 @@ const std::unordered_map<std::string, Track>& MetaCache::getCache() const {
  * @return
  */
 std::vector<const Track*> MetaCache::sortBy(const std::function<bool(const Track&, const Track&)> &key) const {
+    materialize();
     std::vector<const Track*> result; // ensure integrity by forbidding changes
     result.reserve(cache_.size());
     for (const auto &[id, track] : cache_) {
@@ -68,89 +98,151 @@ std::vector<const Track*> MetaCache::sortBy(const std::function<bool(const Track
     return result;
 }
 
-bool MetaCache::dumpCache(std::string &path) const {
-    std::ofstream out(path, std::ios::binary | std::ios::trunc);
-    if (!out) return false;
-
-    for (const auto& [path, track] : cache_) {
-        auto write_string = [&](const std::string& str) {
-            size_t len = str.size();
-            out.write(reinterpret_cast<const char*>(&len), sizeof(len));
-            out.write(str.data(), len);
-        };
+/**
+ * How many tracks the cache holds.
+ */
+size_t MetaCache::size() const {
+    return file_ ? file_->size() : cache_.size();
+}
 
-        write_string(track.filePath);
-        write_string(track.title);
-        write_string(track.artist);
-        write_string(track.album);
-        write_string(track.id);
-        out.write(reinterpret_cast<const char*>(&track.trackNumber), sizeof(track.trackNumber));
-        // out.write(reinterpret_cast<const char*>(&track.duration), sizeof(track.duration));
+/**
+ * Visit every track's id, file and stamp - straight from the mapping for a loaded cache, without building Tracks.
+ * The views are only valid during the call.
+ */
+void MetaCache::forEachFile(const FileVisitor &visit) const {
+    if (file_) {
+        for (size_t i = 0; i < file_->size(); i++) {
+            const MetaCacheFile::Entry entry = (*file_)[i];
+            visit(entry.id, entry.filePath, entry.stamp);
+        }
+        return;
     }
+    for (const auto &[id, track] : cache_) {
+        visit(id, track.filePath, track.stamp);
+    }
+}
 
-    return true;
+/**
+ * Write the cache to disk (see MetaCacheFile for the format).
+ * @param path Where to write it. Missing parent directories are created
+ * @return Whether the cache was written
+ */
+bool MetaCache::dumpCache(std::string &path) const {
+    if (file_ && path == filePath_) return true; // untouched since it was loaded from there
+    materialize();
+    std::error_code error;
+    std::filesystem::create_directories(std::filesystem::path(path).parent_path(), error); // write() says if it failed
+    return MetaCacheFile::write(path, cache_);
 };
 
+/**
+ * Where frontends keep the cache between runs.
+ */
+std::string MetaCache::defaultPath() {
+    if (const char *xdg = getenv("XDG_CACHE_HOME"); xdg && *xdg) {
+        return std::string(xdg) + "/koulouri/metacache.bin";
+    }
+    if (const char *home = getenv("HOME"); home && *home) {
+        return std::string(home) + "/.cache/koulouri/metacache.bin";
+    }
+    return "/tmp/koulouri-metacache.bin";
+}
+
+/**
+ * Replace the cache's contents with a cache file's. The file is mapped and checked, but nothing is copied out of it
+ * until Tracks are needed. A file that is missing, truncated, corrupted or from another version leaves the cache as
+ * it was - a scan rebuilds it.
+ * @param path The file written by `dumpCache()`
+ * @return Whether the file was loaded
+ */
 bool MetaCache::loadCache(std::string &path) {
-    std::ifstream in(path, std::ios::binary);
-    if (!in) return false;
+    if (!std::filesystem::exists(path)) return false;
 
+    try {
+        file_ = std::make_shared<const MetaCacheFile>(path);
+    } catch (const std::runtime_error &e) {
+        Logger::g_log("MetaHandler", Logger::Level::WARNING, "cache", std::string("Ignoring cache: ") + e.what());
+        return false;
+    }
+    filePath_ = path;
     cache_.clear();
+    return true;
+}
 
-    while (in.good()) {
-        size_t len;
-        std::string path, title, artist, album, id;
-        int trackNumber;
-
-        // Read path
-        if (!in.read(reinterpret_cast<char*>(&len), sizeof(len))) break;
-        path.resize(len);
-        if (!in.read(&path[0], len)) break;
-
-        // Read title
-        if (!in.read(reinterpret_cast<char*>(&len), sizeof(len))) break;
-        title.resize(len);
-        if (!in.read(&title[0], len)) break;
-
-        // Read artist
-        if (!in.read(reinterpret_cast<char*>(&len), sizeof(len))) break;
-        artist.resize(len);
-        if (!in.read(&artist[0], len)) break;
-
-        // Read album
-        if (!in.read(reinterpret_cast<char*>(&len), sizeof(len))) break;
-        album.resize(len);
-        if (!in.read(&album[0], len)) break;
-
-        // Read trackId
-        if (!in.read(reinterpret_cast<char*>(&len), sizeof(len))) break;
-        id.resize(len);
-        if (!in.read(&id[0], len)) break;
-
-        // Read trackNumer
-        if (!in.read(reinterpret_cast<char*>(&trackNumber), sizeof(trackNumber))) break;
-
-        Track track(path);
+// Turn the loaded file into Tracks, once - from here on the map is the only copy.
+void MetaCache::materialize() const {
+    if (!file_) return;
+
+    std::unordered_map<std::string, Track> loaded;
+    loaded.reserve(file_->size());
+    for (size_t i = 0; i < file_->size(); i++) {
+        const MetaCacheFile::Entry entry = (*file_)[i];
+        Track track{std::string(entry.filePath)};
+        track.title       = entry.title;
+        track.artist      = entry.artist;
+        track.album       = entry.album;
+        track.genre       = entry.genre;
+        track.trackNumber = entry.trackNumber;
+        track.id          = entry.id;
+        track.stamp       = entry.stamp;
+        loaded.emplace(track.id, std::move(track));
+    }
+    cache_ = std::move(loaded);
+    file_.reset();
+}
 
-        track.title       = title;
-        track.artist      = artist;
-        track.album       = album;
-        track.trackNumber = trackNumber;
-        track.id          = id;
+void MetaCache::addTrack(Track &track) {
+    materialize();
+    cache_.insert({track.id, track});
+}
 
-        addTrack(track);
+/**
+ * Remove a track from the cache.
+ * @param id The track's ID
+ * @return Whether there was such a track
+ */
+bool MetaCache::removeTrack(const std::string &id) {
+    materialize();
+    const auto it = cache_.find(id);
+    if (it == cache_.end()) return false;
+    if (removeListener) {
+        removeListener(it->second);
     }
-
+    cache_.erase(it);
     return true;
 }
 
-void MetaCache::addTrack(Track &track) {
-    cache_.insert({track.id, track});
+/**
+ * Remove every track whose file path `matches`.
+ * @return How many tracks were removed
+ */
+size_t MetaCache::removeFiles(const std::function<bool(const std::string&)> &matches) {
+    materialize();
+    std::vector<std::string> ids;
+    for (const auto &[id, track] : cache_) {
+        if (matches(track.filePath)) {
+            ids.push_back(id);
+        }
+    }
+    for (const std::string &id : ids) {
+        removeTrack(id);
+    }
+    return ids.size();
 }
 
 namespace fs = std::filesystem;
 MetaHandler::MetaHandler() {}
 
+/**
+ * Whether `path` is `directory` or lies somewhere below it, going by the paths alone - no links are followed.
+ * Trailing slashes on `directory` don't matter.
+ */
+bool MetaHandler::isInside(const std::string_view path, std::string_view directory) {
+    while (directory.size() > 1 && directory.back() == '/') directory.remove_suffix(1);
+    if (directory.empty() || path.compare(0, directory.size(), directory) != 0) return false;
+    return path.size() == directory.size() || directory.back() == '/' || path[directory.size()] == '/';
+}
+
 /**
  * @brief Fetch a vector of all (supported) files in a directory.
  * @param directoryPath: The directory to scan
@@ -158,25 +250,33 @@ MetaHandler::MetaHandler() {}
  */
 std::vector<std::string> MetaHandler::fetchAudioFiles(const std::string& directoryPath) {
     std::vector<std::string> audioFiles;
-    const std::vector<std::string> supportedExtensions = {
-        "mp3", "flac", "wav", "ogg", "m4a", "aac", "aiff", "wma"
-    };
 
     for (const auto& entry : fs::recursive_directory_iterator(directoryPath)) {
-        if (entry.is_regular_file()) {
-            std::string ext = entry.path().extension().string();
-            if (!ext.empty() && ext.front() == '.') ext.erase(0, 1); // remove leading dot
-            std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
-
-            if (std::find(supportedExtensions.begin(), supportedExtensions.end(), ext) != supportedExtensions.end()) {
-                audioFiles.push_back(entry.path().string());
-            }
+        if (entry.is_regular_file() && isSupported(entry.path().string())) {
+            audioFiles.push_back(entry.path().string());
         }
     }
 
+    // directory order is up to the filesystem - sort, so scans (and which duplicate wins) don't change run to run
+    std::sort(audioFiles.begin(), audioFiles.end());
     return audioFiles;
 }
 
+/**
+ * @brief Whether a file's extension is one of the supported audio formats.
+ * @param path The file to check - it doesn't have to exist
+ */
+bool MetaHandler::isSupported(const std::string &path) {
+    static const std::vector<std::string> supportedExtensions = {
+        "mp3", "flac", "wav", "ogg", "m4a", "aac", "aiff", "wma"
+    };
+
+    std::string ext = fs::path(path).extension().string();
+    if (!ext.empty() && ext.front() == '.') ext.erase(0, 1); // remove leading dot
+    std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+    return std::find(supportedExtensions.begin(), supportedExtensions.end(), ext) != supportedExtensions.end();
+}
+
 /**
  * @brief Attempt to create a vector of Track objects corresponding to all user media.
  * @param directoryPath
@@ -186,31 +286,187 @@ std::vector<Track> MetaHandler::loadTrackFromDirectory(const std::string &direct
     std::vector<Track> tracks;
     std::vector<std::string> files = fetchAudioFiles(directoryPath);
 
-    for (const std::string &path: files) {
-        Track track(path);
-        if (track.load()) {
-            track.id = generateTrackID(track);
-            tracks.push_back(track);
-        } else {
-            Logger::g_log("MetaHandler", Logger::Level::ERROR, "loader", "Failed to load metadata for file: " + path);
-        }
-    }
+    scan(files, [&](std::vector<Track> &batch) {
+        std::move(batch.begin(), batch.end(), std::back_inserter(tracks));
+    }, nullptr);
 
     return tracks;
 }
 
-void MetaHandler::populateMetaCache(const std::string &directoryPath, MetaCache *originalCache) {
+/**
+ * @brief Read the tags of every supported file in a directory into a MetaCache.
+ *
+ * Tags are parsed on a pool of threads (see `setThreads()`), but merged in file order - the cache ends up the same
+ * as if every file had been read one after another.
+ *
+ * In Incremental mode, cached tracks from `directoryPath` are only re-read if their file stamp changed, and dropped if
+ * their file is gone - the rest of the scan is a `stat()` per file. Tracks from elsewhere are left alone.
+ * @param directoryPath The directory to scan, recursively
+ * @param originalCache The cache to add the tracks to
+ * @param progress Called on the calling thread after every merged batch, if set
+ * @param mode Whether to read every file, or only what changed
+ */
+void MetaHandler::populateMetaCache(const std::string &directoryPath, MetaCache *originalCache, const ProgressCallback &progress,
+                                    const ScanMode mode) {
     std::vector<std::string> files = fetchAudioFiles(directoryPath);
 
-    int i = 0;
-    for (const std::string &path : files) {
-        Track track(path);
-        if (track.load()) {
-            track.id = generateTrackID(track);
+    if (mode == ScanMode::Incremental) {
+        const std::unordered_set<std::string_view> present(files.begin(), files.end());
+        std::unordered_map<std::string_view, std::pair<std::string, FileStamp>> cached; // path (in `files`) -> id, stamp
+        std::vector<std::string> stale; // ids of deleted or changed files
+        size_t removed = 0;
+        // stamps are compared against the loaded file directly - an unchanged library never builds a Track
+        originalCache->forEachFile([&](const std::string_view id, const std::string_view filePath, const FileStamp &stamp) {
+            if (const auto it = present.find(filePath); it != present.end()) {
+                cached.emplace(*it, std::make_pair(std::string(id), stamp));
+            } else if (isInside(filePath, directoryPath)) {
+                stale.emplace_back(id); // deleted
+                removed++;
+            }
+        });
+
+        std::vector<std::string> changed;
+        for (const std::string &path : files) {
+            const auto known = cached.find(path);
+            if (known == cached.end()) {
+                changed.push_back(path); // new (or a duplicate of another track's tags, which never made it in)
+            } else if (known->second.second != FileStamp::of(path)) {
+                stale.push_back(known->second.first);
+                changed.push_back(path);
+            }
+        }
+        for (const std::string &id : stale) {
+            originalCache->removeTrack(id);
+        }
+
+        std::ostringstream oss;
+        oss << "Rescanning " << directoryPath << ": " << files.size() - changed.size() << " unchanged, "
+            << changed.size() << " new or changed, " << removed << " removed";
+        Logger::g_log("MetaHandler", Logger::Level::INFO, "populator", oss.str());
+        files = std::move(changed);
+    }
+
+    const ScanProgress done = scan(files, [&](std::vector<Track> &batch) {
+        for (Track &track : batch) {
             originalCache->addTrack(track);
-            i += 1;
-        } else {
-            Logger::g_log("MetaHandler", Logger::Level::ERROR, "populator", "Failed to load metadata for file: " + path);
         }
+    }, progress);
+
+    std::ostringstream oss;
+    oss << "Scanned " << done.scanned << " files in " << done.seconds << "s (" << static_cast<size_t>(done.filesPerSecond())
+        << " files/s) - " << done.failed << " without usable tags";
+    Logger::g_log("MetaHandler", Logger::Level::INFO, "populator", oss.str());
+}
+
+/**
+ * @brief Bring specific files up to date in a MetaCache.
+ *
+ * Whatever the cache holds for these paths is dropped, then the ones that (still) exist are read again.
+ * Unsupported files are ignored.
+ * @param paths The files that changed, appeared or disappeared
+ * @param cache The cache to update
+ * @param progress Called on the calling thread after every merged batch, if set
+ */
+void MetaHandler::refreshFiles(const std::vector<std::string> &paths, MetaCache *cache, const ProgressCallback &progress) {
+    std::vector<std::string> files;
+    for (const std::string &path : paths) {
+        if (isSupported(path)) {
+            files.push_back(path);
+        }
+    }
+    std::sort(files.begin(), files.end());
+    files.erase(std::unique(files.begin(), files.end()), files.end());
+    if (files.empty()) return;
+
+    const std::unordered_set<std::string> refreshed(files.begin(), files.end());
+    cache->removeFiles([&](const std::string &path) { return refreshed.count(path) > 0; });
+
+    std::error_code error;
+    files.erase(std::remove_if(files.begin(), files.end(), [&](const std::string &path) {
+        return !fs::is_regular_file(path, error);
+    }), files.end());
+    scan(files, [&](std::vector<Track> &batch) {
+        for (Track &track : batch) {
+            cache->addTrack(track);
+        }
+    }, progress);
+}
+
+/**
+ * Parse the tags of `files` on a pool of worker threads, handing the parsed tracks to `merge` in batches.
+ *
+ * Workers claim `BatchSize` files at a time. The calling thread merges finished batches strictly in file order, so
+ * the result doesn't depend on which worker got there first. Files without usable tags are logged and skipped.
+ * @param files What to parse
+ * @param merge Called on the calling thread with each batch's tracks, in order
+ * @param progress Called on the calling thread after every merge, if set
+ * @return The final progress
+ */
+ScanProgress MetaHandler::scan(const std::vector<std::string> &files, const std::function<void(std::vector<Track>&)> &merge,
+                               const ProgressCallback &progress) const {
+    const auto start = std::chrono::steady_clock::now();
+    const size_t batchCount = (files.size() + BatchSize - 1) / BatchSize;
+    ScanProgress status;
+    status.total = files.size();
+    if (batchCount == 0) return status;
+
+    struct Batch {
+        std::vector<Track> tracks;
+        size_t failed = 0;
+        bool done = false; // guarded by `mutex`
+    };
+    std::vector<Batch> batches(batchCount);
+    std::atomic<size_t> nextBatch{0};
+    std::mutex mutex;
+    std::condition_variable finished;
+
+    auto work = [&] {
+        for (size_t b = nextBatch.fetch_add(1); b < batchCount; b = nextBatch.fetch_add(1)) {
+            Batch &batch = batches[b];
+            const size_t end = std::min(files.size(), (b + 1) * BatchSize);
+            for (size_t i = b * BatchSize; i < end; i++) {
+                Track track(files[i]);
+                if (track.load()) {
+                    track.id = generateTrackID(track);
+                    batch.tracks.push_back(std::move(track));
+                } else {
+                    Logger::g_log("MetaHandler", Logger::Level::ERROR, "populator", "Failed to load metadata for file: " + files[i]);
+                    batch.failed++;
+                }
+            }
+            {
+                std::lock_guard lock(mutex);
+                batch.done = true;
+            }
+            finished.notify_one();
+        }
+    };
+
+    unsigned count = threads > 0 ? threads : std::max(1u, std::thread::hardware_concurrency());
+    count = static_cast<unsigned>(std::min<size_t>(count, batchCount));
+    std::vector<std::thread> workers;
+    for (unsigned i = 0; i < count; i++) {
+        workers.emplace_back(work);
+    }
+
+    // merge in order, as each batch becomes the next one due
+    for (size_t b = 0; b < batchCount; b++) {
+        {
+            std::unique_lock lock(mutex);
+            finished.wait(lock, [&] { return batches[b].done; });
+        }
+        merge(batches[b].tracks);
+        status.scanned = std::min(files.size(), (b + 1) * BatchSize);
+        status.failed += batches[b].failed;
+        status.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        batches[b].tracks = std::vector<Track>(); // merged - free it now, rather than holding the whole library twice
+        if (progress) {
+            progress(status);
+        }
+    }
+
+    for (std::thread &worker : workers) {
+        worker.join();
     }
+    return status;
 }
@@ -1,50 +1,129 @@
 #pragma once
+#include <cstddef>
+#include <cstdint>
 #include <functional>
+#include <memory>
 #include <vector>
 #include <string>
+#include <string_view>
 #include <unordered_map>
 
+/**
+ * What a file looked like on disk when its tags were read. A file whose stamp still matches hasn't changed.
+ */
+struct FileStamp
+{
+    int64_t mtime = 0; // modification time, in nanoseconds since the epoch
+    uint64_t size = 0; // in bytes
+    uint64_t inode = 0; // catches files replaced by a rename, which may keep the old mtime
+
+    static FileStamp of(const std::string &path);
+
+    bool operator==(const FileStamp &other) const {
+        return mtime == other.mtime && size == other.size && inode == other.inode;
+    };
+    bool operator!=(const FileStamp &other) const { return !(*this == other); };
+};
+
 class Track
 {
 public:
     std::string title;
     std::string artist;
     std::string album;
+    std::string genre;
     std::string id;
     int trackNumber;
     const std::string filePath;
+    FileStamp stamp; // taken as the tags were read
 
     explicit Track(const std::string &path);
 
     bool load();
 };
 
+class MetaCacheFile;
+
+/**
+ * Every known track, keyed by id.
+ *
+ * A loaded cache stays in its mapped file until something needs Track objects - anything returning or changing
+ * them builds them all first. Scanning an unchanged library, building a LibraryStore or dumping back to the same
+ * file never does.
+ */
 class MetaCache
 {
 public:
+    using RemoveListener = std::function<void(const Track&)>;
+    using FileVisitor = std::function<void(std::string_view id, std::string_view filePath, const FileStamp &stamp)>;
+
     bool dumpCache(std::string &path) const;
     bool loadCache(std::string &path);
+    static std::string defaultPath();
 
     void addTrack(Track &track);
+    bool removeTrack(const std::string &id);
+    size_t removeFiles(const std::function<bool(const std::string&)> &matches);
+    void setRemoveListener(RemoveListener listener) { removeListener = std::move(listener); };
 
     void setCache(std::unordered_map<std::string, Track>&& newCache);
     const std::unordered_map<std::string, Track>& getCache() const;
     std::vector<const Track*> sortBy(const std::function<bool(const Track&, const Track&)> &key) const;
 
+    [[nodiscard]] size_t size() const;
+    void forEachFile(const FileVisitor &visit) const;
+    [[nodiscard]] const MetaCacheFile *mappedFile() const { return file_.get(); }; // null once Tracks are built
+
 private:
-    std::unordered_map<std::string, Track> cache_;
+    void materialize() const;
+
+    mutable std::unordered_map<std::string, Track> cache_;
+    mutable std::shared_ptr<const MetaCacheFile> file_; // loaded, but not turned into Tracks yet
+    std::string filePath_; // where `file_` came from
+    RemoveListener removeListener; // told about every track before it's removed - pointers to it die with it
+};
+
+/**
+ * How far a library scan has come, handed to its progress callback after every batch.
+ */
+struct ScanProgress
+{
+    size_t scanned = 0; // files parsed so far, whether they had usable tags or not
+    size_t total = 0; // files found
+    size_t failed = 0; // files without usable tags
+    double seconds = 0.0; // since parsing started
+
+    [[nodiscard]] double filesPerSecond() const { return seconds > 0.0 ? scanned / seconds : 0.0; };
 };
 
 class MetaHandler
 {
 public:
+    using ProgressCallback = std::function<void(const ScanProgress&)>;
+
     MetaHandler();
     std::vector<std::string> fetchAudioFiles(const std::string &directoryPath);
     std::vector<Track> loadTrackFromDirectory(const std::string &directoryPath);
 
-    void populateMetaCache(const std::string &directoryPath, MetaCache *originalCache);
+    enum class ScanMode {
+        Full, // read every file's tags
+        Incremental // only read files that are new or changed since they were cached, and drop deleted ones
+    };
+
+    void populateMetaCache(const std::string &directoryPath, MetaCache *originalCache, const ProgressCallback &progress = nullptr,
+                           ScanMode mode = ScanMode::Full);
+
+    void refreshFiles(const std::vector<std::string> &paths, MetaCache *cache, const ProgressCallback &progress = nullptr);
+
+    void setThreads(unsigned count) { threads = count; };
+    static bool isSupported(const std::string &path);
+    static bool isInside(std::string_view path, std::string_view directory);
 
+    static constexpr size_t BatchSize = 64; // files a worker claims at once, and tracks merged at once
 
 private:
+    ScanProgress scan(const std::vector<std::string> &files, const std::function<void(std::vector<Track>&)> &merge,
+                      const ProgressCallback &progress) const;
 
+    unsigned threads = 0; // tag parsing threads - 0 uses every core
 };
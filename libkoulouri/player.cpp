@@ -1,66 +1,224 @@
 #include "player.h"
 #include <iostream>
+#include <mutex>
 #include <portaudio.h>
 #include <cstring>
 #include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <fcntl.h>
 #include <sndfile.h>
+#include <spawn.h>
 #include <sstream>
 #include <string>
+#include <sys/wait.h>
 #include "logger.h"
+#include "mappedfile.h"
 
-FfmpegFile::FfmpegFile(const std::string &inputPath) {
-    // Create temp file
-    char tmpTemplate[] = "/tmp/koulouriconv_XXXXXX";
-    int fd = mkstemp(tmpTemplate);
-    if (fd == -1) throw std::runtime_error("Failed to initiate FFmpeg conversion - /tmp file creation failed!");
+extern char **environ;
 
-    close(fd);  // We'll let FFmpeg write to it
-    tempPath = tmpTemplate;
+namespace {
+/**
+ * Start a program with its stdout going into a pipe - directly rather than through a shell, so paths need no quoting.
+ * stdin and stderr go to /dev/null.
+ * @param argv The program and its arguments, null-terminated. Looked up on PATH
+ * @param process Set to the child's pid
+ * @return The pipe's read end, or -1 if the program couldn't be started
+ */
+int spawnReading(const char *const argv[], pid_t &process) {
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) == -1) return -1;
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+    posix_spawn_file_actions_adddup2(&actions, fds[1], STDOUT_FILENO); // dup2 clears close-on-exec on the copy
+    posix_spawn_file_actions_addopen(&actions, STDERR_FILENO, "/dev/null", O_WRONLY, 0);
+    const int spawned = posix_spawnp(&process, argv[0], &actions, nullptr, const_cast<char **>(argv), environ);
+    posix_spawn_file_actions_destroy(&actions);
+
+    close(fds[1]);
+    if (spawned != 0) {
+        close(fds[0]);
+        return -1;
+    }
+    return fds[0];
+}
+
+// Wait for a child to exit, returning whether it succeeded.
+bool reap(const pid_t process) {
+    int status = 0;
+    while (waitpid(process, &status, 0) == -1) {
+        if (errno != EINTR) return false;
+    }
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+}
 
-    // Run FFmpeg to convert inputPath to WAV
-    std::string command = "ffmpeg -i \"" + inputPath + "\" -f wav -y \"" + tempPath + "\" 2>&1";
-    FILE* pipe = popen(command.c_str(), "r");
-    if (!pipe) throw std::runtime_error("Failed to start FFmpeg process");
+/**
+ * Prepare to pipe a file through FFmpeg, looking up its duration with FFprobe.
+ *
+ * FFmpeg itself isn't started until `open()` is called.
+ * @param inputPath The file to decode
+ */
+FfmpegStream::FfmpegStream(const std::string &inputPath) : inputPath(inputPath) {
+    const char *argv[] = {"ffprobe", "-v", "error", "-show_entries", "format=duration",
+                          "-of", "default=noprint_wrappers=1:nokey=1", inputPath.c_str(), nullptr};
+    pid_t probe;
+    const int fd = spawnReading(argv, probe);
+    if (fd == -1) throw std::runtime_error("Failed to start FFprobe process");
 
     char buffer[256];
-    while (fgets(buffer, sizeof(buffer), pipe) != nullptr) {
-        std::string line(buffer);
-        if (!line.empty() && line.back() == '\n') {
-            line.pop_back();  // Remove trailing newline
+    std::string output;
+    ssize_t got;
+    while ((got = read(fd, buffer, sizeof(buffer))) != 0) {
+        if (got == -1) {
+            if (errno == EINTR) continue;
+            break;
         }
-        Logger::g_log("libkoulouri", Logger::Level::DEBUG, "ffmpeg", line);
+        output.append(buffer, got);
+    }
+    close(fd);
+
+    if (!reap(probe)) throw std::runtime_error("FFprobe could not read the file");
+    try {
+        seconds = std::stod(output);
+    } catch (std::logic_error&) {
+        throw std::runtime_error("FFprobe reported no duration: " + output);
     }
+}
+
+FfmpegStream::~FfmpegStream() {
+    closePipe();
+}
+
+/**
+ * (Re)start FFmpeg and open its output with libsndfile.
+ *
+ * Any handle returned by a previous call must be closed (`sf_close`) first, as its pipe is closed here.
+ * @param startSeconds Where in the input FFmpeg should start decoding
+ * @param info Filled with the stream's details. `frames` is unknown for pipes - use `duration()` instead
+ * @return The libsndfile handle reading from FFmpeg's output
+ */
+SNDFILE *FfmpegStream::open(const double startSeconds, SF_INFO &info) {
+    closePipe();
+
+    // -nostdin, or FFmpeg would steal keypresses from interactive frontends
+    const std::string start = std::to_string(startSeconds);
+    const char *argv[] = {"ffmpeg", "-nostdin", "-v", "error", "-ss", start.c_str(), "-i", inputPath.c_str(),
+                          "-f", "au", "-c:a", "pcm_f32be", "-", nullptr};
+    Logger::g_log("libkoulouri", Logger::Level::DEBUG, "ffmpeg", "decoding " + inputPath + " from " + start + "s");
+
+    output = spawnReading(argv, process);
+    if (output == -1) throw std::runtime_error("Failed to start FFmpeg process");
 
-    int result = pclose(pipe);
-    if (result != 0) {
-        std::remove(tmpTemplate); // file isn't removed if we don't continue
+    info = SF_INFO{}; // format must be 0 when reading
+    SNDFILE* file = sf_open_fd(output, SFM_READ, &info, SF_FALSE);
+    if (!file) {
+        closePipe();
         throw std::runtime_error("FFmpeg conversion failed");
     }
+    return file;
+}
+
+// Stop FFmpeg and close its output. Whatever it hadn't written yet is no longer wanted.
+void FfmpegStream::closePipe() {
+    if (output != -1) {
+        close(output);
+        output = -1;
+    }
+    if (process != -1) {
+        kill(process, SIGTERM);
+        reap(process);
+        process = -1;
+    }
+}
+
+
+// loaded track
+
+/**
+ * Whether every sample in the track has been played.
+ * @param position The current play head
+ */
+bool LoadedTrack::finished(const size_t position) const {
+    if (decoder) {
+        return decoder->finished();
+    }
+    return position >= size;
+}
+
+/**
+ * Whether this track can be played through the same output stream as `other`.
+ */
+bool LoadedTrack::compatibleWith(const LoadedTrack &other) const {
+    return sampleRate == other.sampleRate && channels == other.channels && format == other.format;
 }
 
 
 /**
- * @brief Creates the AudioPlayer and initializes PortAudio.
+ * @brief Creates the AudioPlayer, playing through PortAudio's default output device.
  *
  * Note, while an internal logger instance is created here, it is your responsibility to instruct libkoulouri how
  * and where it should log.
  */
-AudioPlayer::AudioPlayer() : logger(Logger("libkoulouri")), stream(nullptr), _isPlaying(false), _isLoaded(false), volume(0) {
-    logger.log(Logger::Level::DEBUG, "initializing PortAudio...");
-    // create the buffer (to prep it for allocate)
-    rawAudio = AudioBuffer();
-    Pa_Initialize();
+AudioPlayer::AudioPlayer() : AudioPlayer(std::make_unique<PortAudioSink>()) {}
+
+/**
+ * @brief Creates an AudioPlayer that plays into `output` instead - a NullSink or WavFileSink runs the whole playback
+ * path without a sound card.
+ * @param output Where the audio goes. Must not be null
+ */
+AudioPlayer::AudioPlayer(std::unique_ptr<AudioSink> output)
+    : logger(Logger("libkoulouri")), sink(std::move(output)), kernels(&AudioTools::activeKernels()) {
+    logger.log(Logger::Level::DEBUG, "using volume kernels: " + std::string(kernels->name));
+    logger.log(Logger::Level::DEBUG, std::string("using audio sink: ") + sink->name());
+    transcodeCache = std::make_shared<TranscodeCache>(TranscodeCache::defaultDirectory(), 1024ull * 1024 * 1024);
+    deviceRate = sink->nativeRate();
+    if (deviceRate > 0) {
+        logger.log(Logger::Level::DEBUG, "output device rate: " + std::to_string(deviceRate));
+    }
 }
 
 /**
- * @brief If the stream hasn't been stopped, stops it and terminates PortAudio.
+ * @brief Stops playback and closes the stream. PortAudio is terminated once no other player (or sink) uses it.
  *
  */
 AudioPlayer::~AudioPlayer() {
     logger.log(Logger::Level::DEBUG, "Running cleanup...");
     stop();
-    logger.log(Logger::Level::DEBUG, "Quitting PortAudio...");
-    Pa_Terminate();
+    closeStream();
+}
+
+/**
+ * Memory-map a file's samples, if they are stored on disk exactly as they would be in an AudioBuffer.
+ *
+ * Only little endian WAV files holding 16/24/32-bit ints or 32-bit floats qualify. Big endian containers (AIFF)
+ * need converting, so they are always decoded.
+ * @return The mapping, or nullptr if the file has to be decoded instead
+ */
+static std::shared_ptr<const MappedFile> mapSamples(const std::string &filePath, const SF_INFO &sfInfo, const FormatType format) {
+    if (__BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__) return nullptr; // samples would need swapping
+    const int container = sfInfo.format & SF_FORMAT_TYPEMASK;
+    const int endian = sfInfo.format & SF_FORMAT_ENDMASK;
+    const int subtype = sfInfo.format & SF_FORMAT_SUBMASK;
+    if (container != SF_FORMAT_WAV && container != SF_FORMAT_WAVEX) return nullptr;
+    if (endian != SF_ENDIAN_FILE && endian != SF_ENDIAN_LITTLE) return nullptr;
+    if (subtype != SF_FORMAT_PCM_16 && subtype != SF_FORMAT_PCM_24 && subtype != SF_FORMAT_PCM_32 &&
+        subtype != SF_FORMAT_FLOAT) return nullptr;
+
+    size_t offset = 0, length = 0;
+    if (!MappedFile::findWavData(filePath, offset, length)) return nullptr;
+    // trust libsndfile's frame count over the chunk header, which may be bogus for files that were cut short
+    const size_t bytes = static_cast<size_t>(sfInfo.frames) * sfInfo.channels * FormatTools::sampleSize(format);
+    if (bytes > length) return nullptr;
+
+    try {
+        return std::make_shared<const MappedFile>(filePath, offset, bytes);
+    } catch (std::runtime_error &e) {
+        Logger::g_log("libkoulouri", Logger::Level::WARNING, "player", std::string("Mapping failed, decoding instead: ") + e.what());
+        return nullptr;
+    }
 }
 
 std::string formatToString(const int format) {
@@ -81,14 +239,25 @@ std::string formatToString(const int format) {
     }
 }
 
+// Copy the settings a track is opened with. Call from the controlling thread.
+AudioPlayer::OpenOptions AudioPlayer::openOptions() const {
+    return {loadMode, streamingThreshold, memoryMapping, storagePolicy, realtime, latencyProfile.load(), resampling,
+            resamplerQuality, deviceRate, transcodeCache};
+}
+
 /**
- * @brief Loads a sound file to memory.
+ * @brief Opens a sound file, either decoding it to memory or preparing it for streaming.
  *
- * Does not automatically play the file.
+ * Only touches `track`, and reads settings from `options` alone - safe to call from the preloading thread while
+ * another track is playing.
  */
-PlayerActionResult AudioPlayer::load(const std::string& filePath, bool allowConverision, bool forceConversion) {
+PlayerActionResult AudioPlayer::openTrack(const std::string& filePath, bool allowConversion, bool forceConversion,
+                                          const OpenOptions &options, LoadedTrack &track) const {
     SF_INFO sfInfo;
     SNDFILE* file = nullptr;
+    std::unique_ptr<FfmpegStream> source; // set if the file has to be piped through FFmpeg
+    std::string openedPath = filePath; // differs from filePath if a cached conversion is played instead
+    std::shared_ptr<LibavInput> libav; // set if the file is decoded in-process by libav
 
     if (!forceConversion) {
         file = sf_open(filePath.c_str(), SFM_READ, &sfInfo);
@@ -97,19 +266,44 @@ PlayerActionResult AudioPlayer::load(const std::string& filePath, bool allowConv
     }
 
     logger.log(Logger::Level::INFO, "Loading: " + filePath);
+    const bool unsupported = !file && sf_error(nullptr) == 1;
+
+#ifdef HAS_LIBAV
+    // libav decodes in-process, so it beats any conversion - but a forced conversion is exactly that
+    if (unsupported && !forceConversion) {
+        try {
+            auto input = std::make_shared<LibavInput>(filePath);
+            file = input->open(sfInfo);
+            libav = std::move(input);
+            logger.log(Logger::Level::INFO, "Decoding with libav...");
+        } catch (std::runtime_error &e) {
+            logger.log(Logger::Level::WARNING, std::string("libav could not decode the file: ") + e.what());
+        }
+    }
+#endif
 
     // file failed to open (as it is unsupported/unrecognized) and we're allowed to convert
-    if ((!file && sf_error(NULL) == 1 && allowConverision) || forceConversion) {
+    if ((!file && unsupported && allowConversion) || forceConversion) {
         logger.log(Logger::Level::WARNING, "File is unsupported/unknown format!");
-        logger.log(Logger::Level::INFO, "Attempting conversion via FFmpeg...");
-        try {
-            FfmpegFile converted_file(filePath);
-            file = sf_open(converted_file.file().c_str(), SFM_READ, &sfInfo);
-        } catch (std::runtime_error e){
-            logger.log(Logger::Level::ERROR, "FFmpeg could not be located or failed to convert!");
-            std::string msg = "FFmpeg could not be located or it failed to convert the file. | ";
-            msg.append(e.what()).append("");
-            return PlayerActionResult(PlayerActionEnum::FAIL, msg);
+        if (const std::string cached = options.transcodeCache ? options.transcodeCache->lookup(filePath) : ""; !cached.empty()) {
+            logger.log(Logger::Level::INFO, "Using cached conversion: " + cached);
+            file = sf_open(cached.c_str(), SFM_READ, &sfInfo);
+            openedPath = cached;
+        }
+        if (!file) {
+            logger.log(Logger::Level::INFO, "Attempting conversion via FFmpeg...");
+            try {
+                source = std::make_unique<FfmpegStream>(filePath);
+                file = source->open(0.0, sfInfo);
+            } catch (std::runtime_error &e){
+                logger.log(Logger::Level::ERROR, "FFmpeg could not be located or failed to convert!");
+                std::string msg = "FFmpeg could not be located or it failed to convert the file. | ";
+                msg.append(e.what()).append("");
+                return PlayerActionResult(PlayerActionEnum::FAIL, msg);
+            }
+            if (options.transcodeCache) {
+                options.transcodeCache->request(filePath); // convert in the background, so next time is instant
+            }
         }
     }
 
@@ -126,6 +320,7 @@ PlayerActionResult AudioPlayer::load(const std::string& filePath, bool allowConv
         if (code == 1) {
             return PlayerActionResult(PlayerActionEnum::NOTSUPPORTED, "File format is either unknown or unsupported!");
         }
+        return PlayerActionResult(PlayerActionEnum::FAIL, msg);
     }
 
     // Fetch metadata
@@ -134,57 +329,166 @@ PlayerActionResult AudioPlayer::load(const std::string& filePath, bool allowConv
     // std::cout << (sf_get_string(file, SF_STR_ARTIST)? : "not available") << std::endl;
     // std::cout << (sf_get_string(file, SF_STR_GENRE)? : "not available") << std::endl;
 
-    sf_count_t totalFrames = sfInfo.frames;
-    format = FormatTools::fromLibsndfile(sfInfo.format);
+    // pipes don't know their length up front
+    sf_count_t totalFrames = source ? static_cast<sf_count_t>(source->duration() * sfInfo.samplerate) : sfInfo.frames;
+    track.path = filePath;
+    track.format = FormatTools::fromLibsndfile(sfInfo.format);
+    track.sampleRate = sfInfo.samplerate;
+    track.channels = sfInfo.channels;
 
-    // ALWAYS CALL .allocate!
-    // AudioBuffer STORES AN INTERNAL VECTOR - FORMAT CHANGES WILL LEAD TO SEGFAULT!
-    rawAudio.format = format; // <- DO NOT CHANGE THIS LINE - AudioBuffer HOLDS ITS OWN COPY!
-    rawAudio.allocate(totalFrames * sfInfo.channels);
+    // convert to the device's rate while decoding, rather than leaving it to whatever the driver does
+    std::unique_ptr<Resampler> resampler;
+    if (options.resampling && options.deviceRate > 0 && sfInfo.samplerate != options.deviceRate) {
+        try {
+            resampler = std::make_unique<Resampler>(sfInfo.samplerate, options.deviceRate, sfInfo.channels, options.resamplerQuality);
+            track.format = FormatType::Float32; // the resampler only works in float
+            track.sampleRate = options.deviceRate;
+            logger.log(Logger::Level::INFO, "Resampling " + std::to_string(sfInfo.samplerate) + " -> " +
+                       std::to_string(options.deviceRate) + " (" + Resampler::qualityName(options.resamplerQuality) + ")");
 
-    logger.log(Logger::Level::DEBUG, "Final rawAudio vector size is: " + std::to_string(rawAudio.size()));
+            // the float output can't come from a mapping, and is bigger than narrower integer samples
+            const FormatType decoded = FormatTools::fromLibsndfile(sfInfo.format);
+            if (options.memoryMapping && !source && options.loadMode != LoadMode::Streaming) {
+                logger.log(Logger::Level::INFO, "Resampling overrides memory mapping - decoding instead");
+            }
+            if (FormatTools::sampleSize(decoded) < FormatTools::sampleSize(FormatType::Float32)) {
+                logger.log(Logger::Level::INFO, "Resampling overrides " + std::to_string(FormatTools::sampleSize(decoded) * 8) +
+                           "-bit storage - holding the track as 32-bit floats");
+            }
+        } catch (std::runtime_error &e) {
+            logger.log(Logger::Level::WARNING, std::string("Not resampling: ") + e.what());
+        }
+    }
 
-    // Read all samples into rawAudio
-    logger.log(Logger::Level::DEBUG, "Reading file...");
-    // TODO: Discard sfinfo.frames entirely and use a read loop instead
-    sf_count_t framesRead = FormatReader::read(file, &rawAudio, totalFrames, format);
+    // mapping is as cheap as streaming to start and needs no decoder, so it wins unless streaming was forced
+    std::shared_ptr<const MappedFile> mapping;
+    if (options.memoryMapping && !source && !resampler && options.loadMode != LoadMode::Streaming) {
+        mapping = mapSamples(openedPath, sfInfo, track.format);
+    }
 
-    // If audio data made it, this is fine. We can simply adjust!
-    if (framesRead != totalFrames) {
-        std::string error = "Partial read! Expected " + std::to_string(totalFrames) + ", got " + std::to_string(framesRead);
-        logger.log(Logger::Level::ERROR, error);
-        logger.log(Logger::Level::WARNING, "File is likely corrupt or missing proper headers!");
-        logger.log(Logger::Level::WARNING, "Trusting decoded data...");
+    // piped files are always streamed, so playback can start while FFmpeg is still decoding
+    const bool streaming = source || (!mapping && (options.loadMode == LoadMode::Streaming ||
+        (options.loadMode == LoadMode::Auto && totalFrames > options.streamingThreshold * sfInfo.samplerate)));
+    if (mapping) {
+        // samples are played straight out of the page cache - nothing to decode
+        logger.log(Logger::Level::DEBUG, "Mapping file instead of decoding it...");
+        sf_close(file);
+        track.audio.format = track.format;
+        track.audio.map(std::move(mapping));
+        track.size = track.audio.size();
+        track.data = std::as_const(track.audio).raw();
+    } else if (streaming) {
+        // hand the file over to the decoder - it will be closed once the decoder is destroyed
+        logger.log(Logger::Level::DEBUG, "Streaming file instead of buffering it...");
+        const LatencySettings latency = LatencySettings::forProfile(options.latencyProfile);
+        track.decoder = std::make_unique<StreamDecoder>(file, track.format, sfInfo.channels, StreamDecoder::DefaultChunkFrames,
+                                                        latency.ringChunks(track.sampleRate, StreamDecoder::DefaultChunkFrames));
+        track.decoder->setPacing(latency.pacing(track.sampleRate, track.channels));
+        if (source) {
+            // FFmpeg's output can't seek - restart it at the new position instead
+            track.decoder->setReopener([stream = source.get(), rate = sfInfo.samplerate](const sf_count_t frame) -> SNDFILE* {
+                SF_INFO info;
+                try {
+                    return stream->open(static_cast<double>(frame) / rate, info);
+                } catch (std::runtime_error &e) {
+                    Logger::g_log("libkoulouri", Logger::Level::ERROR, "ffmpeg", e.what());
+                    return nullptr;
+                }
+            });
+            track.source = std::move(source);
+        }
+        track.libav = std::move(libav);
+        track.size = (resampler ? resampler->outputFramesFor(totalFrames) : totalFrames) * sfInfo.channels;
+        track.decoder->setResampler(std::move(resampler));
+        track.decoder->setRealtime(options.realtime);
+        track.decoder->start();
+    } else {
+        // ALWAYS CALL .allocate!
+        // AudioBuffer STORES AN INTERNAL VECTOR - FORMAT CHANGES WILL LEAD TO SEGFAULT!
+        track.audio.format = track.format; // <- DO NOT CHANGE THIS LINE - AudioBuffer HOLDS ITS OWN COPY!
+        track.audio.allocate(totalFrames * sfInfo.channels);
 
-        // adjust internal variables to match decoded data
-        totalFrames = framesRead;
-        rawAudio.resize((totalFrames*sfInfo.channels), true);
+        logger.log(Logger::Level::DEBUG, "Final rawAudio vector size is: " + std::to_string(track.audio.size()));
 
-        logger.log(Logger::Level::DEBUG, "rawAudio size is now: " + std::to_string(rawAudio.size()));
+        // Read all samples into rawAudio
+        logger.log(Logger::Level::DEBUG, "Reading file...");
+        // TODO: Discard sfinfo.frames entirely and use a read loop instead
+        sf_count_t framesRead = FormatReader::read(file, &track.audio, totalFrames, track.format, sfInfo.channels);
 
-        // sf_close(file);
-        // return PlayerActionResult(PlayerActionEnum::FAIL, error);
-    }
+        // If audio data made it, this is fine. We can simply adjust!
+        if (framesRead != totalFrames) {
+            std::string error = "Partial read! Expected " + std::to_string(totalFrames) + ", got " + std::to_string(framesRead);
+            logger.log(Logger::Level::ERROR, error);
+            logger.log(Logger::Level::WARNING, "File is likely corrupt or missing proper headers!");
+            logger.log(Logger::Level::WARNING, "Trusting decoded data...");
 
-    // Manually clamp the floats into int16 (should ensure we avoid clipping).
-    // for (size_t i = 0; i < floatBuffer.size(); ++i) {
-    //     float sample = std::clamp(floatBuffer[i], -1.0f, 1.0f);
-    //     rawAudio[i] = static_cast<int16_t>(sample * 32767.0f);
-    // }
+            // adjust internal variables to match decoded data
+            totalFrames = framesRead;
+            track.audio.resize((totalFrames*sfInfo.channels), true);
 
-    sf_close(file);
-    this->sampleRate = sfInfo.samplerate;
-    this->numChannels = sfInfo.channels;
-    this->playbackSize = rawAudio.size();
+            logger.log(Logger::Level::DEBUG, "rawAudio size is now: " + std::to_string(track.audio.size()));
+        }
+
+        sf_close(file);
+
+        if (resampler) {
+            AudioBuffer converted;
+            converted.format = FormatType::Float32;
+            converted.allocate(resampler->maxOutputFrames(totalFrames) * sfInfo.channels);
+            auto *out = static_cast<float *>(converted.raw());
+            size_t frames = resampler->process(static_cast<const float *>(std::as_const(track.audio).raw()), totalFrames, out);
+            frames += resampler->flush(out + frames * sfInfo.channels);
+            converted.resize(frames * sfInfo.channels, true);
+            track.audio = std::move(converted);
+        }
+
+        // lossy files don't carry more than 16 bits' worth of detail - no point holding them as floats
+        if (options.storagePolicy == StoragePolicy::Compact && FormatTools::isLossy(sfInfo.format) && track.audio.compact()) {
+            logger.log(Logger::Level::DEBUG, "Storing lossy file as dithered 16-bit ints...");
+            track.format = FormatType::Int16;
+        }
+
+        track.size = track.audio.size();
+        track.data = std::as_const(track.audio).raw();
+    }
+
+    // the callback reads straight out of these samples - make sure none of them are on disk (or never touched).
+    // Mappings are left to the page cache (they're read ahead as they play) - locking one would pin the whole file.
+    if (options.realtime && !track.decoder && !track.audio.mapped()) {
+        track.memoryLock = std::make_unique<MemoryLock>(track.data, track.size * FormatTools::sampleSize(track.format));
+    }
 
     std::stringstream ss;
-    ss << "Audio details are: Sample Rate: " << sampleRate
-              << ", Channels: " << numChannels
+    ss << "Audio details are: Sample Rate: " << track.sampleRate
+              << ", Channels: " << track.channels
               << ", Major format: " << formatToString(sfInfo.format & SF_FORMAT_TYPEMASK)
-              << ", Sub format: " << formatToString(sfInfo.format & SF_FORMAT_SUBMASK) << ", read as " << formatTypeString[format];
+              << ", Sub format: " << formatToString(sfInfo.format & SF_FORMAT_SUBMASK)
+              << (streaming ? ", streamed as " : track.audio.mapped() ? ", mapped as " : ", read as ")
+              << formatTypeString[track.format];
     logger.log(Logger::Level::INFO, ss.str());
 
-    _isLoaded = true;
+    return PlayerActionResult(PlayerActionEnum::PASS);
+}
+
+/**
+ * @brief Loads a sound file to memory.
+ *
+ * Does not automatically play the file. Any track queued with `queueNext()` is dropped.
+ */
+PlayerActionResult AudioPlayer::load(const std::string& filePath, bool allowConverision, bool forceConversion) {
+    auto track = std::make_unique<LoadedTrack>();
+    PlayerActionResult result = openTrack(filePath, allowConverision, forceConversion, openOptions(), *track);
+    if (!result) return result;
+
+    // the old track may still be read by the callback until it has seen the player go idle
+    idleStream(PlaybackControl::State::Ready);
+    cancelNext();
+    collectRetired();
+    delete current.exchange(track.release());
+
+    control.seekTarget.store(PlaybackControl::NoSeek);
+    control.position.store(0);
+    control.state.store(PlaybackControl::State::Ready);
 
     return PlayerActionResult(PlayerActionEnum::PASS);
 }
@@ -196,57 +500,235 @@ PlayerActionResult AudioPlayer::load(const std::string& filePath, bool allowConv
  * Volume should be set first, as it defaults to 0.
  */
 PlayerActionResult AudioPlayer::play() {
-    if (rawAudio.empty()) return PlayerActionResult(PlayerActionEnum::NOTREADY, "Current audio buffer is empty. Nothing to play!");
+    const LoadedTrack *track = current.load();
+    if (!track || (track->audio.empty() && !track->decoder)) {
+        return PlayerActionResult(PlayerActionEnum::NOTREADY, "Current audio buffer is empty. Nothing to play!");
+    }
 
-    logger.log(Logger::Level::DEBUG, "Setting up stream...");
-    PaStreamParameters outputParams;
-    outputParams.device = Pa_GetDefaultOutputDevice();
-    outputParams.channelCount = numChannels;
-    outputParams.sampleFormat = FormatTools::toPortAudio[format];
-    outputParams.suggestedLatency = Pa_GetDeviceInfo(outputParams.device)->defaultLowOutputLatency;
-    outputParams.hostApiSpecificStreamInfo = nullptr;
-
-    logger.log(Logger::Level::DEBUG, "Opening PortAudio stream...");
-    Pa_OpenStream(&stream, nullptr, &outputParams, sampleRate,
-                  1024, paClipOff, audioCallback, this);
-    // Automatically set the 'isComplete' flag once playback stops (unless paused)
-    Pa_SetStreamFinishedCallback(stream, [](void *userData) {
-        if (auto* player = static_cast<AudioPlayer *>(userData); !player->_isPaused) {
-            player->_isComplete = true;
-        };
-    });
+    // reopening costs tens of milliseconds (and a device reconfiguration) on ALSA - keep the stream if it fits
+    if (sink->isOpen() && (track->sampleRate != streamRate || track->channels != streamChannels || track->format != streamFormat)) {
+        logger.log(Logger::Level::DEBUG, "Track needs a different stream - reopening...");
+        closeStream();
+    }
+    if (sink->isOpen()) {
+        logger.log(Logger::Level::DEBUG, "Reusing open stream!");
+        control.state.store(PlaybackControl::State::Playing);
+        return PlayerActionResult(true);
+    }
+
+    if (const PaError error = openStream(track->sampleRate, track->channels, track->format); error != paNoError) {
+        return PlayerActionResult(PlayerActionEnum::FAIL, std::string("Failed to open stream: ") + Pa_GetErrorText(error));
+    }
     logger.log(Logger::Level::DEBUG, "Starting stream!");
-    Pa_StartStream(stream);
-    _isPlaying = true; // audio playback starts here
-    _isPaused = false; // this resets the paused state anyway
-    _isComplete = false; // audio (shouldn't) be marked 'complete' after playback start
+    // audio playback starts here - this also resets any paused/completed state
+    control.state.store(PlaybackControl::State::Playing);
+    if (const PaError error = sink->start(); error != paNoError) {
+        control.state.store(PlaybackControl::State::Ready);
+        closeStream();
+        return PlayerActionResult(PlayerActionEnum::FAIL, std::string("Failed to start stream: ") + Pa_GetErrorText(error));
+    }
 
     return PlayerActionResult(true);
 }
 
+// Pick the callback for tracks of the given kind and size its scratch buffers, so it never has to allocate.
+// With `unpack`, packed 24-bit tracks come out as 32-bit ints.
+PaStreamCallback *AudioPlayer::prepareCallback(const int sampleRate, const int channels, const FormatType format,
+                                               const unsigned long framesPerBuffer, const bool unpack) {
+    mixScratch.assign(3 * framesPerBuffer * channels, 0.0f); // crossfade scratch - see crossfadeCallback
+    callbackStats.setPeriod(framesPerBuffer, sampleRate);
+
+    // the callback reads these instead of the current track, which it may not touch while idle
+    streamRate = sampleRate;
+    streamChannels = channels;
+    streamFormat = format;
+
+    if (unpack && format == FormatType::Int24) {
+        unpackScratch.assign(framesPerBuffer * channels, Packed24{});
+        return unpackingCallback;
+    }
+    return callbackFor(format);
+}
+
+// Open (but don't start) a stream for tracks of the given kind, buffered as the latency profile asks.
+PaError AudioPlayer::openStream(const int sampleRate, const int channels, const FormatType format) {
+    logger.log(Logger::Level::DEBUG, "Setting up stream...");
+    const LatencySettings latency = LatencySettings::forProfile(latencyProfile.load());
+    const unsigned long framesPerBuffer = latency.framesPerBuffer;
+    AudioSink::StreamConfig config{sampleRate, channels, format, framesPerBuffer, latency.highLatency};
+
+    const bool unpack = format == FormatType::Int24 && !sink->supports(format, sampleRate, channels);
+    if (unpack) {
+        logger.log(Logger::Level::DEBUG, "Device can't play packed 24-bit - unpacking to 32-bit...");
+        config.format = FormatType::Int32;
+    }
+    PaStreamCallback *callback = prepareCallback(sampleRate, channels, format, framesPerBuffer, unpack);
+
+    logger.log(Logger::Level::DEBUG, std::string("Opening ") + sink->name() + " stream (" +
+               std::to_string(framesPerBuffer) + " frames per buffer)...");
+    const PaError error = sink->open(config, callback, this);
+    if (error != paNoError) {
+        logger.log(Logger::Level::ERROR, std::string("Failed to open stream: ") + Pa_GetErrorText(error));
+    }
+    return error;
+}
+
 PlayerActionResult AudioPlayer::pause() {
-    if (stream && _isPlaying) {
+    if (sink->isOpen() && isPlaying()) {
         logger.log(Logger::Level::DEBUG, "Pausing!");
-        _isPaused = true;
-        Pa_StopStream(stream);
-        _isPlaying = false;
+        // the stream keeps running (playing silence), so resuming is instant
+        control.state.store(PlaybackControl::State::Paused);
         return PlayerActionResult(true);
     }
     return PlayerActionResult(PlayerActionEnum::NOTREADY, "Stream is either closed or already paused!");
 }
 
 PlayerActionResult AudioPlayer::resume() {
-    if (stream && !_isPlaying) {
+    // a Ready track hasn't been checked against the open stream yet - that's play()'s job
+    if (const PlaybackControl::State state = control.state.load();
+        sink->isOpen() && (state == PlaybackControl::State::Paused || state == PlaybackControl::State::Completed)) {
         logger.log(Logger::Level::DEBUG, "Resuming!");
-        _isPaused = false;
-        _isComplete = false; // resuming restarts the stream
-        Pa_StartStream(stream);
-        _isPlaying = true;
+        control.state.store(PlaybackControl::State::Playing);
         return PlayerActionResult(true);
     }
     return PlayerActionResult(PlayerActionEnum::NOTREADY, "Stream is either closed or already playing!");
 }
 
+/**
+ * @brief Decode a track in the background, so it can follow the current one without a gap.
+ *
+ * If the track shares its sample rate, channel count and format with the current one, the audio callback
+ * splices it in the moment the current track runs out - the stream stays open and `getTrackChanges()` is bumped.
+ * Otherwise, the current track completes as usual and `playNext()` has to be called to switch over.
+ *
+ * Replaces any previously queued track.
+ */
+PlayerActionResult AudioPlayer::queueNext(const std::string& filePath, bool allowConversion) {
+    if (!isLoaded()) {
+        return PlayerActionResult(PlayerActionEnum::NOTREADY, "Nothing is loaded - use load() instead!");
+    }
+
+    cancelNext();
+    collectRetired();
+
+    control.nextPending.store(true);
+    preloader = std::thread([this, filePath, allowConversion, options = openOptions()] {
+        auto track = std::make_unique<LoadedTrack>();
+        if (!openTrack(filePath, allowConversion, false, options, *track)) {
+            logger.log(Logger::Level::ERROR, "Failed to pre-decode next track: " + filePath);
+        } else if (const LoadedTrack *playing = current.load(); playing && track->compatibleWith(*playing)) {
+            logger.log(Logger::Level::DEBUG, "Next track is ready to be spliced in!");
+            next.store(track.release());
+        } else {
+            logger.log(Logger::Level::DEBUG, "Next track needs a new stream - it will not be gapless.");
+            queued = std::move(track);
+        }
+        control.nextPending.store(false);
+    });
+
+    return PlayerActionResult(true);
+}
+
+/**
+ * @brief Switch to the queued track right away, reopening the stream.
+ *
+ * Waits for the queued track to finish pre-decoding if it hasn't yet.
+ */
+PlayerActionResult AudioPlayer::playNext() {
+    if (preloader.joinable()) {
+        preloader.join();
+    }
+
+    std::unique_ptr<LoadedTrack> upcoming(next.exchange(nullptr));
+    if (!upcoming) {
+        upcoming = std::move(queued);
+    }
+    if (!upcoming) {
+        return PlayerActionResult(PlayerActionEnum::NOTFOUND, "No track has been queued (or it failed to load)!");
+    }
+
+    idleStream(PlaybackControl::State::Ready);
+    collectRetired();
+    delete current.exchange(upcoming.release());
+
+    control.seekTarget.store(PlaybackControl::NoSeek);
+    control.position.store(0);
+    control.state.store(PlaybackControl::State::Ready);
+    control.trackChanges.fetch_add(1);
+
+    return play();
+}
+
+/**
+ * Whether a track has been queued with `queueNext()` and is either ready or still being decoded.
+ */
+bool AudioPlayer::hasNext() {
+    collectRetired();
+    if (control.nextPending.load()) return true;
+    if (preloader.joinable()) {
+        preloader.join(); // already done decoding - this only makes `queued` safe to look at
+    }
+    return next.load() != nullptr || queued != nullptr;
+}
+
+/**
+ * The path of the track currently being played (or an empty string if nothing is loaded).
+ */
+std::string AudioPlayer::getCurrentPath() const {
+    const LoadedTrack *track = current.load();
+    return track ? track->path : "";
+}
+
+/**
+ * @brief Move the play head.
+ *
+ * The move is only requested here - the audio callback picks it up on its next run. While streaming, this
+ * also seeks the decoder, dropping anything it decoded ahead of the old position.
+ * @param to The (interleaved) sample position to move to
+ */
+void AudioPlayer::setPos(size_t to) {
+    LoadedTrack *track = current.load();
+    if (!track) return;
+
+    to = std::clamp(to, std::size_t{0}, track->size);
+    to -= to % track->channels; // never land between two channels of the same frame
+    if (track->decoder) {
+        track->decoder->seek(to);
+    } else {
+        if (const MappedFile *mapping = track->audio.getMapping()) {
+            // start reading the new position in now, rather than page faulting inside the callback
+            mapping->prefetch(to * FormatTools::sampleSize(track->format));
+        }
+        control.seekTarget.store(to, std::memory_order_relaxed);
+    }
+    control.position.store(to, std::memory_order_relaxed); // report the new position right away
+}
+
+size_t AudioPlayer::getMaxPos() const {
+    const LoadedTrack *track = current.load();
+    return track ? track->size : 0;
+}
+
+int AudioPlayer::getSampleRate() const {
+    const LoadedTrack *track = current.load();
+    return track ? track->sampleRate : 0;
+}
+
+int AudioPlayer::getChannels() const {
+    const LoadedTrack *track = current.load();
+    return track ? track->channels : 0;
+}
+
+bool AudioPlayer::isStreaming() const {
+    const LoadedTrack *track = current.load();
+    return track && track->decoder;
+}
+
+bool AudioPlayer::isMapped() const {
+    const LoadedTrack *track = current.load();
+    return track && track->audio.mapped();
+}
+
 void AudioPlayer::setVolume(int volume) {
     if (volume > 100) {
         volume = 100;
@@ -254,9 +736,7 @@ void AudioPlayer::setVolume(int volume) {
         volume = 0;
     }
 
-    if (this->volume != volume) {
-        this->volume = volume;
-
+    if (control.volume.exchange(volume, std::memory_order_relaxed) != volume) {
         // processAudioData();
         logger.log(Logger::Level::DEBUG, "adjusting volume to: " + std::to_string(volume));
     } else {
@@ -264,42 +744,358 @@ void AudioPlayer::setVolume(int volume) {
     }
 }
 
+/**
+ * @brief Keep FFmpeg conversions on disk, so files libsndfile can't read only have to be converted once.
+ *
+ * Enabled by default (1GiB in `TranscodeCache::defaultDirectory()`).
+ * @param directory Where to keep converted files
+ * @param budgetBytes How large the cache may grow. 0 disables caching
+ */
+void AudioPlayer::setTranscodeCache(const std::string &directory, const uint64_t budgetBytes) {
+    transcodeCache.reset(); // a preloader still using the old cache keeps it alive until it's done
+    if (budgetBytes > 0) {
+        transcodeCache = std::make_shared<TranscodeCache>(directory, budgetBytes);
+    }
+    logger.log(Logger::Level::DEBUG, "transcode cache set to: " + directory + " (" + std::to_string(budgetBytes) + " bytes)");
+}
+
+/**
+ * @brief Convert tracks to the output device's native rate while decoding.
+ *
+ * Disabled by default, so tracks are played at their own rate and the device (or its driver) converts. Resampled
+ * tracks are decoded to 32-bit float - they're never memory mapped, and 16 or 24-bit ones take more memory.
+ * Only applies to tracks loaded afterwards.
+ * @param enabled Whether to resample
+ * @param quality Filter length - see ResamplerQuality
+ */
+void AudioPlayer::setResampling(const bool enabled, const ResamplerQuality quality) {
+    resampling = enabled;
+    resamplerQuality = quality;
+    logger.log(Logger::Level::DEBUG, std::string("resampling ") + (enabled ? "enabled (" + std::string(Resampler::qualityName(quality)) + ")" : "disabled"));
+}
+
+/**
+ * @brief Choose how buffered tracks are held in memory.
+ *
+ * `StoragePolicy::Compact` halves the memory used by lossy files (MP3, Vorbis, Opus), at the cost of a dither pass
+ * while loading. Only applies to tracks loaded afterwards - streamed and mapped tracks are unaffected.
+ * @param policy The storage policy to use
+ */
+void AudioPlayer::setStoragePolicy(const StoragePolicy policy) {
+    storagePolicy = policy;
+    logger.log(Logger::Level::DEBUG, std::string("storage policy set to: ") + (policy == StoragePolicy::Compact ? "compact" : "exact"));
+}
+
+/**
+ * @brief Limit how much freed sample memory is kept around for the next tracks.
+ *
+ * Buffered tracks reuse the memory of tracks played before them (see BufferPool), so switching tracks doesn't
+ * fault in fresh pages. Shared by every AudioPlayer in the process - 512MiB by default.
+ * @param bytes How many idle bytes may be kept. 0 frees memory as soon as a track is done with it
+ */
+void AudioPlayer::setBufferBudget(const uint64_t bytes) {
+    BufferPool::global().setBudget(bytes);
+}
+
+/**
+ * @brief Trade memory and privileges for fewer underruns when the system is under load.
+ *
+ * Playback buffers are locked into RAM (or at least prefaulted) and streaming decoder threads run with SCHED_FIFO,
+ * or a raised nice level if that's not permitted. Whatever couldn't be applied is logged and counted in
+ * `getRealtimeStatus()`. Only applies to tracks loaded afterwards.
+ * @param enabled Whether to use realtime mode
+ */
+void AudioPlayer::setRealtime(const bool enabled) {
+    realtime = enabled;
+    logger.log(Logger::Level::DEBUG, std::string("realtime mode ") + (enabled ? "enabled" : "disabled"));
+}
+
+/**
+ * @brief Choose how much audio is buffered ahead of the speakers.
+ *
+ * Takes effect right away: an open stream is reopened with the new buffer size where it left off, and streaming
+ * decoders switch to the new decode-ahead (up to what their ring buffer can hold - tracks opened afterwards get
+ * one sized for it). Tracks still being pre-decoded keep the profile they started with.
+ *
+ * If the stream can't be reopened with the new profile, the previous one is put back. If even that fails, playback
+ * ends as if the track had completed - nothing is left to play through.
+ * @param profile The latency profile to use
+ * @return FAIL (saying why) if the stream couldn't be reopened with `profile`
+ */
+PlayerActionResult AudioPlayer::setLatencyProfile(const LatencyProfile profile) {
+    const LatencyProfile previous = latencyProfile.exchange(profile);
+    if (previous == profile) return PlayerActionResult(PlayerActionEnum::PASS);
+    logger.log(Logger::Level::DEBUG, std::string("latency profile set to: ") + LatencySettings::name(profile));
+
+    const bool reopen = sink->isOpen();
+    if (reopen) {
+        sink->close();
+    }
+    LoadedTrack *track = current.load(); // only now - the callback may have just moved on to the next one
+
+    // with the stream closed, the callback can't be holding on to the fading track either
+    const LatencySettings settings = LatencySettings::forProfile(profile);
+    for (LoadedTrack *decoding : {track, next.load(), reopen ? fading : nullptr}) {
+        if (decoding && decoding->decoder) {
+            decoding->decoder->setPacing(settings.pacing(decoding->sampleRate, decoding->channels));
+        }
+    }
+    if (!control.nextPending.load() && preloader.joinable()) {
+        preloader.join(); // already done decoding - this only makes `queued` safe to touch
+    }
+    if (!preloader.joinable() && queued && queued->decoder) {
+        queued->decoder->setPacing(settings.pacing(queued->sampleRate, queued->channels));
+    }
+    if (!reopen) return PlayerActionResult(PlayerActionEnum::PASS);
+
+    // the playback state is left alone - a playing track carries on where it was
+    PaError error = openStream(streamRate, streamChannels, streamFormat);
+    if (error == paNoError && (error = sink->start()) == paNoError) return PlayerActionResult(PlayerActionEnum::PASS);
+    const std::string msg = std::string("Failed to reopen stream with the ") + LatencySettings::name(profile) +
+                            " profile: " + Pa_GetErrorText(error);
+    logger.log(Logger::Level::ERROR, msg);
+
+    // decoders keep the new pacing - it only changes how far ahead they decode
+    sink->close();
+    latencyProfile.store(previous);
+    if (openStream(streamRate, streamChannels, streamFormat) == paNoError && sink->start() == paNoError) {
+        logger.log(Logger::Level::WARNING, std::string("Kept the ") + LatencySettings::name(previous) + " profile");
+        return PlayerActionResult(PlayerActionEnum::FAIL, msg);
+    }
+
+    // no stream at all - without this, frontends would wait on a play head that never moves
+    sink->close();
+    idleStream(PlaybackControl::State::Completed);
+    logger.log(Logger::Level::ERROR, "No stream could be opened - playback stopped");
+    return PlayerActionResult(PlayerActionEnum::FAIL, msg + " (playback stopped)");
+}
+
+/**
+ * @brief Enable crossfading between queued tracks.
+ *
+ * Only applies to tracks that could otherwise be played gaplessly (see `queueNext()`).
+ * @param seconds How long the fade should last. 0 disables crossfading
+ * @param curve The gain curve to fade with
+ */
+void AudioPlayer::setCrossfade(double seconds, CrossfadeCurve curve) {
+    control.crossfadeCurve.store(curve, std::memory_order_relaxed);
+    control.crossfadeSeconds.store(static_cast<float>(std::max(seconds, 0.0)), std::memory_order_relaxed);
+    logger.log(Logger::Level::DEBUG, "crossfade set to: " + std::to_string(seconds) + "s");
+}
+
+double AudioPlayer::getCrossfade() const {
+    return control.crossfadeSeconds.load(std::memory_order_relaxed);
+}
+
 int AudioPlayer::getVolume() {
-    return this->volume;
+    return control.volume.load(std::memory_order_relaxed);
 }
 
 bool AudioPlayer::isPlaying() {
-    return this->_isPlaying;
+    return control.state.load() == PlaybackControl::State::Playing;
 }
 
 bool AudioPlayer::isLoaded() {
-    return this->_isLoaded;
+    return control.state.load() != PlaybackControl::State::Idle;
 }
 
 bool AudioPlayer::isCompleted() {
-    return this->_isComplete;
+    collectRetired();
+    return control.state.load() == PlaybackControl::State::Completed;
 }
 
 
 void AudioPlayer::stop() {
     logger.log(Logger::Level::DEBUG, ".stop() called, resetting state!");
-    if (stream) {
-        Pa_StopStream(stream);
-        Pa_CloseStream(stream);
-        stream = nullptr;
+    // no data - should pretend we aren't complete for safety
+    idleStream(PlaybackControl::State::Idle);
+    cancelNext();
+    collectRetired();
+    delete current.exchange(nullptr); // the callback is idle, so it can no longer be reading from it
+
+    control.seekTarget.store(PlaybackControl::NoSeek);
+    control.position.store(0); // reset the 'play head'
+}
+
+/**
+ * @brief Close the output stream now, rather than keeping it open for the next track.
+ *
+ * The stream otherwise stays open (playing silence) until a track needs a different rate, channel count or format.
+ * A playing track is paused - `play()` opens a new stream and continues where it left off.
+ */
+void AudioPlayer::closeOutput() {
+    auto expected = PlaybackControl::State::Playing;
+    control.state.compare_exchange_strong(expected, PlaybackControl::State::Paused);
+    closeStream();
+}
+
+/**
+ * @brief Render the loaded track to a file as fast as it decodes, rather than playing it.
+ *
+ * Runs the playback callback itself - resampling, volume and all - from the play head to the end of the track, and
+ * writes what it hands out to `outputPath`. The output stream is closed and any queued track dropped first, so the
+ * file holds this one track and nothing else. The track is Completed afterwards, as if it had been played.
+ * @param outputPath Where to write the result. Overwritten if it exists
+ * @param container SF_FORMAT_WAV or SF_FORMAT_FLAC. FLAC holds at most 24-bit ints - anything wider is converted
+ * @param framesWritten Set to the amount of frames written, if not null
+ */
+PlayerActionResult AudioPlayer::render(const std::string& outputPath, const int container, uint64_t *framesWritten) {
+    LoadedTrack *track = current.load();
+    if (!track || (track->audio.empty() && !track->decoder)) {
+        return PlayerActionResult(PlayerActionEnum::NOTREADY, "Current audio buffer is empty. Nothing to render!");
+    }
+    // from here on, this thread is the only one running the callback
+    closeOutput();
+    cancelNext();
+    collectRetired();
+
+    constexpr unsigned long framesPerBuffer = 8192;
+    const bool flac = (container & SF_FORMAT_TYPEMASK) == SF_FORMAT_FLAC;
+    PaStreamCallback *callback = prepareCallback(track->sampleRate, track->channels, track->format, framesPerBuffer, true);
+    const FormatType outputFormat = track->format == FormatType::Int24 ? FormatType::Int32 : track->format;
+
+    SF_INFO info{};
+    info.samplerate = track->sampleRate;
+    info.channels = track->channels;
+    switch (track->format) {
+        case FormatType::Int16: info.format = SF_FORMAT_PCM_16; break;
+        case FormatType::Int24: info.format = SF_FORMAT_PCM_24; break;
+        case FormatType::Int32: info.format = flac ? SF_FORMAT_PCM_24 : SF_FORMAT_PCM_32; break;
+        case FormatType::Float32: info.format = flac ? SF_FORMAT_PCM_24 : SF_FORMAT_FLOAT; break;
+    }
+    info.format |= container & SF_FORMAT_TYPEMASK;
+    SNDFILE *file = sf_open(outputPath.c_str(), SFM_WRITE, &info);
+    if (!file) {
+        const std::string msg = "Failed to create " + outputPath + ": " + sf_strerror(nullptr);
+        logger.log(Logger::Level::ERROR, msg);
+        return PlayerActionResult(PlayerActionEnum::FAIL, msg);
+    }
+    if (outputFormat == FormatType::Float32 && flac) {
+        sf_command(file, SFC_SET_CLIPPING, nullptr, SF_TRUE); // overs would wrap around otherwise
+    }
+    if (track->decoder) {
+        // keep the ring topped up - the default pacing naps for longer than it takes to drain it
+        track->decoder->setPacing(StreamDecoder::Pacing{SIZE_MAX, SIZE_MAX, std::chrono::milliseconds(1)});
+    }
+
+    logger.log(Logger::Level::DEBUG, "Rendering to " + outputPath + "...");
+    std::vector<char> buffer(framesPerBuffer * track->channels * FormatTools::sampleSize(outputFormat));
+    uint64_t frames = 0;
+    bool failed = false;
+    control.state.store(PlaybackControl::State::Playing);
+    while (control.state.load() == PlaybackControl::State::Playing) {
+        const uint64_t before = control.samplesPlayed.load(std::memory_order_relaxed);
+        callback(nullptr, buffer.data(), framesPerBuffer, nullptr, 0, this);
+        // whatever the callback padded with silence isn't part of the track
+        const auto count = static_cast<sf_count_t>((control.samplesPlayed.load(std::memory_order_relaxed) - before) / track->channels);
+        if (count == 0) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1)); // decoder fell behind
+            continue;
+        }
+
+        sf_count_t written = 0;
+        switch (outputFormat) {
+            case FormatType::Int16: written = sf_writef_short(file, reinterpret_cast<const short*>(buffer.data()), count); break;
+            case FormatType::Int32: written = sf_writef_int(file, reinterpret_cast<const int*>(buffer.data()), count); break;
+            case FormatType::Float32: written = sf_writef_float(file, reinterpret_cast<const float*>(buffer.data()), count); break;
+            case FormatType::Int24: break; // unpacked by the callback
+        }
+        if (written != count) {
+            failed = true;
+            break;
+        }
+        frames += count;
+    }
+    sf_close(file);
+    if (framesWritten) {
+        *framesWritten = frames;
+    }
+
+    if (failed) {
+        control.state.store(PlaybackControl::State::Paused);
+        const std::string msg = "Failed writing " + outputPath + " - disk full?";
+        logger.log(Logger::Level::ERROR, msg);
+        return PlayerActionResult(PlayerActionEnum::FAIL, msg);
+    }
+    logger.log(Logger::Level::DEBUG, "Rendered " + std::to_string(frames) + " frames to " + outputPath);
+    return PlayerActionResult(PlayerActionEnum::PASS);
+}
+
+// Take the tracks back from the callback: once this returns, it plays silence and won't touch any track (or the
+// crossfade state) until playback starts again. The stream itself stays open, for the next track to reuse.
+void AudioPlayer::idleStream(const PlaybackControl::State state) {
+    control.state.store(state);
+    waitForCallback();
+    // an unfinished crossfade can never complete
+    delete fading;
+    fading = nullptr;
+}
+
+// Wait out a callback that may have started before the last state change - any callback after it sees the new state.
+void AudioPlayer::waitForCallback() const {
+    const uint64_t runs = control.callbackRuns.load();
+    if (runs % 2 == 0) return;
+    while (control.callbackRuns.load() == runs) {
+        std::this_thread::yield(); // callbacks take microseconds
+    }
+}
+
+// Stop and close the sink's stream, if one is open. Once this returns, the callback is guaranteed not to run.
+void AudioPlayer::closeStream() {
+    if (sink->isOpen()) {
+        sink->close();
     }
-    if (!rawAudio.empty()) {
-        rawAudio.clear();
+    // without a stream, an unfinished crossfade can never complete
+    delete fading;
+    fading = nullptr;
+}
+
+// Wait for any pre-decode to finish, then drop whatever was queued.
+void AudioPlayer::cancelNext() {
+    if (preloader.joinable()) {
+        preloader.join();
     }
+    queued.reset();
+    // the callback claims `next` with a CAS, so whoever swaps it out first owns it
+    delete next.exchange(nullptr);
+    control.nextPending.store(false);
+}
+
+// Free a track the callback has moved on from. The callback never frees memory itself.
+void AudioPlayer::collectRetired() {
+    delete retired.exchange(nullptr);
+}
+
 
-    _isPlaying = false;
-    _isLoaded = false;
-    _isPaused = false;
-    _isComplete = false; // no data - should pretend we aren't complete for safety
-    playbackPos = 0; // reset the 'play head'
+namespace {
+// Marks the audio callback as running for its lifetime (see `AudioPlayer::waitForCallback()`).
+struct CallbackRun {
+    explicit CallbackRun(std::atomic<uint64_t> &runs) : runs(runs) {
+        runs.fetch_add(1);
+    }
+    ~CallbackRun() {
+        runs.fetch_add(1);
+    }
+    std::atomic<uint64_t> &runs;
+};
 }
 
+/**
+ * Get the audio callback instantiated for a format.
+ *
+ * Tracks spliced into an open stream always share its format, so this only has to be decided once per stream.
+ */
+PaStreamCallback *AudioPlayer::callbackFor(const FormatType format) {
+    switch (format) {
+        case FormatType::Int16: return audioCallback<FormatType::Int16>;
+        case FormatType::Int24: return audioCallback<FormatType::Int24>;
+        case FormatType::Int32: return audioCallback<FormatType::Int32>;
+        case FormatType::Float32: return audioCallback<FormatType::Float32>;
+    }
+    return audioCallback<FormatType::Float32>;
+}
 
+template<FormatType Format>
 int AudioPlayer::audioCallback(
     const void *inputBuffer,
     void *outputBuffer,
@@ -308,68 +1104,204 @@ int AudioPlayer::audioCallback(
     PaStreamCallbackFlags statusFlags,
     void *userData
     ) {
+    using Sample = typename SampleTraits<Format>::Type;
     AudioPlayer* player = static_cast<AudioPlayer*>(userData);
+    PlaybackControl &control = player->control;
+    const CallbackRun run(control.callbackRuns);
+    const CallbackStats::Scope timing(player->callbackStats, statusFlags, timeInfo);
+    auto *out = static_cast<Sample*>(outputBuffer);
+
+    // Idle, paused or between tracks - the tracks belong to the controlling thread, so keep the stream fed with silence
+    LoadedTrack *track = player->current.load(std::memory_order_acquire);
+    if (control.state.load() != PlaybackControl::State::Playing || !track) {
+        std::fill(out, out + framesPerBuffer * player->streamChannels, Sample{});
+        return paContinue;
+    }
 
-    // Despite the return call, none of the code following this statement is safe to run if the playbackPos
-    // is greater than or equal to the size of the internal buffer. Thus, we should safely quit here by signalling to
-    // PortAudio that we've completed the playback.
-    if (player->getPos() >= player->rawAudio.size()) {
-        return paComplete;
+    // The callback is the only writer of the play head - seeks are handed over through seekTarget instead.
+    size_t pos = control.position.load(std::memory_order_relaxed);
+    if (const size_t target = control.seekTarget.exchange(PlaybackControl::NoSeek, std::memory_order_relaxed);
+        target != PlaybackControl::NoSeek) {
+        pos = target;
     }
+    const int volume = control.volume.load(std::memory_order_relaxed);
 
-    size_t samplesToWrite = framesPerBuffer * player->numChannels;
-    size_t availableSamples = player->rawAudio.size() - player->getPos();
-    samplesToWrite = std::min(samplesToWrite, availableSamples);
+    const size_t samplesRequested = framesPerBuffer * track->channels;
+    const size_t startPos = pos;
+    size_t samplesWritten = track->read(out, samplesRequested, pos);
+    if (track->decoder && !track->decoder->atEnd()) { // a ring draining at the end of a file isn't falling behind
+        player->callbackStats.recordFill(track->decoder->buffered(), track->decoder->capacity());
+    }
 
-    // choose a volume adjustment function based on the format.
-    // done within this callback for simplicity - shouldn't affect processing speed?
-    switch (player->format) {
-        case FormatType::Int16: {
-            int16_t* out = static_cast<int16_t*>(outputBuffer);
-            const int16_t* in = &player->rawAudio.getInt16Buffer()[player->getPos()];
-            AudioTools::adjustVolumeInt16(in, out, samplesToWrite, player->getVolume());
-            break;
-        }
-        case FormatType::Int24: // no native support - converted into padded Int32
-            [[fallthrough]];
-        case FormatType::Int32: {
-            int32_t* out = static_cast<int32_t*>(outputBuffer);
-            const int32_t* in = &player->rawAudio.getInt32Buffer()[player->getPos()];
-            AudioTools::adjustVolumeInt32(in, out, samplesToWrite, player->getVolume());
-            break;
+    // Crossfade: claim the queued track once the current one's tail is about to play, then mix the two
+    if (!player->fading) {
+        player->beginCrossfade(track, startPos, samplesRequested);
+    }
+    if (player->fading) {
+        return player->crossfadeCallback<Format>(track, out, startPos, pos, samplesWritten, samplesRequested, volume);
+    }
+
+    // Gapless: once the current track runs dry, splice the queued one in right where it stopped.
+    // The old track can't be freed here, so it is parked until the controlling thread collects it.
+    if (samplesWritten < samplesRequested && track->finished(pos)) {
+        LoadedTrack *upcoming = player->next.load(std::memory_order_acquire);
+        // claim the track with a CAS, so the controlling thread can't cancel (and free) it mid-splice
+        if (upcoming && player->retired.load(std::memory_order_relaxed) == nullptr
+            && player->next.compare_exchange_strong(upcoming, nullptr, std::memory_order_acq_rel)) {
+            player->retired.store(track, std::memory_order_release);
+            player->current.store(upcoming, std::memory_order_release);
+            track = upcoming;
+            pos = 0;
+            samplesWritten += track->read(out + samplesWritten, samplesRequested - samplesWritten, pos);
+            control.trackChanges.fetch_add(1, std::memory_order_relaxed);
         }
-        case FormatType::Float32: {
-            float* out = static_cast<float*>(outputBuffer);
-            const float* in = &player->rawAudio.getFloat32Buffer()[player->getPos()];
-            AudioTools::adjustVolumeFloat32(in, out, samplesToWrite, player->getVolume());
-            break;
+    }
+
+    control.samplesPlayed.fetch_add(samplesWritten, std::memory_order_relaxed);
+
+    // tracks hand back raw samples, so volume is applied in place
+    (player->kernels->*SampleTraits<Format>::volume)(out, out, samplesWritten, volume / 100.0f);
+
+    // decoder fell behind (or we're at the end) - fill the gap with silence rather than garbage
+    if (samplesWritten < samplesRequested && !track->finished(pos)) {
+        player->callbackStats.countStarved();
+    }
+    std::fill(out + samplesWritten, out + samplesRequested, Sample{});
+
+    control.position.store(std::min(pos, track->size), std::memory_order_relaxed);
+
+    // done, unless the next track is still being decoded (it can still be spliced in). The stream keeps running
+    // either way, so the following track can reuse it.
+    if (track->finished(pos) && !control.nextPending.load(std::memory_order_relaxed)
+        && player->next.load(std::memory_order_relaxed) == nullptr) {
+        auto expected = PlaybackControl::State::Playing;
+        control.state.compare_exchange_strong(expected, PlaybackControl::State::Completed);
+    }
+    return paContinue;
+}
+
+
+/**
+ * Audio callback for packed 24-bit tracks on devices that only take 32-bit ints.
+ *
+ * Runs the regular Int24 callback into pre-allocated scratch, then unpacks the result into the device's buffer.
+ */
+int AudioPlayer::unpackingCallback(const void *inputBuffer, void *outputBuffer, const unsigned long framesPerBuffer,
+                                   const PaStreamCallbackTimeInfo *timeInfo, const PaStreamCallbackFlags statusFlags,
+                                   void *userData) {
+    AudioPlayer *player = static_cast<AudioPlayer*>(userData);
+    auto *out = static_cast<int32_t*>(outputBuffer);
+    const size_t samples = framesPerBuffer * player->streamChannels;
+    if (samples > player->unpackScratch.size()) { // scratch was sized for a smaller buffer - never allocate here
+        std::fill(out, out + samples, 0);
+        return paContinue;
+    }
+
+    Packed24 *packed = player->unpackScratch.data();
+    const int result = audioCallback<FormatType::Int24>(inputBuffer, packed, framesPerBuffer, timeInfo, statusFlags, userData);
+    player->kernels->unpack24(packed, out, samples);
+    return result;
+}
+
+
+/**
+ * Claim the queued track for a crossfade if crossfading is enabled and the current track is about to enter
+ * its tail. Falls back to a plain gapless splice if the queued track isn't ready in time.
+ *
+ * The curve is sampled into the gain tables here, once per fade, so the callback only interpolates between them.
+ */
+void AudioPlayer::beginCrossfade(const LoadedTrack *track, const size_t startPos, const size_t samplesRequested) {
+    const float seconds = control.crossfadeSeconds.load(std::memory_order_relaxed);
+    if (seconds <= 0.0f) return;
+    if (samplesRequested * 3 > mixScratch.size()) return; // scratch was sized for a smaller buffer - never allocate here
+
+    const size_t fadeSamples = static_cast<size_t>(seconds * track->sampleRate) * track->channels;
+    const size_t remaining = track->size > startPos ? track->size - startPos : 0;
+    if (remaining > fadeSamples + samplesRequested) return; // not in the tail yet
+
+    LoadedTrack *upcoming = next.load(std::memory_order_acquire);
+    if (!upcoming || retired.load(std::memory_order_relaxed) != nullptr
+        || !next.compare_exchange_strong(upcoming, nullptr, std::memory_order_acq_rel)) {
+        return;
+    }
+
+    fading = upcoming;
+    fadePosition = 0;
+    // a fade can't be longer than what's left of either track
+    fadeLength = std::min({fadeSamples, remaining, upcoming->size});
+    fadeLength = std::max(fadeLength - fadeLength % track->channels, static_cast<size_t>(track->channels));
+
+    const CrossfadeCurve curve = control.crossfadeCurve.load(std::memory_order_relaxed);
+    for (size_t step = 0; step <= FadeSteps; ++step) {
+        AudioTools::crossfadeGains(curve, static_cast<float>(step) / FadeSteps, fadeOutTable[step], fadeInTable[step]);
+    }
+}
+
+/**
+ * Crossfading half of the audio callback - mixes the tail of the current track with the head of the incoming one.
+ *
+ * Once the current track is exhausted, the incoming track takes over as the current one.
+ */
+template<FormatType Format>
+int AudioPlayer::crossfadeCallback(LoadedTrack *track, typename SampleTraits<Format>::Type *out, const size_t startPos,
+                                   size_t &pos, const size_t samplesWritten, const size_t samplesRequested,
+                                   const int volume) {
+    using Sample = typename SampleTraits<Format>::Type;
+    const int channels = track->channels;
+
+    // outgoing track may end mid-buffer - it's silent past its end
+    std::fill(out + samplesWritten, out + samplesRequested, Sample{});
+
+    // scratch layout: [outgoing gains][incoming gains][incoming samples]
+    float *gainA = mixScratch.data();
+    float *gainB = gainA + samplesRequested;
+    auto *incoming = reinterpret_cast<Sample*>(gainB + samplesRequested);
+
+    // the incoming track only starts playing once the fade zone is reached (or is paused, if we seeked out of it)
+    const size_t zoneStart = track->size > fadeLength ? track->size - fadeLength : 0;
+    const size_t firstSample = startPos >= zoneStart ? 0 : std::min(samplesRequested, zoneStart - startPos);
+    std::fill(incoming, incoming + firstSample, Sample{});
+    const size_t incomingRead = fading->read(incoming + firstSample, samplesRequested - firstSample, fadePosition);
+    std::fill(incoming + firstSample + incomingRead, incoming + samplesRequested, Sample{});
+
+    // expand the gain tables into per-sample gains (volume included), so the mix itself is a flat loop
+    const float gain = volume / 100.0f;
+    for (size_t frame = 0; frame < samplesRequested / channels; ++frame) {
+        const size_t samplePos = startPos + frame * channels;
+        const float progress = samplePos >= zoneStart ? static_cast<float>(samplePos - zoneStart) / fadeLength : 0.0f;
+        const float x = std::min(progress, 1.0f) * FadeSteps;
+        const size_t step = std::min(static_cast<size_t>(x), FadeSteps - 1);
+        const float t = x - step;
+        const float fadeOut = fadeOutTable[step] + (fadeOutTable[step + 1] - fadeOutTable[step]) * t;
+        const float fadeIn = fadeInTable[step] + (fadeInTable[step + 1] - fadeInTable[step]) * t;
+        for (int c = 0; c < channels; ++c) {
+            gainA[frame * channels + c] = fadeOut * gain;
+            gainB[frame * channels + c] = fadeIn * gain;
         }
     }
 
-    player->setPos(player->getPos() + samplesToWrite);
-    return (player->getPos() >= player->rawAudio.size()) ? paComplete : paContinue;
-}
-// int AudioPlayer::audioCallback(const void *inputBuffer, void *outputBuffer, unsigned long framesPerBuffer, const PaStreamCallbackTimeInfo *timeInfo, PaStreamCallbackFlags statusFlags, void *userData) {
-//     AudioPlayer* player = static_cast<AudioPlayer*>(userData);
-//     float* out = static_cast<float*>(outputBuffer);
-//
-//     size_t samplesToWrite = framesPerBuffer * player->numChannels;
-//     size_t availableSamples = player->rawAudio.size() - player->getPos();
-//     samplesToWrite = std::min(samplesToWrite, availableSamples);
-//
-//     const float* raw = &player->rawAudio.getFloat32Buffer()[player->getPos()];
-//     float gain = player->volume / 100.0f;
-//     for (size_t i = 0; i < samplesToWrite; ++i) {
-//         float scaled = raw[i] * gain;
-//         out[i] = std::clamp(scaled, -1.0f, 1.0f); // assuming normalized float audio
-//     }
-//
-//     player->setPos(player->getPos() + samplesToWrite);
-//     return (player->getPos() >= player->rawAudio.size()) ? paComplete : paContinue;
-//
-// }
+    (kernels->*SampleTraits<Format>::mix)(out, incoming, gainA, gainB, out, samplesRequested);
 
+    // audible up to whichever track ran further into the buffer
+    control.samplesPlayed.fetch_add(std::max(samplesWritten, firstSample + incomingRead), std::memory_order_relaxed);
+    if ((samplesWritten < samplesRequested && !track->finished(pos))
+        || (firstSample + incomingRead < samplesRequested && !fading->finished(fadePosition))) {
+        callbackStats.countStarved();
+    }
 
+    // outgoing track is done - the incoming one takes over (it was already claimed, so `retired` is free)
+    if (track->finished(pos)) {
+        retired.store(track, std::memory_order_release);
+        current.store(fading, std::memory_order_release);
+        track = fading;
+        pos = fadePosition;
+        fading = nullptr;
+        control.trackChanges.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    control.position.store(std::min(pos, track->size), std::memory_order_relaxed);
+    return paContinue;
+}
 
 
 void AudioPlayer::print(std::string text) {
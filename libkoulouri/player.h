@@ -1,15 +1,30 @@
 #pragma once
 #include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
 #include <iostream>
 #include <sndfile.h>
 #include <portaudio.h>
 #include <utility>
 #include <vector>
 #include <map>
+#include <memory>
+#include <string>
+#include <thread>
 #include <unistd.h>
 
 #include "FormatTools.h"
+#include "audiosink.h"
+#include "callbackstats.h"
+#include "latency.h"
+#include "libavinput.h"
 #include "logger.h"
+#include "realtime.h"
+#include "resampler.h"
+#include "streamdecoder.h"
+#include "transcodecache.h"
 
 enum class PlayerActionEnum {
     /**
@@ -82,27 +97,133 @@ public:
 };
 
 
-class FfmpegFile {
+/**
+ * Decodes a file libsndfile can't read by piping it through FFmpeg.
+ *
+ * FFmpeg writes an AU stream (32-bit float) to its stdout, which libsndfile reads as it's being produced - playback
+ * can begin as soon as the first frames arrive, and nothing is written to disk. Pipes can't seek, so seeking
+ * restarts FFmpeg at the new position instead.
+ *
+ * Throws std::runtime_error if FFmpeg (or FFprobe) can't be run or can't decode the file.
+ */
+class FfmpegStream {
 public:
-    explicit FfmpegFile(const std::string &inputPath);
+    explicit FfmpegStream(const std::string &inputPath);
+    ~FfmpegStream();
+
+    FfmpegStream(const FfmpegStream&) = delete;
+    FfmpegStream& operator=(const FfmpegStream&) = delete;
+
+    SNDFILE *open(double startSeconds, SF_INFO &info);
 
-    const std::string &file() const {
-        return tempPath;
+    // Length of the input, as reported by FFprobe. Pipes don't carry one.
+    double duration() const {
+        return seconds;
     }
 
-    ~FfmpegFile() {
-        if (!tempPath.empty()) {
-            unlink(tempPath.c_str());
+private:
+    void closePipe();
+
+    std::string inputPath;
+    int output = -1; // read end of FFmpeg's stdout
+    pid_t process = -1;
+    double seconds = 0.0;
+};
+
+/**
+ * Everything the audio callback shares with the rest of the program.
+ *
+ * All members are atomic, so the real-time callback never has to lock (or even read a half-written value)
+ * while frontends move the play head, change the volume or pause playback.
+ */
+struct PlaybackControl {
+    enum class State : uint8_t {
+        Idle, // nothing loaded
+        Ready, // data loaded, playback not started yet
+        Playing, // playing audio - data loaded
+        Paused, // not playing audio - data still loaded
+        Completed // done playing audio - data still loaded
+    };
+
+    static constexpr size_t NoSeek = SIZE_MAX;
+
+    std::atomic<size_t> position{0}; // play head - only the callback advances it
+    std::atomic<size_t> seekTarget{NoSeek}; // requested play head, picked up by the callback
+    std::atomic<int> volume{0}; // gain, in percent
+    std::atomic<State> state{State::Idle};
+    std::atomic<size_t> trackChanges{0}; // bumped every time the player moves on to a queued track
+    std::atomic<bool> nextPending{false}; // a queued track is still being decoded - don't finish the stream yet
+    std::atomic<float> crossfadeSeconds{0.0f}; // 0 = gapless
+    std::atomic<CrossfadeCurve> crossfadeCurve{CrossfadeCurve::EqualPower};
+    std::atomic<uint64_t> callbackRuns{0}; // bumped as the callback starts and returns - odd while it's running
+    std::atomic<uint64_t> samplesPlayed{0}; // track samples the callback handed out, silence not included
+};
+
+/**
+ * A single opened track, either fully decoded into memory or streamed by a StreamDecoder.
+ *
+ * The audio callback only ever reads from tracks - they are created and destroyed by the controlling thread.
+ */
+class LoadedTrack {
+public:
+    std::string path;
+    AudioBuffer audio; // only used when buffered (or mapped)
+    const void *data = nullptr; // start of `audio`, resolved once so reading never has to visit the variant
+    std::unique_ptr<FfmpegStream> source; // only set for files piped through FFmpeg - must outlive the decoder
+    std::shared_ptr<LibavInput> libav; // only set for files decoded by libav - must outlive the decoder
+    std::unique_ptr<StreamDecoder> decoder; // only set while streaming
+    int sampleRate = 0;
+    int channels = 0;
+    FormatType format = FormatType::Float32;
+    size_t size = 0; // total (interleaved) samples
+    std::unique_ptr<MemoryLock> memoryLock; // realtime mode only - declared last, so it's released before `audio`
+
+    /**
+     * Copy raw samples from the track into `output`, starting at `position`.
+     * @param output Where to write the samples (must fit `samples` samples of the track's format)
+     * @param samples The maximum amount of samples to copy
+     * @param position The play head. Advanced by the amount of samples read
+     * @return How many samples were actually copied
+     */
+    template<typename T>
+    size_t read(T *output, const size_t samples, size_t &position) {
+        if (decoder) {
+            return decoder->read(output, samples, position);
         }
+
+        if (position >= size) return 0;
+        const size_t toRead = std::min(samples, size - position);
+        std::copy_n(static_cast<const T*>(data) + position, toRead, output);
+        position += toRead;
+        return toRead;
     }
 
-private:
-    std::string tempPath;
+    [[nodiscard]] bool finished(size_t position) const;
+    [[nodiscard]] bool compatibleWith(const LoadedTrack &other) const;
 };
 
 class AudioPlayer {
 public:
+    /**
+     * How `load()` should bring audio into memory.
+     */
+    enum class LoadMode {
+        /**
+         * Decode the whole file before playback. Fastest seeking, but memory grows with track length.
+         */
+        Buffered,
+        /**
+         * Decode in small chunks on a background thread while playing. Constant startup time and memory.
+         */
+        Streaming,
+        /**
+         * Buffer short files and stream anything longer than the streaming threshold.
+         */
+        Auto
+    };
+
     AudioPlayer();
+    explicit AudioPlayer(std::unique_ptr<AudioSink> output);
     ~AudioPlayer();
 
     PlayerActionResult load(const std::string& filePath, bool allowConverision, bool forceConversion = false);
@@ -110,55 +231,146 @@ public:
     PlayerActionResult pause();
     PlayerActionResult resume();
     void stop();
+    void closeOutput();
+    PlayerActionResult render(const std::string& outputPath, int container = SF_FORMAT_WAV, uint64_t *framesWritten = nullptr);
     void setVolume(int volume);
     int getVolume();
     bool isLoaded();
     bool isCompleted();
     bool isPlaying();
 
-    size_t getPos() const { return playbackPos; };
+    PlayerActionResult queueNext(const std::string& filePath, bool allowConversion);
+    PlayerActionResult playNext();
+    bool hasNext();
+    size_t getTrackChanges() const { return control.trackChanges.load(); };
+    std::string getCurrentPath() const;
+    void setCrossfade(double seconds, CrossfadeCurve curve = CrossfadeCurve::EqualPower);
+    double getCrossfade() const;
+
+    size_t getPos() const { return control.position.load(std::memory_order_relaxed); };
     double posToSeconds(size_t raw) const {
-        return static_cast<double>(std::clamp(raw, std::size_t{0}, playbackSize)) / (sampleRate * numChannels);
+        const LoadedTrack *track = current.load();
+        if (!track) return 0.0;
+        return static_cast<double>(std::clamp(raw, std::size_t{0}, track->size)) / (track->sampleRate * track->channels);
     };
     size_t secondsToPos(double seconds) const {
-        return static_cast<size_t>(std::clamp(seconds, 0.0, posToSeconds(playbackSize)) * (sampleRate * numChannels));
+        const LoadedTrack *track = current.load();
+        if (!track) return 0;
+        return static_cast<size_t>(std::clamp(seconds, 0.0, posToSeconds(track->size)) * (track->sampleRate * track->channels));
     };
 
-    void setPos(size_t to) {
-        playbackPos = std::clamp(to, std::size_t{0}, rawAudio.size());
-    };
-    size_t getMaxPos() const { return playbackSize; };
+    void setPos(size_t to);
+    size_t getMaxPos() const;
 
-    int getSampleRate() const { return sampleRate; };
-    int getChannels() const { return numChannels; };
+    int getSampleRate() const;
+    int getChannels() const;
+
+    void setLoadMode(LoadMode mode) { loadMode = mode; };
+    LoadMode getLoadMode() const { return loadMode; };
+    void setStreamingThreshold(double seconds) { streamingThreshold = seconds; };
+    void setMemoryMapping(bool enabled) { memoryMapping = enabled; };
+    void setStoragePolicy(StoragePolicy policy);
+    void setBufferBudget(uint64_t bytes);
+    void setRealtime(bool enabled);
+    PlayerActionResult setLatencyProfile(LatencyProfile profile);
+    LatencyProfile getLatencyProfile() const { return latencyProfile.load(); };
+    bool isRealtime() const { return realtime; };
+    RealtimeStatus getRealtimeStatus() const { return Realtime::status(); };
+    BufferPool::Stats getBufferStats() const { return BufferPool::global().stats(); };
+    CallbackStats::Snapshot getCallbackStats() const { return callbackStats.snapshot(); };
+    void resetCallbackStats() { callbackStats.reset(); };
+    StoragePolicy getStoragePolicy() const { return storagePolicy; };
+    void setTranscodeCache(const std::string &directory, uint64_t budgetBytes);
+    void setResampling(bool enabled, ResamplerQuality quality = ResamplerQuality::Balanced);
+    int getDeviceRate() const { return deviceRate; };
+    const AudioSink &getSink() const { return *sink; };
+    bool isStreaming() const;
+    bool isMapped() const;
 
     void print(std::string text);
 
 private:
     Logger logger;
+    std::unique_ptr<AudioSink> sink; // where the callback's output goes - PortAudio unless told otherwise
 
+    // One callback is instantiated per format and picked when the stream opens (see `callbackFor()`),
+    // so the callback itself never has to branch on the format.
+    template<FormatType Format>
     static int audioCallback(const void *inputBuffer, void *outputBuffer,
                              unsigned long framesPerBuffer,
                              const PaStreamCallbackTimeInfo *timeInfo,
                              PaStreamCallbackFlags statusFlags,
                              void *userData);
-    size_t playbackPos = 0;
-    size_t playbackSize = 0;
-
-
-    PaStream *stream;
-    bool _isPlaying; // playing audio - data loaded
-    bool _isComplete; // done playing audio - data still loaded
-    bool _isPaused; // not playing audio - data still loaded
-    bool _isLoaded; // audio loaded
-    std::string currentPath;
-
-    // std::vector<int16_t> rawAudio;
-    AudioBuffer rawAudio;
-    // using VolumeCallback = std::function<void(const void* input, void* output, size_t samples, float volume)>;
-    // std::function<void(const void* input, void* output, size_t samples, float volume)> volumeCallback;
-    int sampleRate;
-    int numChannels;
-    int volume;
-    FormatType format;
+    static PaStreamCallback *callbackFor(FormatType format);
+    static int unpackingCallback(const void *inputBuffer, void *outputBuffer,
+                                 unsigned long framesPerBuffer,
+                                 const PaStreamCallbackTimeInfo *timeInfo,
+                                 PaStreamCallbackFlags statusFlags,
+                                 void *userData);
+
+    void beginCrossfade(const LoadedTrack *track, size_t startPos, size_t samplesRequested);
+    template<FormatType Format>
+    int crossfadeCallback(LoadedTrack *track, typename SampleTraits<Format>::Type *out, size_t startPos, size_t &pos,
+                          size_t samplesWritten, size_t samplesRequested, int volume);
+    PaStreamCallback *prepareCallback(int sampleRate, int channels, FormatType format, unsigned long framesPerBuffer, bool unpack);
+    PaError openStream(int sampleRate, int channels, FormatType format);
+    void idleStream(PlaybackControl::State state);
+    void waitForCallback() const;
+    // What opening a track depends on. Copied before a track is opened, as the preloader opens tracks while the
+    // setters may be running on the controlling thread.
+    struct OpenOptions {
+        LoadMode loadMode;
+        double streamingThreshold;
+        bool memoryMapping;
+        StoragePolicy storagePolicy;
+        bool realtime;
+        LatencyProfile latencyProfile;
+        bool resampling;
+        ResamplerQuality resamplerQuality;
+        int deviceRate;
+        std::shared_ptr<TranscodeCache> transcodeCache; // shared, so a preloader keeps the cache it started with
+    };
+    OpenOptions openOptions() const;
+    PlayerActionResult openTrack(const std::string& filePath, bool allowConversion, bool forceConversion,
+                                 const OpenOptions &options, LoadedTrack &track) const;
+    void closeStream();
+    void cancelNext();
+    void collectRetired();
+
+    // The stream stays open (playing silence while idle) for as long as tracks keep its rate, channels and format.
+    int streamRate = 0;
+    int streamChannels = 0;
+    FormatType streamFormat = FormatType::Float32;
+    PlaybackControl control;
+    CallbackStats callbackStats; // recorded by the callback, read by frontends
+    const VolumeKernels *kernels; // resolved once, rather than on every callback
+
+    // Track handoff. `current` and `next` are read by the callback, which may splice `next` in once `current`
+    // runs dry - the old track is then parked in `retired` until the controlling thread frees it.
+    std::atomic<LoadedTrack*> current{nullptr};
+    std::atomic<LoadedTrack*> next{nullptr};
+    std::atomic<LoadedTrack*> retired{nullptr};
+    std::unique_ptr<LoadedTrack> queued; // decoded ahead, but can't be spliced (format differs)
+    std::thread preloader;
+
+    // crossfade state - owned by the callback while the stream is open
+    LoadedTrack *fading = nullptr; // incoming track, claimed from `next`
+    size_t fadePosition = 0; // play head of the incoming track
+    size_t fadeLength = 0; // in samples
+    static constexpr size_t FadeSteps = 256;
+    std::array<float, FadeSteps + 1> fadeOutTable{}; // the curve, sampled when the fade starts - see beginCrossfade
+    std::array<float, FadeSteps + 1> fadeInTable{};
+    std::vector<float> mixScratch; // sized when the stream opens, so mixing never allocates
+    std::vector<Packed24> unpackScratch; // packed output, for devices that need 24-bit audio unpacked to 32-bit
+
+    LoadMode loadMode = LoadMode::Auto;
+    double streamingThreshold = 300.0; // seconds - anything longer is streamed in Auto mode
+    bool memoryMapping = true; // play uncompressed files straight from a mapping when their samples allow it
+    StoragePolicy storagePolicy = StoragePolicy::Exact;
+    bool realtime = false; // lock playback buffers in memory and raise decoder thread priority
+    std::atomic<LatencyProfile> latencyProfile{LatencyProfile::Balanced}; // atomic, so frontends can read it from any thread
+    std::shared_ptr<TranscodeCache> transcodeCache; // keeps FFmpeg conversions around between plays, if set
+    bool resampling = false; // convert tracks to the device's rate (as floats, unmapped), rather than making the device do it
+    ResamplerQuality resamplerQuality = ResamplerQuality::Balanced;
+    int deviceRate = 0; // the sink's native rate - 0 if unknown, or if it takes any
 };
@@ -0,0 +1,159 @@
+#include "realtime.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <mutex>
+#include <pthread.h>
+#include <sched.h>
+#include <string>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <vector>
+
+#include "logger.h"
+
+namespace {
+
+// Below the priorities audio servers (and PortAudio's own callback thread) use - decoders feed the callback,
+// they shouldn't preempt it.
+constexpr int fifoPriority = 10;
+constexpr int niceLevel = -10;
+
+// Only the first fallback of each kind is worth a warning - every track after it would fail the same way.
+void reportOnce(std::atomic<bool> &reported, const std::string &message) {
+    const bool first = !reported.exchange(true, std::memory_order_relaxed);
+    Logger::g_log("libkoulouri", first ? Logger::Level::WARNING : Logger::Level::DEBUG, "realtime", message);
+}
+
+std::atomic<bool> lockReported{false};
+std::atomic<bool> schedulingReported{false};
+
+// mlock doesn't count - one munlock releases a page however many times it was locked. Buffers that share a page
+// (or the same buffer locked twice) would unlock each other, so every live lock's pages are kept here, and
+// only pages no other lock covers get unlocked.
+struct PageRange {
+    uintptr_t start;
+    uintptr_t end;
+};
+std::mutex lockedMutex;
+std::vector<PageRange> lockedRanges;
+
+PageRange pagesOf(const void *data, const size_t bytes) {
+    const auto pageSize = static_cast<uintptr_t>(sysconf(_SC_PAGESIZE));
+    const auto address = reinterpret_cast<uintptr_t>(data);
+    return {address & ~(pageSize - 1), (address + bytes + pageSize - 1) & ~(pageSize - 1)};
+}
+
+} // namespace
+
+std::atomic<uint64_t> Realtime::lockedBytes{0};
+std::atomic<uint64_t> Realtime::lockFailures{0};
+std::atomic<uint64_t> Realtime::fifoThreads{0};
+std::atomic<uint64_t> Realtime::niceThreads{0};
+std::atomic<uint64_t> Realtime::normalThreads{0};
+
+/**
+ * Raise the calling thread's priority as far as the process is allowed: SCHED_FIFO if possible, a high nice level
+ * otherwise. Failures are reported through the logger (and `status()`), never thrown.
+ * @return The scheduling the thread ended up with
+ */
+Realtime::Scheduling Realtime::promoteCurrentThread() {
+    sched_param param{};
+    param.sched_priority = fifoPriority;
+    const int fifoError = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+    if (fifoError == 0) {
+        fifoThreads.fetch_add(1, std::memory_order_relaxed);
+        return Scheduling::Fifo;
+    }
+
+    // Linux applies nice levels per thread, given the thread id
+    const auto tid = static_cast<id_t>(syscall(SYS_gettid));
+    if (setpriority(PRIO_PROCESS, tid, niceLevel) == 0) {
+        niceThreads.fetch_add(1, std::memory_order_relaxed);
+        reportOnce(schedulingReported, "SCHED_FIFO not permitted (" + std::string(strerror(fifoError)) +
+                                       "), decoding at nice " + std::to_string(niceLevel) + " instead");
+        return Scheduling::Nice;
+    }
+
+    normalThreads.fetch_add(1, std::memory_order_relaxed);
+    reportOnce(schedulingReported, "Neither SCHED_FIFO nor a raised nice level is permitted (" +
+                                   std::string(strerror(errno)) + ") - decoding at normal priority");
+    return Scheduling::Normal;
+}
+
+/**
+ * Touch every page of a region, so it's resident before the audio callback reads it.
+ */
+void Realtime::prefault(const void *data, const size_t bytes) {
+    const auto pageSize = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    const volatile char *bytesIn = static_cast<const volatile char *>(data);
+    for (size_t offset = 0; offset < bytes; offset += pageSize) {
+        (void) bytesIn[offset];
+    }
+}
+
+/**
+ * A snapshot of what the realtime mode has managed to apply so far, across every AudioPlayer in the process.
+ */
+RealtimeStatus Realtime::status() {
+    return {
+        lockedBytes.load(std::memory_order_relaxed),
+        lockFailures.load(std::memory_order_relaxed),
+        fifoThreads.load(std::memory_order_relaxed),
+        niceThreads.load(std::memory_order_relaxed),
+        normalThreads.load(std::memory_order_relaxed)
+    };
+}
+
+/**
+ * Lock (or, failing that, prefault) a region of memory.
+ * @param data Start of the region
+ * @param bytes Length of the region
+ */
+MemoryLock::MemoryLock(const void *data, const size_t bytes) : data(data), bytes(bytes) {
+    if (!data || bytes == 0) return;
+
+    // mlock faults every page in itself
+    std::unique_lock lock(lockedMutex);
+    if (mlock(data, bytes) == 0) {
+        lockedRanges.push_back(pagesOf(data, bytes));
+        lock.unlock();
+        isLocked = true;
+        Realtime::lockedBytes.fetch_add(bytes, std::memory_order_relaxed);
+        return;
+    }
+    lock.unlock();
+
+    Realtime::lockFailures.fetch_add(1, std::memory_order_relaxed);
+    reportOnce(lockReported, "Could not lock " + std::to_string(bytes) + " bytes (" + std::string(strerror(errno)) +
+                             ") - prefaulting only. Raise RLIMIT_MEMLOCK (ulimit -l) to lock playback buffers");
+    Realtime::prefault(data, bytes);
+}
+
+MemoryLock::~MemoryLock() {
+    if (!isLocked) return;
+    Realtime::lockedBytes.fetch_sub(bytes, std::memory_order_relaxed);
+
+    const PageRange own = pagesOf(data, bytes);
+    std::lock_guard lock(lockedMutex);
+    lockedRanges.erase(std::find_if(lockedRanges.begin(), lockedRanges.end(), [&](const PageRange &range) {
+        return range.start == own.start && range.end == own.end;
+    }));
+
+    // unlock the gaps between whatever other locks still overlap this one
+    std::vector<PageRange> held;
+    for (const PageRange &range : lockedRanges) {
+        if (range.start < own.end && range.end > own.start) held.push_back(range);
+    }
+    std::sort(held.begin(), held.end(), [](const PageRange &a, const PageRange &b) { return a.start < b.start; });
+
+    uintptr_t from = own.start;
+    for (const PageRange &range : held) {
+        if (range.start > from) munlock(reinterpret_cast<void *>(from), range.start - from);
+        from = std::max(from, range.end);
+    }
+    if (from < own.end) munlock(reinterpret_cast<void *>(from), own.end - from);
+}
@@ -0,0 +1,63 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * How much of the realtime setup could actually be applied - unprivileged processes usually get less than asked for.
+ */
+struct RealtimeStatus {
+    uint64_t lockedBytes; // playback memory currently locked into RAM
+    uint64_t lockFailures; // buffers that could only be prefaulted, not locked (RLIMIT_MEMLOCK too low)
+    uint64_t fifoThreads; // decoder threads running with SCHED_FIFO
+    uint64_t niceThreads; // decoder threads that fell back to a raised nice level
+    uint64_t normalThreads; // decoder threads left at normal priority (no CAP_SYS_NICE/RLIMIT_RTPRIO/RLIMIT_NICE)
+};
+
+/**
+ * Helpers for keeping playback going while the rest of the system is under load.
+ */
+class Realtime {
+public:
+    enum class Scheduling {
+        Fifo,
+        Nice,
+        Normal
+    };
+
+    static Scheduling promoteCurrentThread();
+    static void prefault(const void *data, size_t bytes);
+    static RealtimeStatus status();
+
+private:
+    friend class MemoryLock;
+
+    static std::atomic<uint64_t> lockedBytes;
+    static std::atomic<uint64_t> lockFailures;
+    static std::atomic<uint64_t> fifoThreads;
+    static std::atomic<uint64_t> niceThreads;
+    static std::atomic<uint64_t> normalThreads;
+};
+
+/**
+ * Keeps a region of memory resident (`mlock`) for as long as it exists, so the audio callback never waits on a
+ * page fault. Pages are faulted in up front either way - if locking isn't permitted, they're only prefaulted.
+ * Locks may overlap: a page stays locked until every MemoryLock covering it is gone.
+ *
+ * Must be destroyed before the memory it covers is freed.
+ */
+class MemoryLock {
+public:
+    MemoryLock(const void *data, size_t bytes);
+    ~MemoryLock();
+
+    MemoryLock(const MemoryLock&) = delete;
+    MemoryLock& operator=(const MemoryLock&) = delete;
+
+    [[nodiscard]] bool locked() const { return isLocked; };
+
+private:
+    const void *data;
+    size_t bytes;
+    bool isLocked = false;
+};
@@ -0,0 +1,96 @@
+#include "renderer.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <filesystem>
+#include <mutex>
+#include <thread>
+
+/**
+ * @param options How to process every track
+ */
+Renderer::Renderer(RenderOptions options) : options(options) {}
+
+/**
+ * Render every job, spread over `options.threads` threads. Blocks until all of them are done.
+ * @param jobs What to render, and where to
+ * @param progress Called (from the worker threads, one at a time) as each job finishes
+ * @return One result per job, in the same order
+ */
+std::vector<RenderResult> Renderer::render(const std::vector<RenderJob> &jobs, const Progress &progress) const {
+    std::vector<RenderResult> results(jobs.size());
+    unsigned threads = options.threads > 0 ? options.threads : std::max(1u, std::thread::hardware_concurrency());
+    threads = static_cast<unsigned>(std::min<size_t>(threads, jobs.size()));
+
+    std::atomic<size_t> nextJob{0};
+    std::mutex progressMutex;
+    size_t done = 0;
+    auto work = [&] {
+        // one player per thread - its tracks, scratch buffers and callback state are its own
+        AudioPlayer player(std::make_unique<NullSink>(options.sampleRate, 0.0));
+        player.setLoadMode(AudioPlayer::LoadMode::Auto);
+        player.setResampling(options.sampleRate > 0, options.quality);
+        player.setStoragePolicy(options.storagePolicy);
+        player.setVolume(options.volume);
+
+        for (size_t i = nextJob.fetch_add(1); i < jobs.size(); i = nextJob.fetch_add(1)) {
+            results[i] = renderOne(player, jobs[i]);
+            if (progress) {
+                std::lock_guard lock(progressMutex);
+                progress(results[i], ++done, jobs.size());
+            }
+        }
+    };
+
+    std::vector<std::thread> workers;
+    for (unsigned i = 1; i < threads; i++) {
+        workers.emplace_back(work);
+    }
+    if (threads > 0) {
+        work(); // the calling thread pulls its weight too
+    }
+    for (std::thread &worker : workers) {
+        worker.join();
+    }
+    return results;
+}
+
+RenderResult Renderer::renderOne(AudioPlayer &player, const RenderJob &job) const {
+    const auto start = std::chrono::steady_clock::now();
+    RenderResult result;
+    result.job = job;
+    result.result = player.load(job.input, options.allowConversion);
+    if (result.result) {
+        result.sampleRate = player.getSampleRate();
+        const int container = options.format == RenderFormat::Flac ? SF_FORMAT_FLAC : SF_FORMAT_WAV;
+        result.result = player.render(job.output, container, &result.frames);
+    }
+    result.wallSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return result;
+}
+
+/**
+ * Where to render `input` to, inside `directory`. Numbered by the track's place in the queue, so a playlist keeps
+ * its order and tracks sharing a name don't overwrite each other.
+ * @param input The file being rendered
+ * @param directory The directory to render into
+ * @param format Decides the extension
+ * @param index The track's place in the queue, from 0
+ */
+std::string Renderer::outputPathFor(const std::string &input, const std::string &directory, const RenderFormat format,
+                                    const size_t index) {
+    char number[32];
+    std::snprintf(number, sizeof(number), "%03zu - ", index + 1);
+    const std::string name = number + std::filesystem::path(input).stem().string() + "." + formatName(format);
+    return (std::filesystem::path(directory) / name).string();
+}
+
+const char *Renderer::formatName(const RenderFormat format) {
+    switch (format) {
+        case RenderFormat::Wav: return "wav";
+        case RenderFormat::Flac: return "flac";
+    }
+    return "wav";
+}
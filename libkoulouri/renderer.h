@@ -0,0 +1,73 @@
+#pragma once
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "player.h"
+
+/**
+ * Container a Renderer writes.
+ */
+enum class RenderFormat {
+    Wav, // in the track's own sample format
+    Flac // 16 or 24-bit ints
+};
+
+/**
+ * How a Renderer processes its tracks.
+ */
+struct RenderOptions {
+    int sampleRate = 0; // resample everything to this rate - 0 keeps each track's own
+    ResamplerQuality quality = ResamplerQuality::Balanced;
+    int volume = 100; // in percent, as with AudioPlayer::setVolume()
+    RenderFormat format = RenderFormat::Wav;
+    unsigned threads = 0; // tracks rendered at once - 0 uses every core
+    bool allowConversion = true; // pipe formats libsndfile can't read through FFmpeg
+    StoragePolicy storagePolicy = StoragePolicy::Exact;
+};
+
+/**
+ * One input file and where its rendering goes.
+ */
+struct RenderJob {
+    std::string input;
+    std::string output;
+};
+
+/**
+ * What came of a RenderJob.
+ */
+struct RenderResult {
+    RenderJob job;
+    PlayerActionResult result = PlayerActionResult(PlayerActionEnum::NOTREADY);
+    uint64_t frames = 0; // written
+    int sampleRate = 0; // of the output
+    double wallSeconds = 0.0; // spent loading and rendering
+
+    [[nodiscard]] double audioSeconds() const { return sampleRate > 0 ? static_cast<double>(frames) / sampleRate : 0.0; };
+};
+
+/**
+ * Renders tracks to files as fast as the CPU allows, through the same decode, resample and volume path playback
+ * uses (see `AudioPlayer::render()`).
+ *
+ * Tracks are independent, so they are spread over a pool of threads, each with its own AudioPlayer. Results keep
+ * the order of the jobs, whichever finishes first. The totals double as a throughput benchmark of the pipeline.
+ */
+class Renderer {
+public:
+    using Progress = std::function<void(const RenderResult &result, size_t done, size_t total)>;
+
+    explicit Renderer(RenderOptions options = {});
+
+    std::vector<RenderResult> render(const std::vector<RenderJob> &jobs, const Progress &progress = nullptr) const;
+
+    static std::string outputPathFor(const std::string &input, const std::string &directory, RenderFormat format, size_t index);
+    static const char *formatName(RenderFormat format);
+
+private:
+    RenderResult renderOne(AudioPlayer &player, const RenderJob &job) const;
+
+    RenderOptions options;
+};
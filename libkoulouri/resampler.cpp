@@ -0,0 +1,278 @@
+#include "resampler.h"
+
+#include <algorithm>
+#include <cmath>
+#include <numeric>
+#include <stdexcept>
+#include <string>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define KOULOURI_X86 1
+#include <immintrin.h>
+#endif
+
+namespace {
+
+struct QualityPreset {
+    size_t taps;
+    double beta; // Kaiser window shape - higher means more stopband attenuation, but a wider transition band
+    double cutoff; // filter center, as a fraction of the lower Nyquist frequency
+};
+
+// Cutoffs are placed so each filter's transition band ends right around Nyquist.
+QualityPreset presetFor(const ResamplerQuality quality) {
+    switch (quality) {
+        case ResamplerQuality::Fast: return {16, 6.0, 0.76};
+        case ResamplerQuality::Balanced: return {32, 8.0, 0.84};
+        case ResamplerQuality::Best: return {64, 10.0, 0.90};
+    }
+    return {32, 8.0, 0.84};
+}
+
+constexpr size_t maxPhases = 1024; // unusual rate pairs (e.g. 44100 -> 47999) share the closest phase instead
+constexpr size_t maxTaps = 1024;
+constexpr int maxRatio = 8; // beyond this, filters get long enough that the source is better off converted upfront
+
+// zeroth order modified Bessel function of the first kind, for the Kaiser window
+double besselI0(const double x) {
+    double sum = 1.0, term = 1.0;
+    for (int k = 1; k < 50; ++k) {
+        term *= (x / (2.0 * k)) * (x / (2.0 * k));
+        sum += term;
+        if (term < sum * 1e-12) break;
+    }
+    return sum;
+}
+
+// dot products - the only hot loop. Taps are always a multiple of 8, but tails are handled anyway.
+
+float dotScalar(const float *a, const float *b, const size_t n) {
+    // independent accumulators, so the adds can overlap
+    float s0 = 0.0f, s1 = 0.0f, s2 = 0.0f, s3 = 0.0f;
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        s0 += a[i] * b[i];
+        s1 += a[i + 1] * b[i + 1];
+        s2 += a[i + 2] * b[i + 2];
+        s3 += a[i + 3] * b[i + 3];
+    }
+    for (; i < n; ++i) s0 += a[i] * b[i];
+    return (s0 + s1) + (s2 + s3);
+}
+
+#ifdef KOULOURI_X86
+__attribute__((target("sse2")))
+float dotSse2(const float *a, const float *b, const size_t n) {
+    __m128 sum = _mm_setzero_ps();
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        sum = _mm_add_ps(sum, _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+    }
+    alignas(16) float lanes[4];
+    _mm_store_ps(lanes, sum);
+    float total = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+    for (; i < n; ++i) total += a[i] * b[i];
+    return total;
+}
+
+__attribute__((target("avx2,fma")))
+float dotAvx2(const float *a, const float *b, const size_t n) {
+    __m256 sum0 = _mm256_setzero_ps();
+    __m256 sum1 = _mm256_setzero_ps();
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        sum0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), sum0);
+        sum1 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8), sum1);
+    }
+    for (; i + 8 <= n; i += 8) {
+        sum0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), sum0);
+    }
+    const __m256 sum = _mm256_add_ps(sum0, sum1);
+    __m128 half = _mm_add_ps(_mm256_castps256_ps128(sum), _mm256_extractf128_ps(sum, 1));
+    half = _mm_add_ps(half, _mm_movehl_ps(half, half));
+    half = _mm_add_ss(half, _mm_shuffle_ps(half, half, 1));
+    float total = _mm_cvtss_f32(half);
+    for (; i < n; ++i) total += a[i] * b[i];
+    return total;
+}
+#endif
+
+using DotFn = float (*)(const float *, const float *, size_t);
+
+DotFn selectDot() {
+#ifdef KOULOURI_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) return dotAvx2;
+    if (__builtin_cpu_supports("sse2")) return dotSse2;
+#endif
+    return dotScalar;
+}
+
+const DotFn dot = selectDot();
+
+} // namespace
+
+/**
+ * Create a resampler and precompute its filter bank.
+ * @param inputRate The sample rate of the audio fed into `process()`
+ * @param outputRate The sample rate to convert to
+ * @param channels The amount of interleaved channels
+ * @param quality How long (and sharp) the filters should be
+ */
+Resampler::Resampler(const int inputRate, const int outputRate, const int channels, const ResamplerQuality quality)
+    : inputRate(inputRate), outputRate(outputRate), channels(channels) {
+    if (inputRate <= 0 || outputRate <= 0 || channels <= 0) {
+        throw std::runtime_error("Invalid resampler configuration");
+    }
+    if (inputRate > outputRate * maxRatio || outputRate > inputRate * maxRatio) {
+        throw std::runtime_error("Unsupported resampling ratio: " + std::to_string(inputRate) + " -> " + std::to_string(outputRate));
+    }
+    const uint64_t divisor = std::gcd(static_cast<uint64_t>(inputRate), static_cast<uint64_t>(outputRate));
+    up = outputRate / divisor;
+    down = inputRate / divisor;
+    phases = std::min<uint64_t>(up, maxPhases);
+
+    // when downsampling, the cutoff drops with the ratio - widen the filter to keep the same transition steepness
+    const QualityPreset preset = presetFor(quality);
+    const double ratio = std::min(1.0, static_cast<double>(up) / down);
+    taps = static_cast<size_t>(std::ceil(preset.taps / ratio / 8.0)) * 8;
+    taps = std::min(taps, maxTaps);
+
+    const double cutoff = preset.cutoff * ratio;
+    const double halfWidth = taps / 2.0;
+    const double pad = taps / 2.0 - 1.0; // taps before the center
+    const double pi = std::acos(-1.0);
+    const double windowScale = besselI0(preset.beta);
+
+    filters.resize(phases * taps);
+    for (size_t p = 0; p < phases; ++p) {
+        const double fraction = static_cast<double>(p) / phases;
+        float *coeffs = filters.data() + p * taps;
+        double sum = 0.0;
+        for (size_t j = 0; j < taps; ++j) {
+            const double x = fraction + pad - j; // distance from the output sample, in input samples
+            const double sinc = x == 0.0 ? 1.0 : std::sin(pi * cutoff * x) / (pi * cutoff * x);
+            const double edge = x / halfWidth;
+            const double window = edge * edge < 1.0 ? besselI0(preset.beta * std::sqrt(1.0 - edge * edge)) / windowScale : 0.0;
+            const double value = cutoff * sinc * window;
+            coeffs[j] = static_cast<float>(value);
+            sum += value;
+        }
+        // unity gain at DC for every phase, or the interpolation would ripple
+        for (size_t j = 0; j < taps; ++j) {
+            coeffs[j] = static_cast<float>(coeffs[j] / sum);
+        }
+    }
+
+    reset();
+}
+
+/**
+ * Convert a block of audio. Any input the filters can't reach yet is kept for the next call.
+ * @param input Interleaved input samples
+ * @param inputFrames The amount of frames in `input`
+ * @param output Where to write converted samples - must fit `maxOutputFrames(inputFrames)` frames
+ * @return How many frames were written
+ */
+size_t Resampler::process(const float *input, const size_t inputFrames, float *output) {
+    for (int c = 0; c < channels; ++c) {
+        std::vector<float> &channel = history[c];
+        const size_t start = channel.size();
+        channel.resize(start + inputFrames);
+        for (size_t i = 0; i < inputFrames; ++i) {
+            channel[start + i] = input[i * channels + c];
+        }
+    }
+    inputCount += inputFrames;
+    return produce(output, SIZE_MAX);
+}
+
+/**
+ * Convert whatever input is still held back, as if the input was followed by silence.
+ *
+ * Call once the input has ended, so the last few milliseconds aren't lost.
+ * @param output Where to write converted samples - must fit `maxOutputFrames(0)` frames
+ * @return How many frames were written
+ */
+size_t Resampler::flush(float *output) {
+    for (auto &channel : history) {
+        channel.resize(channel.size() + taps / 2, 0.0f);
+    }
+    // stop where the input ended, not where the padding does
+    const uint64_t scaledInput = static_cast<uint64_t>(inputCount) * up;
+    const size_t expected = scaledInput > startPhase ? (scaledInput - startPhase + down - 1) / down : 0;
+    return produce(output, expected > outputCount ? expected - outputCount : 0);
+}
+
+/**
+ * Forget all buffered input, e.g. after seeking.
+ * @param outputFrame The output frame the next call to `process()` starts at. The input should start at
+ * `inputFrameFor(outputFrame)`
+ */
+void Resampler::reset(const size_t outputFrame) {
+    phase = static_cast<uint64_t>(outputFrame) * down % up;
+    startPhase = phase;
+    center = 0;
+    base = 0;
+    inputCount = 0;
+    outputCount = 0;
+    // the frames before the first input are treated as silence
+    history.assign(channels, std::vector<float>(taps / 2 - 1, 0.0f));
+}
+
+/**
+ * An upper bound on the frames a single `process()` (or `flush()`) call can produce.
+ */
+size_t Resampler::maxOutputFrames(const size_t inputFrames) const {
+    return (inputFrames + taps) * up / down + 2;
+}
+
+/**
+ * How many frames `inputFrames` frames of input turn into, from start to end.
+ */
+size_t Resampler::outputFramesFor(const size_t inputFrames) const {
+    return (static_cast<uint64_t>(inputFrames) * up + down - 1) / down;
+}
+
+/**
+ * The input frame an output frame lines up with (rounded down).
+ */
+size_t Resampler::inputFrameFor(const size_t outputFrame) const {
+    return static_cast<uint64_t>(outputFrame) * down / up;
+}
+
+const char *Resampler::qualityName(const ResamplerQuality quality) {
+    switch (quality) {
+        case ResamplerQuality::Fast: return "fast";
+        case ResamplerQuality::Balanced: return "balanced";
+        case ResamplerQuality::Best: return "best";
+    }
+    return "unknown";
+}
+
+// Produce as many frames as the buffered input allows (up to `limit`), then drop input no output needs anymore.
+size_t Resampler::produce(float *output, const size_t limit) {
+    // history index 0 holds frame `base` - the window of the output centered on `center` starts at that index,
+    // as the history carries (taps / 2 - 1) frames of padding in front
+    const size_t available = base + history[0].size();
+    size_t produced = 0;
+    while (produced < limit && center + taps <= available) {
+        const size_t filter = phases == up ? phase : phase * phases / up;
+        const float *coeffs = filters.data() + filter * taps;
+        for (int c = 0; c < channels; ++c) {
+            output[produced * channels + c] = dot(history[c].data() + (center - base), coeffs, taps);
+        }
+        ++produced;
+        phase += down;
+        center += phase / up;
+        phase %= up;
+    }
+    outputCount += produced;
+
+    const size_t consumed = std::min(center - base, history[0].size());
+    for (auto &channel : history) {
+        channel.erase(channel.begin(), channel.begin() + static_cast<std::ptrdiff_t>(consumed));
+    }
+    base += consumed;
+    return produced;
+}
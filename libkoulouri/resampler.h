@@ -0,0 +1,62 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/**
+ * Trade-off between CPU time and accuracy for Resampler.
+ */
+enum class ResamplerQuality {
+    Fast, // 16 taps - ~70dB SNR, rolls off the top octave early
+    Balanced, // 32 taps - ~85dB SNR, transparent for most listening
+    Best // 64 taps - ~115dB SNR, flat to ~19kHz at 44.1kHz
+};
+
+/**
+ * Polyphase windowed-sinc sample rate converter for interleaved 32-bit float audio.
+ *
+ * The conversion ratio is reduced to a fraction L/M, and one Kaiser-windowed sinc filter is precomputed per
+ * output phase. Each output sample is then a single dot product (vectorized for the running CPU) over a
+ * de-interleaved history, with no per-sample trig or division.
+ *
+ * Meant for decoder threads - `process()` may grow internal buffers and is not real-time safe.
+ *
+ * Throws std::runtime_error for invalid rates, or ratios beyond 8:1 either way.
+ */
+class Resampler {
+public:
+    Resampler(int inputRate, int outputRate, int channels, ResamplerQuality quality = ResamplerQuality::Balanced);
+
+    size_t process(const float *input, size_t inputFrames, float *output);
+    size_t flush(float *output);
+    void reset(size_t outputFrame = 0);
+
+    [[nodiscard]] size_t maxOutputFrames(size_t inputFrames) const;
+    [[nodiscard]] size_t outputFramesFor(size_t inputFrames) const;
+    [[nodiscard]] size_t inputFrameFor(size_t outputFrame) const;
+
+    [[nodiscard]] int getInputRate() const { return inputRate; };
+    [[nodiscard]] int getOutputRate() const { return outputRate; };
+
+    static const char *qualityName(ResamplerQuality quality);
+
+private:
+    size_t produce(float *output, size_t limit);
+
+    int inputRate;
+    int outputRate;
+    int channels;
+    size_t taps; // per phase - always a multiple of 8
+    uint64_t up; // L - output rate, reduced
+    uint64_t down; // M - input rate, reduced
+    size_t phases; // filters in the bank (only fewer than `up` for unusual rate pairs)
+    std::vector<float> filters; // phases * taps coefficients
+
+    std::vector<std::vector<float>> history; // per channel, starting at input frame `base`
+    size_t base = 0; // input frame (relative to the last reset) held at history[c][0]
+    size_t center = 0; // input frame the next output sample is centered on
+    uint64_t phase = 0; // position between `center` and `center + 1`, in 1/up steps
+    uint64_t startPhase = 0; // `phase` right after the last reset
+    size_t inputCount = 0; // frames fed in since the last reset
+    size_t outputCount = 0; // frames produced since the last reset
+};
@@ -0,0 +1,104 @@
+#include "ringbuffer.h"
+
+#include <algorithm>
+#include <cstring>
+
+/**
+ * Create a new ring buffer.
+ * @param capacity The minimum amount of samples the buffer should hold (rounded up to a power of two)
+ * @param sampleBytes The size of a single sample, in bytes
+ */
+SpscRingBuffer::SpscRingBuffer(const size_t capacity, const size_t sampleBytes) : sampleBytes(sampleBytes) {
+    size_t rounded = 1;
+    while (rounded < capacity) {
+        rounded <<= 1;
+    }
+    mask = rounded - 1;
+    storage.resize(rounded * sampleBytes);
+}
+
+/**
+ * Copy as many samples as will fit into the buffer.
+ *
+ * Producer only.
+ * @param input The samples to write
+ * @param samples The amount of samples in `input`
+ * @return How many samples were written
+ */
+size_t SpscRingBuffer::write(const void *input, const size_t samples) {
+    const uint64_t write = writeIndex.load(std::memory_order_relaxed);
+    const uint64_t read = readIndex.load(std::memory_order_acquire);
+    const size_t toWrite = std::min(samples, capacity() - static_cast<size_t>(write - read));
+
+    // copy in (at most) two parts - up to the end of storage, then from the start
+    const size_t start = write & mask;
+    const size_t first = std::min(toWrite, capacity() - start);
+    const auto *in = static_cast<const char *>(input);
+    std::memcpy(storage.data() + start * sampleBytes, in, first * sampleBytes);
+    std::memcpy(storage.data(), in + first * sampleBytes, (toWrite - first) * sampleBytes);
+
+    writeIndex.store(write + toWrite, std::memory_order_release);
+    return toWrite;
+}
+
+/**
+ * Mark everything written so far as stale. The consumer will skip over it on its next read.
+ *
+ * Producer only. Typically used after seeking, where already decoded audio no longer matters.
+ */
+void SpscRingBuffer::discard() {
+    discardMark.store(writeIndex.load(std::memory_order_relaxed), std::memory_order_relaxed);
+    discardEpoch.fetch_add(1, std::memory_order_release);
+}
+
+/**
+ * How many samples can currently be written without overwriting unread data.
+ */
+size_t SpscRingBuffer::writeAvailable() const {
+    const uint64_t write = writeIndex.load(std::memory_order_relaxed);
+    const uint64_t read = readIndex.load(std::memory_order_acquire);
+    return capacity() - static_cast<size_t>(write - read);
+}
+
+/**
+ * Copy up to `samples` samples out of the buffer.
+ *
+ * Consumer only. Never blocks or allocates.
+ * @param output Where to write the samples
+ * @param samples The maximum amount of samples to read
+ * @param discarded Optional. Set to true if a discard requested by the producer was applied during this read
+ * @return How many samples were read
+ */
+size_t SpscRingBuffer::read(void *output, const size_t samples, bool *discarded) {
+    uint64_t read = readIndex.load(std::memory_order_relaxed);
+
+    const uint64_t epoch = discardEpoch.load(std::memory_order_acquire);
+    if (epoch != seenEpoch) {
+        seenEpoch = epoch;
+        read = std::max(read, discardMark.load(std::memory_order_relaxed));
+        if (discarded) *discarded = true;
+    }
+
+    const uint64_t write = writeIndex.load(std::memory_order_acquire);
+    const size_t toRead = std::min(samples, static_cast<size_t>(write - read));
+
+    const size_t start = read & mask;
+    const size_t first = std::min(toRead, capacity() - start);
+    auto *out = static_cast<char *>(output);
+    std::memcpy(out, storage.data() + start * sampleBytes, first * sampleBytes);
+    std::memcpy(out + first * sampleBytes, storage.data(), (toRead - first) * sampleBytes);
+
+    readIndex.store(read + toRead, std::memory_order_release);
+    return toRead;
+}
+
+/**
+ * How many samples are currently waiting to be read.
+ *
+ * Note, this may include samples that a pending discard is about to skip.
+ */
+size_t SpscRingBuffer::readAvailable() const {
+    const uint64_t read = readIndex.load(std::memory_order_relaxed);
+    const uint64_t write = writeIndex.load(std::memory_order_acquire);
+    return static_cast<size_t>(write - read);
+}
@@ -0,0 +1,49 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/**
+ * Wait-free single-producer/single-consumer ring buffer for interleaved PCM samples.
+ *
+ * Exactly one thread may write (the decoder) and exactly one thread may read (the audio callback).
+ * Neither side ever locks or allocates, making `read()` safe to call from a real-time thread.
+ *
+ * Samples are stored as raw bytes, so one buffer type can carry every FormatType.
+ */
+class SpscRingBuffer {
+public:
+    SpscRingBuffer(size_t capacity, size_t sampleBytes);
+
+    SpscRingBuffer(const SpscRingBuffer&) = delete;
+    SpscRingBuffer& operator=(const SpscRingBuffer&) = delete;
+
+    // producer side
+    size_t write(const void *input, size_t samples);
+    void discard();
+    [[nodiscard]] size_t writeAvailable() const;
+
+    // consumer side
+    size_t read(void *output, size_t samples, bool *discarded = nullptr);
+    [[nodiscard]] size_t readAvailable() const;
+
+    [[nodiscard]] size_t capacity() const { return mask + 1; };
+    [[nodiscard]] const void *memory() const { return storage.data(); }; // for locking the storage (see MemoryLock)
+    [[nodiscard]] size_t memoryBytes() const { return storage.size(); };
+
+private:
+    std::vector<char> storage;
+    size_t sampleBytes;
+    size_t mask; // capacity - 1 (capacity is always a power of two)
+
+    // monotonically increasing sample counters - only ever wrapped when indexing into storage.
+    // kept on separate cache lines so producer and consumer don't fight over them.
+    alignas(64) std::atomic<uint64_t> writeIndex{0};
+    alignas(64) std::atomic<uint64_t> readIndex{0};
+
+    // discard handshake - written by the producer, applied by the consumer
+    alignas(64) std::atomic<uint64_t> discardMark{0};
+    std::atomic<uint64_t> discardEpoch{0};
+    uint64_t seenEpoch = 0; // consumer only
+};
@@ -0,0 +1,232 @@
+#include "streamdecoder.h"
+
+#include <algorithm>
+#include <chrono>
+#include <utility>
+
+#include "logger.h"
+
+/**
+ * Create a new decoder for an already opened file.
+ *
+ * Note, decoding does not begin until `start()` is called.
+ * @param file The libsndfile handle to decode from (owned by the decoder from now on)
+ * @param format The FormatType the file should be read as
+ * @param channels The amount of channels in the file
+ * @param chunkFrames How many frames to decode at once
+ * @param chunkCount How many chunks to decode ahead of the play head
+ */
+StreamDecoder::StreamDecoder(SNDFILE *file, const FormatType format, const int channels,
+                             const size_t chunkFrames, const size_t chunkCount)
+    : file(file), format(format), channels(channels), chunkFrames(chunkFrames),
+      ring(chunkFrames * channels * chunkCount, FormatTools::sampleSize(format)) {
+    chunk.format = format;
+    chunk.allocate(chunkFrames * channels);
+}
+
+StreamDecoder::~StreamDecoder() {
+    stop();
+    if (file) {
+        sf_close(file);
+    }
+}
+
+/**
+ * Start the decoder thread. The ring buffer will begin filling immediately.
+ */
+void StreamDecoder::start() {
+    if (worker.joinable()) return;
+    if (realtime && locks.empty()) {
+        // the ring is what the callback reads - the rest is decoder-side, but a fault there starves it just as well
+        locks.push_back(std::make_unique<MemoryLock>(ring.memory(), ring.memoryBytes()));
+        locks.push_back(std::make_unique<MemoryLock>(std::as_const(chunk).raw(), chunk.size() * FormatTools::sampleSize(format)));
+        locks.push_back(std::make_unique<MemoryLock>(resampled.data(), resampled.size() * sizeof(float)));
+    }
+    stopping = false;
+    worker = std::thread(&StreamDecoder::run, this);
+}
+
+/**
+ * Seek by reopening the file instead of calling `sf_seek` - for inputs such as pipes, which can only be read forwards.
+ *
+ * The decoder closes its current handle before calling `handler`. Must be set before `start()`.
+ * @param handler Called (on the decoder thread) with the frame to continue from
+ */
+void StreamDecoder::setReopener(Reopener handler) {
+    reopener = std::move(handler);
+}
+
+/**
+ * Convert everything decoded to another sample rate before it reaches the ring buffer.
+ *
+ * Positions passed to `read()` and `seek()` are then in the output rate. The decoder's format must be Float32.
+ * Must be set before `start()`.
+ * @param converter The resampler to run decoded chunks through
+ */
+void StreamDecoder::setResampler(std::unique_ptr<Resampler> converter) {
+    resampler = std::move(converter);
+    if (resampler) {
+        resampled.resize(resampler->maxOutputFrames(chunkFrames) * channels);
+    }
+}
+
+/**
+ * Lock the decoder's buffers into memory and run the decoder thread at a raised priority (see Realtime).
+ *
+ * Must be set before `start()`.
+ * @param enabled Whether to apply realtime settings
+ */
+void StreamDecoder::setRealtime(const bool enabled) {
+    realtime = enabled;
+}
+
+/**
+ * Change how far ahead the decoder works. Safe to call at any time (but not from the audio callback).
+ * @param settings The new pacing
+ */
+void StreamDecoder::setPacing(const Pacing &settings) {
+    {
+        std::lock_guard lock(mutex);
+        pacing = settings;
+    }
+    wake.notify_one();
+}
+
+/**
+ * Stop the decoder thread, waiting for it to exit.
+ */
+void StreamDecoder::stop() {
+    {
+        std::lock_guard lock(mutex);
+        stopping = true;
+    }
+    wake.notify_all();
+    if (worker.joinable()) {
+        worker.join();
+    }
+}
+
+/**
+ * Copy decoded samples into `output`.
+ *
+ * Safe to call from the audio callback - it never blocks or allocates.
+ * @param output Where to write the samples (must fit `samples` samples of the decoder's format)
+ * @param samples The maximum amount of samples to copy
+ * @param position The caller's play head. Moved to the seek target if a seek landed, then advanced by the samples read
+ * @return How many samples were actually copied
+ */
+size_t StreamDecoder::read(void *output, const size_t samples, size_t &position) {
+    bool discarded = false;
+    const size_t samplesRead = ring.read(output, samples, &discarded);
+    if (discarded) {
+        position = seekBase.load(std::memory_order_relaxed);
+    }
+    position += samplesRead;
+    return samplesRead;
+}
+
+/**
+ * Move the decoder to a new position, discarding anything decoded ahead of the old one.
+ *
+ * Must not be called from the audio callback.
+ * @param samplePos The (interleaved) sample position to continue from
+ */
+void StreamDecoder::seek(const size_t samplePos) {
+    {
+        std::lock_guard lock(mutex);
+        seekFrame = samplePos / channels;
+        seekPending = true;
+        endOfFile.store(false, std::memory_order_relaxed);
+    }
+    wake.notify_one();
+}
+
+/**
+ * Whether the end of the file has been reached and every decoded sample has been consumed.
+ */
+bool StreamDecoder::finished() const {
+    return endOfFile.load(std::memory_order_acquire) && ring.readAvailable() == 0;
+}
+
+void StreamDecoder::run() {
+    // room a chunk needs in the ring - more than a chunk when resampling up
+    const size_t chunkSamples = (resampler ? resampler->maxOutputFrames(chunkFrames) : chunkFrames) * channels;
+    if (realtime) {
+        Realtime::promoteCurrentThread();
+    }
+
+    std::unique_lock lock(mutex);
+    while (!stopping) {
+        if (seekPending) {
+            const size_t frame = seekFrame;
+            seekPending = false;
+            // the play head is in output frames - the file has to be seeked in its own
+            size_t fileFrame = frame;
+            if (resampler) {
+                fileFrame = resampler->inputFrameFor(frame);
+                resampler->reset(frame);
+            }
+            if (reopener) {
+                // reopening may take a while (e.g. restarting a process) - don't hold up seek() meanwhile
+                lock.unlock();
+                if (file) sf_close(file);
+                file = reopener(static_cast<sf_count_t>(fileFrame));
+                lock.lock();
+                if (!file) {
+                    Logger::g_log("libkoulouri", Logger::Level::ERROR, "decoder", "Reopening for seek failed!");
+                }
+                if (seekPending) continue; // seeked again while reopening - go straight there instead
+            } else if (sf_seek(file, static_cast<sf_count_t>(fileFrame), SEEK_SET) < 0) {
+                Logger::g_log("libkoulouri", Logger::Level::ERROR, "decoder", "Seek failed: " + std::string(sf_strerror(file)));
+            }
+            seekBase.store(frame * channels, std::memory_order_relaxed);
+            ring.discard(); // publishes seekBase along with the discard
+        }
+
+        if (!file) { // lost the file to a failed reopen - nothing more to decode
+            endOfFile.store(true, std::memory_order_release);
+            wake.wait_for(lock, std::chrono::milliseconds(10));
+            continue;
+        }
+
+        // The callback never wakes us (that would mean touching a lock), so poll while there's nothing to do.
+        // The ring holds seconds of audio, so a short nap here can't starve it.
+        if (endOfFile.load(std::memory_order_relaxed) || !wantsChunk(chunkSamples)) {
+            wake.wait_for(lock, pacing.poll);
+            continue;
+        }
+
+        lock.unlock();
+        const sf_count_t framesRead = FormatReader::read(file, &chunk, static_cast<sf_count_t>(chunkFrames), format, channels);
+        size_t outputFrames = framesRead > 0 ? static_cast<size_t>(framesRead) : 0;
+        if (resampler) {
+            // at the end, push out the tail the filter was still holding back
+            outputFrames = framesRead > 0
+                ? resampler->process(static_cast<const float *>(std::as_const(chunk).raw()), outputFrames, resampled.data())
+                : resampler->flush(resampled.data());
+        }
+        lock.lock();
+
+        if (seekPending) continue; // a seek came in while decoding - this chunk is stale
+        if (outputFrames > 0) {
+            ring.write(resampler ? resampled.data() : chunk.raw(), outputFrames * channels);
+        }
+        if (framesRead <= 0) {
+            endOfFile.store(true, std::memory_order_release);
+        }
+    }
+}
+
+// Whether to decode another chunk now. Once the ring is topped up, decoding pauses until it has drained below
+// `refillSamples` - with a low refill mark, the decoder works in bursts and sleeps in between.
+bool StreamDecoder::wantsChunk(const size_t chunkSamples) {
+    const size_t buffered = ring.readAvailable();
+    const size_t ahead = std::max(std::min(pacing.aheadSamples, ring.capacity()), chunkSamples);
+    if (buffered < pacing.refillSamples) {
+        refilling = true;
+    }
+    if (buffered + chunkSamples > ahead || ring.writeAvailable() < chunkSamples) {
+        refilling = false;
+    }
+    return refilling;
+}
@@ -0,0 +1,96 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <sndfile.h>
+#include <thread>
+#include <vector>
+
+#include "FormatTools.h"
+#include "realtime.h"
+#include "resampler.h"
+#include "ringbuffer.h"
+
+/**
+ * Background decoder that pulls fixed-size chunks out of libsndfile while the file is playing.
+ *
+ * Instead of decoding the whole file up front, a lock-free ring buffer is kept full by a worker thread.
+ * This keeps both startup latency and memory usage constant regardless of track length.
+ *
+ * The decoder takes ownership of the SNDFILE handle and closes it once destroyed.
+ */
+class StreamDecoder {
+public:
+    /**
+     * Opens a fresh handle that starts at the given frame. Used instead of `sf_seek` for files that can't seek.
+     * Returns nullptr on failure.
+     */
+    using Reopener = std::function<SNDFILE*(sf_count_t frame)>;
+
+    /**
+     * How far ahead the decoder works, and how eagerly. The defaults keep the ring topped up.
+     */
+    struct Pacing {
+        size_t aheadSamples = SIZE_MAX; // keep up to this many samples decoded (capped by the ring)
+        size_t refillSamples = SIZE_MAX; // once topped up, wait until fewer than this many are left
+        std::chrono::milliseconds poll{10}; // how long to sleep while there's nothing to decode
+    };
+
+    static constexpr size_t DefaultChunkFrames = 8192;
+
+    StreamDecoder(SNDFILE *file, FormatType format, int channels, size_t chunkFrames = DefaultChunkFrames, size_t chunkCount = 16);
+    ~StreamDecoder();
+
+    StreamDecoder(const StreamDecoder&) = delete;
+    StreamDecoder& operator=(const StreamDecoder&) = delete;
+
+    void start();
+    void stop();
+    void setReopener(Reopener handler);
+    void setResampler(std::unique_ptr<Resampler> converter);
+    void setRealtime(bool enabled);
+    void setPacing(const Pacing &settings);
+
+    size_t read(void *output, size_t samples, size_t &position);
+    void seek(size_t samplePos);
+
+    [[nodiscard]] bool finished() const;
+    [[nodiscard]] size_t buffered() const { return ring.readAvailable(); }; // samples decoded ahead of the play head
+    [[nodiscard]] size_t capacity() const { return ring.capacity(); };
+    [[nodiscard]] bool atEnd() const { return endOfFile.load(std::memory_order_relaxed); }; // the ring only drains from here
+
+private:
+    void run();
+    bool wantsChunk(size_t chunkSamples);
+
+    SNDFILE *file;
+    Reopener reopener; // only set for files that can't seek (pipes)
+    std::unique_ptr<Resampler> resampler; // only set if the file's rate differs from the output's
+    std::vector<float> resampled; // resampler output, copied into the ring
+    FormatType format;
+    int channels;
+    size_t chunkFrames;
+
+    AudioBuffer chunk; // decoder-side scratch, copied into the ring once filled
+    SpscRingBuffer ring;
+    std::atomic<size_t> seekBase{0}; // play head position of the first sample after the latest discard
+    std::atomic<bool> endOfFile{false};
+
+    // only shared between the decoder and the controlling thread - never touched by the audio callback
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::thread worker;
+    size_t seekFrame = 0;
+    bool seekPending = false;
+    bool stopping = false;
+    Pacing pacing;
+    bool refilling = true; // decoder thread only - between `refillSamples` and `aheadSamples`
+
+    bool realtime = false;
+    std::vector<std::unique_ptr<MemoryLock>> locks; // keeps the buffers above resident - declared last, so unlocked before they are freed
+};
@@ -0,0 +1,227 @@
+#include "transcodecache.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <fcntl.h>
+#include <filesystem>
+#include <spawn.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <vector>
+
+#include "logger.h"
+
+extern char **environ;
+
+namespace {
+// FNV-1a - the key has to come out the same on every build, which std::hash doesn't promise
+uint64_t fnv1a(const std::string &data) {
+    uint64_t hash = 14695981039346656037ull;
+    for (const unsigned char c : data) {
+        hash = (hash ^ c) * 1099511628211ull;
+    }
+    return hash;
+}
+
+// Whether `name` is one of our entries: 16 hex digits and ".wav". Anything else in the directory isn't ours to
+// delete - including the ".part" files a conversion (maybe another player's) is still writing.
+bool isEntryName(const std::string &name) {
+    constexpr size_t keyLength = 16;
+    if (name.size() != keyLength + 4 || name.compare(keyLength, 4, ".wav") != 0) return false;
+    return std::all_of(name.begin(), name.begin() + keyLength, [](const char c) {
+        return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'f');
+    });
+}
+}
+
+/**
+ * Create a cache in `directory`. The directory is created once the first conversion finishes.
+ * @param directory Where converted files are kept
+ * @param budgetBytes How large the cache may grow before old entries are deleted
+ */
+TranscodeCache::TranscodeCache(std::string directory, const uint64_t budgetBytes)
+    : directory(std::move(directory)), budget(budgetBytes) {
+    evict(); // the budget may have shrunk since the last run
+}
+
+/**
+ * Stop converting, killing FFmpeg if it's running. Queued conversions are dropped.
+ */
+TranscodeCache::~TranscodeCache() {
+    {
+        std::lock_guard lock(mutex);
+        stopping = true;
+        pending.clear();
+        if (converting > 0) {
+            kill(converting, SIGTERM);
+        }
+    }
+    wake.notify_all();
+    if (worker.joinable()) {
+        worker.join();
+    }
+}
+
+/**
+ * Find the converted version of a file.
+ *
+ * A hit counts as a use, moving the entry to the back of the eviction order.
+ * @param source The original (unconverted) file
+ * @return The path of the converted file, or an empty string if it isn't cached
+ */
+std::string TranscodeCache::lookup(const std::string &source) {
+    const std::string entry = entryFor(source);
+    std::error_code ec;
+    if (entry.empty() || !std::filesystem::is_regular_file(entry, ec)) return "";
+
+    // the entry's modification time doubles as its 'last used' stamp
+    std::filesystem::last_write_time(entry, std::filesystem::file_time_type::clock::now(), ec);
+    return entry;
+}
+
+/**
+ * Convert a file in the background, unless it is already cached or waiting to be converted.
+ * @param source The file to convert
+ */
+void TranscodeCache::request(const std::string &source) {
+    {
+        std::lock_guard lock(mutex);
+        if (stopping || std::find(pending.begin(), pending.end(), source) != pending.end()) return;
+        pending.push_back(source);
+        if (!worker.joinable()) {
+            worker = std::thread(&TranscodeCache::run, this);
+        }
+    }
+    wake.notify_one();
+}
+
+/**
+ * Delete the least recently used entries until the cache fits its budget again. Only the cache's own entries are
+ * counted and deleted.
+ */
+void TranscodeCache::evict() {
+    struct Entry {
+        std::filesystem::file_time_type used;
+        uint64_t size;
+        std::filesystem::path path;
+    };
+
+    std::error_code ec;
+    std::vector<Entry> entries;
+    uint64_t total = 0;
+    for (const auto &file : std::filesystem::directory_iterator(directory, ec)) {
+        if (!isEntryName(file.path().filename().string()) || !file.is_regular_file(ec)) continue;
+        const uint64_t size = file.file_size(ec);
+        if (ec) continue;
+        entries.push_back({file.last_write_time(ec), size, file.path()});
+        total += size;
+    }
+    if (total <= budget) return;
+
+    std::sort(entries.begin(), entries.end(), [](const Entry &a, const Entry &b) {
+        return a.used < b.used;
+    });
+    for (const Entry &entry : entries) {
+        if (total <= budget) break;
+        if (std::filesystem::remove(entry.path, ec)) {
+            Logger::g_log("libkoulouri", Logger::Level::DEBUG, "transcode", "Evicted: " + entry.path.string());
+            total -= entry.size;
+        }
+    }
+}
+
+/**
+ * Where the cache lives unless told otherwise: `$XDG_CACHE_HOME/koulouri/transcode`, falling back to
+ * `~/.cache/koulouri/transcode`.
+ */
+std::string TranscodeCache::defaultDirectory() {
+    if (const char *xdg = getenv("XDG_CACHE_HOME"); xdg && *xdg) {
+        return std::string(xdg) + "/koulouri/transcode";
+    }
+    if (const char *home = getenv("HOME"); home && *home) {
+        return std::string(home) + "/.cache/koulouri/transcode";
+    }
+    return "/tmp/koulouri-transcode";
+}
+
+// Path the converted version of `source` is stored at, or an empty string if `source` can't be read.
+std::string TranscodeCache::entryFor(const std::string &source) const {
+    struct stat st{};
+    if (stat(source.c_str(), &st) == -1) return "";
+
+    // any change to the file (or a different file at the same path) produces a new key
+    const std::string identity = source + '\n' + std::to_string(st.st_mtim.tv_sec) + '.' +
+                                 std::to_string(st.st_mtim.tv_nsec) + '\n' + std::to_string(st.st_size);
+    char key[17];
+    std::snprintf(key, sizeof(key), "%016llx", static_cast<unsigned long long>(fnv1a(identity)));
+    return directory + "/" + key + ".wav";
+}
+
+// Run FFmpeg on `source`, only moving the result to `entry` once it's complete.
+bool TranscodeCache::convert(const std::string &source, const std::string &entry) {
+    const std::string part = entry + ".part";
+
+    // spawn FFmpeg directly rather than through a shell - no quoting issues, and we get a pid to kill
+    const char *argv[] = {"ffmpeg", "-nostdin", "-v", "error", "-y", "-i", source.c_str(),
+                          "-f", "wav", "-c:a", "pcm_f32le", part.c_str(), nullptr};
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+    posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, "/dev/null", O_WRONLY, 0);
+    posix_spawn_file_actions_addopen(&actions, STDERR_FILENO, "/dev/null", O_WRONLY, 0);
+
+    pid_t pid;
+    std::unique_lock lock(mutex);
+    const int spawned = stopping ? -1 : posix_spawnp(&pid, "ffmpeg", &actions, nullptr, const_cast<char **>(argv), environ);
+    posix_spawn_file_actions_destroy(&actions);
+    if (spawned != 0) return false;
+    converting = pid;
+    lock.unlock();
+
+    int status = 0;
+    pid_t reaped;
+    while ((reaped = waitpid(pid, &status, 0)) == -1 && errno == EINTR) {}
+
+    lock.lock();
+    converting = -1;
+    lock.unlock();
+
+    // a failed wait says nothing about how FFmpeg exited - the .part file may be cut short
+    std::error_code ec;
+    if (reaped == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        std::filesystem::remove(part, ec);
+        return false;
+    }
+    std::filesystem::rename(part, entry, ec);
+    return !ec;
+}
+
+void TranscodeCache::run() {
+    std::unique_lock lock(mutex);
+    while (true) {
+        wake.wait(lock, [this] { return stopping || !pending.empty(); });
+        if (stopping) return;
+
+        const std::string source = pending.front();
+        pending.pop_front();
+        lock.unlock();
+
+        const std::string entry = entryFor(source);
+        std::error_code ec;
+        if (!entry.empty() && !std::filesystem::exists(entry, ec)) {
+            std::filesystem::create_directories(directory, ec);
+            if (convert(source, entry)) {
+                Logger::g_log("libkoulouri", Logger::Level::DEBUG, "transcode", "Cached: " + source);
+                evict();
+            } else {
+                Logger::g_log("libkoulouri", Logger::Level::WARNING, "transcode", "Failed to cache: " + source);
+            }
+        }
+
+        lock.lock();
+    }
+}
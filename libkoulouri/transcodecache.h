@@ -0,0 +1,52 @@
+#pragma once
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <sys/types.h>
+#include <thread>
+
+/**
+ * On-disk cache of files converted by FFmpeg, so formats libsndfile can't read only have to be converted once.
+ *
+ * Entries are keyed by the source's path, modification time and size - editing or replacing a file invalidates
+ * its entry. Conversions run on a background thread (while the first play streams straight from FFmpeg), and
+ * the least recently used entries are deleted whenever the cache grows past its byte budget. Other files in the
+ * directory are left alone.
+ *
+ * Converted files are 32-bit float WAVs, so cached tracks can be memory-mapped rather than decoded.
+ * All methods are thread safe.
+ */
+class TranscodeCache {
+public:
+    TranscodeCache(std::string directory, uint64_t budgetBytes);
+    ~TranscodeCache();
+
+    TranscodeCache(const TranscodeCache&) = delete;
+    TranscodeCache& operator=(const TranscodeCache&) = delete;
+
+    std::string lookup(const std::string &source);
+    void request(const std::string &source);
+    void evict();
+
+    [[nodiscard]] const std::string &getDirectory() const { return directory; };
+    [[nodiscard]] uint64_t getBudget() const { return budget; };
+
+    static std::string defaultDirectory();
+
+private:
+    [[nodiscard]] std::string entryFor(const std::string &source) const;
+    bool convert(const std::string &source, const std::string &entry);
+    void run();
+
+    std::string directory;
+    uint64_t budget;
+
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::deque<std::string> pending; // sources waiting to be converted
+    std::thread worker; // started on the first request
+    pid_t converting = -1; // FFmpeg process currently running, killed if the cache is destroyed
+    bool stopping = false;
+};
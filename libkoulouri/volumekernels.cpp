@@ -0,0 +1,387 @@
+#include "FormatTools.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <iterator>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define KOULOURI_X86 1
+#include <immintrin.h>
+#endif
+
+// Volume and mixing kernels. Every implementation must produce the same output as the scalar one (truncation towards
+// zero, saturating to the format's range), so switching between them is never audible. Int32 samples can round up to
+// 2^31 even at unity gain - the SIMD kernels patch those lanes to INT32_MAX, as the scalar ones clamp them.
+// Mixers work in float for every format, the scalar ones included.
+
+namespace {
+// 2^31 - the first float that doesn't fit in an int32
+constexpr float int32Limit = 2147483648.0f;
+
+// portable fallback
+
+void int16Scalar(const int16_t* input, int16_t* output, const size_t samples, const float gain) {
+    for (size_t i = 0; i < samples; ++i) {
+        int scaled = static_cast<int>(input[i] * gain);
+        output[i] = static_cast<int16_t>(std::clamp(scaled, INT16_MIN, INT16_MAX));
+    }
+}
+
+void int32Scalar(const int32_t* input, int32_t* output, const size_t samples, const float gain) {
+    for (size_t i = 0; i < samples; ++i) {
+        int64_t scaled = input[i] * gain;
+        output[i] = static_cast<int32_t>(std::clamp(scaled, static_cast<int64_t>(INT32_MIN), static_cast<int64_t>(INT32_MAX)));
+    }
+}
+
+void float32Scalar(const float* input, float* output, const size_t samples, const float gain) {
+    for (size_t i = 0; i < samples; ++i) {
+        float scaled = input[i] * gain;
+        output[i] = std::clamp(scaled, -1.0f, 1.0f);
+    }
+}
+
+void unpack24Scalar(const Packed24* input, int32_t* output, const size_t samples) {
+    for (size_t i = 0; i < samples; ++i) {
+        output[i] = input[i].toInt32();
+    }
+}
+
+void pack24Scalar(const int32_t* input, Packed24* output, const size_t samples) {
+    for (size_t i = 0; i < samples; ++i) {
+        output[i] = Packed24::fromInt32(input[i]);
+    }
+}
+
+// Packed 24-bit volume - unpack a block onto the stack, scale it with a set's Int32 kernel and pack it back.
+// Sharing the Int32 kernels keeps every set's 24-bit output identical to the scalar one.
+template<void (*Unpack)(const Packed24*, int32_t*, size_t), void (*Scale)(const int32_t*, int32_t*, size_t, float),
+         void (*Pack)(const int32_t*, Packed24*, size_t)>
+void int24Blocked(const Packed24* input, Packed24* output, const size_t samples, const float gain) {
+    int32_t block[512];
+    for (size_t i = 0; i < samples; i += std::size(block)) {
+        const size_t count = std::min(samples - i, std::size(block));
+        Unpack(input + i, block, count);
+        Scale(block, block, count, gain);
+        Pack(block, output + i, count);
+    }
+}
+
+void mixInt16Scalar(const int16_t* a, const int16_t* b, const float* gainA, const float* gainB, int16_t* output,
+                    const size_t samples) {
+    for (size_t i = 0; i < samples; ++i) {
+        const int mixed = static_cast<int>(a[i] * gainA[i] + b[i] * gainB[i]);
+        output[i] = static_cast<int16_t>(std::clamp(mixed, INT16_MIN, INT16_MAX));
+    }
+}
+
+void mixInt32Scalar(const int32_t* a, const int32_t* b, const float* gainA, const float* gainB, int32_t* output,
+                    const size_t samples) {
+    for (size_t i = 0; i < samples; ++i) {
+        const int64_t mixed = static_cast<float>(a[i]) * gainA[i] + static_cast<float>(b[i]) * gainB[i];
+        output[i] = static_cast<int32_t>(std::clamp(mixed, static_cast<int64_t>(INT32_MIN), static_cast<int64_t>(INT32_MAX)));
+    }
+}
+
+void mixFloat32Scalar(const float* a, const float* b, const float* gainA, const float* gainB, float* output,
+                      const size_t samples) {
+    for (size_t i = 0; i < samples; ++i) {
+        output[i] = std::clamp(a[i] * gainA[i] + b[i] * gainB[i], -1.0f, 1.0f);
+    }
+}
+
+// Packed 24-bit mixing, the same way as volume - both inputs are unpacked a block at a time and mixed as Int32.
+template<void (*Unpack)(const Packed24*, int32_t*, size_t),
+         void (*Mix)(const int32_t*, const int32_t*, const float*, const float*, int32_t*, size_t),
+         void (*Pack)(const int32_t*, Packed24*, size_t)>
+void mixInt24Blocked(const Packed24* a, const Packed24* b, const float* gainA, const float* gainB, Packed24* output,
+                     const size_t samples) {
+    int32_t blockA[256], blockB[256];
+    for (size_t i = 0; i < samples; i += std::size(blockA)) {
+        const size_t count = std::min(samples - i, std::size(blockA));
+        Unpack(a + i, blockA, count);
+        Unpack(b + i, blockB, count);
+        Mix(blockA, blockB, gainA + i, gainB + i, blockA, count);
+        Pack(blockA, output + i, count);
+    }
+}
+
+#ifdef KOULOURI_X86
+// SSE2 (every x86_64 CPU has it)
+
+// cvttps turns anything at or above 2^31 (and below -2^31) into INT32_MIN - flip the positive ones to INT32_MAX
+__attribute__((target("sse2")))
+inline __m128i saturateInt32Sse2(const __m128 values) {
+    const __m128i overflow = _mm_castps_si128(_mm_cmpge_ps(values, _mm_set1_ps(int32Limit)));
+    return _mm_xor_si128(_mm_cvttps_epi32(values), overflow);
+}
+
+__attribute__((target("sse2")))
+void int16Sse2(const int16_t* input, int16_t* output, const size_t samples, const float gain) {
+    const __m128 g = _mm_set1_ps(gain);
+    size_t i = 0;
+    for (; i + 8 <= samples; i += 8) {
+        const __m128i in = _mm_loadu_si128(reinterpret_cast<const __m128i*>(input + i));
+        // sign-extend to 32 bit by unpacking into the high halves, then shifting back down
+        const __m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(in, in), 16);
+        const __m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(in, in), 16);
+        const __m128i scaledLo = _mm_cvttps_epi32(_mm_mul_ps(_mm_cvtepi32_ps(lo), g));
+        const __m128i scaledHi = _mm_cvttps_epi32(_mm_mul_ps(_mm_cvtepi32_ps(hi), g));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(output + i), _mm_packs_epi32(scaledLo, scaledHi)); // saturates
+    }
+    int16Scalar(input + i, output + i, samples - i, gain);
+}
+
+__attribute__((target("sse2")))
+void int32Sse2(const int32_t* input, int32_t* output, const size_t samples, const float gain) {
+    const __m128 g = _mm_set1_ps(gain);
+    size_t i = 0;
+    for (; i + 4 <= samples; i += 4) {
+        const __m128 in = _mm_cvtepi32_ps(_mm_loadu_si128(reinterpret_cast<const __m128i*>(input + i)));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(output + i), saturateInt32Sse2(_mm_mul_ps(in, g)));
+    }
+    int32Scalar(input + i, output + i, samples - i, gain);
+}
+
+__attribute__((target("sse2")))
+void float32Sse2(const float* input, float* output, const size_t samples, const float gain) {
+    const __m128 g = _mm_set1_ps(gain);
+    const __m128 upper = _mm_set1_ps(1.0f);
+    const __m128 lower = _mm_set1_ps(-1.0f);
+    size_t i = 0;
+    for (; i + 4 <= samples; i += 4) {
+        const __m128 scaled = _mm_mul_ps(_mm_loadu_ps(input + i), g);
+        _mm_storeu_ps(output + i, _mm_max_ps(_mm_min_ps(scaled, upper), lower));
+    }
+    float32Scalar(input + i, output + i, samples - i, gain);
+}
+
+__attribute__((target("sse2")))
+void mixInt16Sse2(const int16_t* a, const int16_t* b, const float* gainA, const float* gainB, int16_t* output,
+                  const size_t samples) {
+    size_t i = 0;
+    for (; i + 8 <= samples; i += 8) {
+        const __m128i inA = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i));
+        const __m128i inB = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i));
+        const __m128 aLo = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(inA, inA), 16));
+        const __m128 aHi = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpackhi_epi16(inA, inA), 16));
+        const __m128 bLo = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(inB, inB), 16));
+        const __m128 bHi = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpackhi_epi16(inB, inB), 16));
+        const __m128 mixedLo = _mm_add_ps(_mm_mul_ps(aLo, _mm_loadu_ps(gainA + i)), _mm_mul_ps(bLo, _mm_loadu_ps(gainB + i)));
+        const __m128 mixedHi = _mm_add_ps(_mm_mul_ps(aHi, _mm_loadu_ps(gainA + i + 4)), _mm_mul_ps(bHi, _mm_loadu_ps(gainB + i + 4)));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(output + i),
+                         _mm_packs_epi32(_mm_cvttps_epi32(mixedLo), _mm_cvttps_epi32(mixedHi))); // saturates
+    }
+    mixInt16Scalar(a + i, b + i, gainA + i, gainB + i, output + i, samples - i);
+}
+
+__attribute__((target("sse2")))
+void mixInt32Sse2(const int32_t* a, const int32_t* b, const float* gainA, const float* gainB, int32_t* output,
+                  const size_t samples) {
+    size_t i = 0;
+    for (; i + 4 <= samples; i += 4) {
+        const __m128 inA = _mm_cvtepi32_ps(_mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i)));
+        const __m128 inB = _mm_cvtepi32_ps(_mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i)));
+        const __m128 mixed = _mm_add_ps(_mm_mul_ps(inA, _mm_loadu_ps(gainA + i)), _mm_mul_ps(inB, _mm_loadu_ps(gainB + i)));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(output + i), saturateInt32Sse2(mixed));
+    }
+    mixInt32Scalar(a + i, b + i, gainA + i, gainB + i, output + i, samples - i);
+}
+
+__attribute__((target("sse2")))
+void mixFloat32Sse2(const float* a, const float* b, const float* gainA, const float* gainB, float* output,
+                    const size_t samples) {
+    const __m128 upper = _mm_set1_ps(1.0f);
+    const __m128 lower = _mm_set1_ps(-1.0f);
+    size_t i = 0;
+    for (; i + 4 <= samples; i += 4) {
+        const __m128 mixed = _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(gainA + i)),
+                                        _mm_mul_ps(_mm_loadu_ps(b + i), _mm_loadu_ps(gainB + i)));
+        _mm_storeu_ps(output + i, _mm_max_ps(_mm_min_ps(mixed, upper), lower));
+    }
+    mixFloat32Scalar(a + i, b + i, gainA + i, gainB + i, output + i, samples - i);
+}
+
+// AVX2
+
+__attribute__((target("avx2")))
+inline __m256i saturateInt32Avx2(const __m256 values) {
+    const __m256i overflow = _mm256_castps_si256(_mm256_cmp_ps(values, _mm256_set1_ps(int32Limit), _CMP_GE_OQ));
+    return _mm256_xor_si256(_mm256_cvttps_epi32(values), overflow);
+}
+
+__attribute__((target("avx2")))
+void int16Avx2(const int16_t* input, int16_t* output, const size_t samples, const float gain) {
+    const __m256 g = _mm256_set1_ps(gain);
+    size_t i = 0;
+    for (; i + 16 <= samples; i += 16) {
+        const __m128i inLo = _mm_loadu_si128(reinterpret_cast<const __m128i*>(input + i));
+        const __m128i inHi = _mm_loadu_si128(reinterpret_cast<const __m128i*>(input + i + 8));
+        const __m256i scaledLo = _mm256_cvttps_epi32(_mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(inLo)), g));
+        const __m256i scaledHi = _mm256_cvttps_epi32(_mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(inHi)), g));
+        // packs works per 128 bit lane, so the quarters come out as lo0 hi0 lo1 hi1 - put them back in order
+        const __m256i packed = _mm256_packs_epi32(scaledLo, scaledHi);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(output + i), _mm256_permute4x64_epi64(packed, 0xD8));
+    }
+    int16Sse2(input + i, output + i, samples - i, gain);
+}
+
+// 24-bit (un)packing is pure byte shuffling - SSE2 has no byte shuffle, so only AVX2 gets a vector version
+
+__attribute__((target("avx2")))
+void unpack24Avx2(const Packed24* input, int32_t* output, const size_t samples) {
+    const auto* bytes = reinterpret_cast<const uint8_t*>(input);
+    // move the second group of 4 samples (bytes 12..23) into the upper lane, then shift each sample into the
+    // top 3 bytes of its own int
+    const __m256i lanes = _mm256_setr_epi32(0, 1, 2, 0, 3, 4, 5, 0);
+    const __m256i shuffle = _mm256_setr_epi8(-1, 0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11,
+                                             -1, 0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11);
+    size_t i = 0;
+    for (; i + 11 <= samples; i += 8) { // each load reads 32 bytes - 8 samples plus a bit of the next ones
+        const __m256i in = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(bytes + i * 3));
+        const __m256i spread = _mm256_shuffle_epi8(_mm256_permutevar8x32_epi32(in, lanes), shuffle);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(output + i), spread);
+    }
+    unpack24Scalar(input + i, output + i, samples - i);
+}
+
+__attribute__((target("avx2")))
+void pack24Avx2(const int32_t* input, Packed24* output, const size_t samples) {
+    auto* bytes = reinterpret_cast<uint8_t*>(output);
+    // drop the low byte of every int, packing each lane's 12 bytes to its front
+    const __m256i shuffle = _mm256_setr_epi8(1, 2, 3, 5, 6, 7, 9, 10, 11, 13, 14, 15, -1, -1, -1, -1,
+                                             1, 2, 3, 5, 6, 7, 9, 10, 11, 13, 14, 15, -1, -1, -1, -1);
+    size_t i = 0;
+    for (; i + 8 <= samples; i += 8) {
+        const __m256i packed = _mm256_shuffle_epi8(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(input + i)), shuffle);
+        // store exactly 24 bytes - 12 from each lane - so nothing past this block is touched
+        const __m128i lo = _mm256_castsi256_si128(packed);
+        const __m128i hi = _mm256_extracti128_si256(packed, 1);
+        uint8_t* dst = bytes + i * 3;
+        _mm_storel_epi64(reinterpret_cast<__m128i*>(dst), lo);
+        const int loTail = _mm_cvtsi128_si32(_mm_srli_si128(lo, 8));
+        std::memcpy(dst + 8, &loTail, 4);
+        _mm_storel_epi64(reinterpret_cast<__m128i*>(dst + 12), hi);
+        const int hiTail = _mm_cvtsi128_si32(_mm_srli_si128(hi, 8));
+        std::memcpy(dst + 20, &hiTail, 4);
+    }
+    pack24Scalar(input + i, output + i, samples - i);
+}
+
+__attribute__((target("avx2")))
+void int32Avx2(const int32_t* input, int32_t* output, const size_t samples, const float gain) {
+    const __m256 g = _mm256_set1_ps(gain);
+    size_t i = 0;
+    for (; i + 8 <= samples; i += 8) {
+        const __m256 in = _mm256_cvtepi32_ps(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(input + i)));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(output + i), saturateInt32Avx2(_mm256_mul_ps(in, g)));
+    }
+    int32Sse2(input + i, output + i, samples - i, gain);
+}
+
+__attribute__((target("avx2")))
+void float32Avx2(const float* input, float* output, const size_t samples, const float gain) {
+    const __m256 g = _mm256_set1_ps(gain);
+    const __m256 upper = _mm256_set1_ps(1.0f);
+    const __m256 lower = _mm256_set1_ps(-1.0f);
+    size_t i = 0;
+    for (; i + 8 <= samples; i += 8) {
+        const __m256 scaled = _mm256_mul_ps(_mm256_loadu_ps(input + i), g);
+        _mm256_storeu_ps(output + i, _mm256_max_ps(_mm256_min_ps(scaled, upper), lower));
+    }
+    float32Sse2(input + i, output + i, samples - i, gain);
+}
+
+// no FMA - separate multiplies and adds round the same way as the scalar mixers
+
+__attribute__((target("avx2")))
+void mixInt16Avx2(const int16_t* a, const int16_t* b, const float* gainA, const float* gainB, int16_t* output,
+                  const size_t samples) {
+    size_t i = 0;
+    for (; i + 8 <= samples; i += 8) {
+        const __m256 inA = _mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i))));
+        const __m256 inB = _mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i))));
+        const __m256 mixed = _mm256_add_ps(_mm256_mul_ps(inA, _mm256_loadu_ps(gainA + i)), _mm256_mul_ps(inB, _mm256_loadu_ps(gainB + i)));
+        const __m256i truncated = _mm256_cvttps_epi32(mixed);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(output + i),
+                         _mm_packs_epi32(_mm256_castsi256_si128(truncated), _mm256_extracti128_si256(truncated, 1)));
+    }
+    mixInt16Sse2(a + i, b + i, gainA + i, gainB + i, output + i, samples - i);
+}
+
+__attribute__((target("avx2")))
+void mixInt32Avx2(const int32_t* a, const int32_t* b, const float* gainA, const float* gainB, int32_t* output,
+                  const size_t samples) {
+    size_t i = 0;
+    for (; i + 8 <= samples; i += 8) {
+        const __m256 inA = _mm256_cvtepi32_ps(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + i)));
+        const __m256 inB = _mm256_cvtepi32_ps(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + i)));
+        const __m256 mixed = _mm256_add_ps(_mm256_mul_ps(inA, _mm256_loadu_ps(gainA + i)), _mm256_mul_ps(inB, _mm256_loadu_ps(gainB + i)));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(output + i), saturateInt32Avx2(mixed));
+    }
+    mixInt32Sse2(a + i, b + i, gainA + i, gainB + i, output + i, samples - i);
+}
+
+__attribute__((target("avx2")))
+void mixFloat32Avx2(const float* a, const float* b, const float* gainA, const float* gainB, float* output,
+                    const size_t samples) {
+    const __m256 upper = _mm256_set1_ps(1.0f);
+    const __m256 lower = _mm256_set1_ps(-1.0f);
+    size_t i = 0;
+    for (; i + 8 <= samples; i += 8) {
+        const __m256 mixed = _mm256_add_ps(_mm256_mul_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(gainA + i)),
+                                           _mm256_mul_ps(_mm256_loadu_ps(b + i), _mm256_loadu_ps(gainB + i)));
+        _mm256_storeu_ps(output + i, _mm256_max_ps(_mm256_min_ps(mixed, upper), lower));
+    }
+    mixFloat32Sse2(a + i, b + i, gainA + i, gainB + i, output + i, samples - i);
+}
+#endif
+
+const VolumeKernels scalarKernels = {"scalar", int16Scalar, int24Blocked<unpack24Scalar, int32Scalar, pack24Scalar>,
+                                     int32Scalar, float32Scalar, unpack24Scalar, pack24Scalar,
+                                     mixInt16Scalar, mixInt24Blocked<unpack24Scalar, mixInt32Scalar, pack24Scalar>,
+                                     mixInt32Scalar, mixFloat32Scalar};
+#ifdef KOULOURI_X86
+const VolumeKernels sse2Kernels = {"sse2", int16Sse2, int24Blocked<unpack24Scalar, int32Sse2, pack24Scalar>,
+                                   int32Sse2, float32Sse2, unpack24Scalar, pack24Scalar,
+                                   mixInt16Sse2, mixInt24Blocked<unpack24Scalar, mixInt32Sse2, pack24Scalar>,
+                                   mixInt32Sse2, mixFloat32Sse2};
+const VolumeKernels avx2Kernels = {"avx2", int16Avx2, int24Blocked<unpack24Avx2, int32Avx2, pack24Avx2>,
+                                   int32Avx2, float32Avx2, unpack24Avx2, pack24Avx2,
+                                   mixInt16Avx2, mixInt24Blocked<unpack24Avx2, mixInt32Avx2, pack24Avx2>,
+                                   mixInt32Avx2, mixFloat32Avx2};
+#endif
+
+// Pick the fastest kernel set the CPU supports.
+const VolumeKernels& selectKernels() {
+#ifdef KOULOURI_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) return avx2Kernels;
+    if (__builtin_cpu_supports("sse2")) return sse2Kernels;
+#endif
+    return scalarKernels;
+}
+
+} // namespace
+
+/**
+ * Get the volume kernels used by AudioTools. Chosen once (on first use) by checking the CPU's features.
+ */
+const VolumeKernels& AudioTools::activeKernels() {
+    static const VolumeKernels& kernels = selectKernels();
+    return kernels;
+}
+
+/**
+ * Get every volume kernel set the current CPU can run, slowest first. Mostly useful for benchmarking.
+ */
+std::vector<VolumeKernels> AudioTools::supportedKernels() {
+    std::vector<VolumeKernels> kernels = {scalarKernels};
+#ifdef KOULOURI_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2")) kernels.push_back(sse2Kernels);
+    if (__builtin_cpu_supports("avx2")) kernels.push_back(avx2Kernels);
+#endif
+    return kernels;
+}
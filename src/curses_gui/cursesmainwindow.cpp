@@ -13,7 +13,26 @@
 #include "libkoulouri/player.h"
 
 CursesMainWindow::CursesMainWindow() {
-    mhandler.populateMetaCache("/home/exii/Music", &mcache);
+    // a missing (or outdated) cache just makes the rescan a full one
+    std::string cachePath = MetaCache::defaultPath();
+    mcache.loadCache(cachePath);
+    // watch before scanning, so nothing that changes mid-scan is missed - the first `syncLibrary()` picks it up
+    try {
+        watcher = std::make_unique<LibraryWatcher>(std::vector<std::string>{"/home/exii/Music"});
+    } catch (std::runtime_error &e) {
+        Logger::g_log("frontend", Logger::Level::WARNING, "curses", std::string("Not watching the library: ") + e.what());
+    }
+    // curses isn't up yet - report on the plain terminal while the library is scanned
+    mhandler.populateMetaCache("/home/exii/Music", &mcache, [](const ScanProgress &progress) {
+        std::cout << "\rScanning library... " << progress.scanned << "/" << progress.total
+                  << " (" << static_cast<size_t>(progress.filesPerSecond()) << " files/s)" << std::flush;
+    }, MetaHandler::ScanMode::Incremental);
+    std::cout << std::endl;
+    mcache.dumpCache(cachePath);
+    library = LibraryStore(mcache); // straight from the cache file, if the scan found nothing new
+
+    // the queue points into the cache, so let go of tracks the watcher removes
+    mcache.setRemoveListener([this](const Track &track) { forgetTrack(track); });
     userInput = "";
     windowType = WindowType::TrackList;
     queueIndex = 0;
@@ -60,8 +79,21 @@ std::string formatTime(double seconds) {
 }
 
 void CursesMainWindow::handleInternalQueue() {
+    if (player.getTrackChanges() != trackChanges) { // the pre-decoded track was spliced in
+        trackChanges = player.getTrackChanges();
+        currentTrack = nextTrack;
+        nextTrack = nullptr;
+    }
+
     if (player.isCompleted()) {
-        player.stop();
+        // pre-decoded track couldn't be spliced in (different format) - switch over manually
+        if (nextTrack && player.playNext()) {
+            trackChanges = player.getTrackChanges();
+            currentTrack = nextTrack;
+        } else {
+            player.stop();
+        }
+        nextTrack = nullptr;
     }
 
     if (!player.isLoaded() && queueIndex < queue.size()) {
@@ -75,14 +107,42 @@ void CursesMainWindow::handleInternalQueue() {
                 player.setVolume(70);
                 player.play();
                 currentTrack = track;
+                trackChanges = player.getTrackChanges();
             }
         } catch (std::out_of_range &e) {
             queueIndex = 0; // assume queue was cleared, or we've hit the end (++ would put us over)
         }
     }
+
+    // start decoding the following track early, so it can play without a gap
+    if (player.isLoaded() && !nextTrack && queueIndex < queue.size()) {
+        nextTrack = queue.at(queueIndex);
+        queueIndex++;
+        player.queueNext(nextTrack->filePath, true);
+    }
 }
 
 
+/**
+ * Apply whatever changed in the library since the last call. Returns true if the cache changed, in which case any
+ * Track pointers taken from it (other than the queue's) have to be fetched again.
+ */
+bool CursesMainWindow::syncLibrary() {
+    return watcher && !watcher->apply(mhandler, mcache).empty();
+}
+
+// Drop every pointer to a track that's about to leave the cache.
+void CursesMainWindow::forgetTrack(const Track &track) {
+    for (size_t i = queue.size(); i-- > 0;) {
+        if (queue[i] == &track) {
+            queue.erase(queue.begin() + static_cast<long>(i));
+            if (i < queueIndex) queueIndex--;
+        }
+    }
+    if (currentTrack == &track) currentTrack = nullptr; // keeps playing - it's only gone from the library
+    if (nextTrack == &track) nextTrack = nullptr;
+}
+
 int CursesMainWindow::renderBaseUi(const WindowType winType) {
     const double positionSeconds = player.posToSeconds(player.getPos());
     const double maxPositionSeconds = player.posToSeconds(player.getMaxPos());
@@ -98,7 +158,8 @@ int CursesMainWindow::renderBaseUi(const WindowType winType) {
         case WindowType::QueueList: {title += "queue"; break;}
         default: {title += "unknown (report to dev!)"; break;}
     }
-    title += " / volume: " + std::to_string(player.getVolume()) + " ]";
+    title += " / volume: " + std::to_string(player.getVolume());
+    title += std::string(" / latency: ") + LatencySettings::name(player.getLatencyProfile()) + " ]";
     move(0, (maxx/2)-(static_cast<int>(title.length())/2));
     addstr(title.c_str());
 
@@ -108,7 +169,7 @@ int CursesMainWindow::renderBaseUi(const WindowType winType) {
         std::string startTime = formatTime(positionSeconds);
         std::string endTime = formatTime(maxPositionSeconds);
         std::string timeLabel = startTime + "-" + endTime;
-        std::string infoLabel = currentTrack->artist + " - " + currentTrack->title;
+        std::string infoLabel = currentTrack ? currentTrack->artist + " - " + currentTrack->title : player.getCurrentPath();
 
         const int timeLabelWidth = static_cast<int>(timeLabel.size()) + 1;
         const int barWidth = static_cast<int>((maxx - timeLabelWidth) * (positionSeconds / maxPositionSeconds));
@@ -123,6 +184,12 @@ int CursesMainWindow::renderBaseUi(const WindowType winType) {
         move(maxy-2, 1);
         addstr(infoLabel.c_str());
     }
+
+    if (showStats) {
+        const std::string stats = "[ " + player.getCallbackStats().summary() + " ]";
+        move(maxy-2, std::max(1, maxx-1-static_cast<int>(stats.length())));
+        addstr(stats.c_str());
+    }
     return 0;
 }
 
@@ -157,6 +224,7 @@ int CursesMainWindow::main() {
                 }
             }
 
+            win->syncLibrary();
             win->handleInternalQueue();
             win->renderBaseUi(win->windowType);
         }
@@ -165,9 +233,7 @@ int CursesMainWindow::main() {
     });
 
     menu_handler.registerCallback(WindowType::TrackList, [](CursesMainWindow *win, MenuHandler *handler) {
-        const std::vector<const Track*> byArtist = win->mcache.sortBy([](const Track& a, const Track& b) {
-            return a.artist < b.artist;
-        });
+        std::vector<LibraryStore::Index> byArtist = win->library.sortByArtist();
 
         int scrollOffset = 0;
         while (win->running) {
@@ -179,8 +245,9 @@ int CursesMainWindow::main() {
             for (int i = 0; i < win->maxy-4; i++) {
                 move(i+1, 1);
                 try {
-                    const Track* track = byArtist.at(i+scrollOffset);
-                    std::string str = std::to_string(i+scrollOffset) + " " + track->artist + " - " + track->title;
+                    const LibraryStore::TrackRef track = win->library[byArtist.at(i+scrollOffset)];
+                    std::string str = std::to_string(i+scrollOffset) + " " + std::string(track.artist()) + " - " +
+                                      std::string(track.title());
                     addstr(str.c_str());
                     clrtoeol();
                 } catch (std::out_of_range &e) { // should crash cleanly
@@ -197,6 +264,11 @@ int CursesMainWindow::main() {
             clrtoeol();
 
             win->renderBaseUi(win->windowType);
+            if (win->syncLibrary()) {
+                win->library = LibraryStore(win->mcache);
+                byArtist = win->library.sortByArtist();
+                clear();
+            }
             win->handleInternalQueue();
 
             int k = getch();
@@ -232,7 +304,12 @@ int CursesMainWindow::main() {
                 try {
                     const long trackNumber = stol(win->userInput);
                     try {
-                        win->queue.insert(win->queue.end(), byArtist.at(trackNumber));
+                        // the queue holds the cache's own Tracks, so the watcher can tell it when one goes away
+                        const auto &tracks = win->mcache.getCache();
+                        const auto found = tracks.find(win->library[byArtist.at(trackNumber)].id());
+                        if (found != tracks.end()) {
+                            win->queue.insert(win->queue.end(), &found->second);
+                        }
                         // initscr();
                     } catch (std::out_of_range &e) {
                         // pass - was out of range
@@ -245,6 +322,21 @@ int CursesMainWindow::main() {
                 }
             } else if (isdigit(k)) {
                 win->userInput += static_cast<char>(k);
+            } else if (isascii(k) && k == 'l') { // cycle latency profiles - applies without restarting the track
+                LatencyProfile profile = LatencyProfile::LowLatency;
+                switch (win->player.getLatencyProfile()) {
+                    case LatencyProfile::LowLatency: profile = LatencyProfile::Balanced; break;
+                    case LatencyProfile::Balanced: profile = LatencyProfile::PowerSaving; break;
+                    case LatencyProfile::PowerSaving: profile = LatencyProfile::LowLatency; break;
+                }
+                // on failure the player has either kept the old profile or stopped - the queue moves on either way
+                if (PlayerActionResult result = win->player.setLatencyProfile(profile); !result) {
+                    Logger::g_log("frontend", Logger::Level::ERROR, "curses", result.message);
+                }
+                clear();
+            } else if (isascii(k) && k == 's') {
+                win->showStats = !win->showStats;
+                clear();
             } else if (isascii(k) && k == 'q') {
                 win->windowType = QueueList;
                 clear();
@@ -0,0 +1,225 @@
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <sndfile.h>
+#include <string>
+#include <sys/resource.h>
+#include <thread>
+#include <vector>
+#include "libkoulouri/FormatTools.h"
+#include "libkoulouri/latency.h"
+#include "libkoulouri/resampler.h"
+#include "koulouri_shared/cmdparser.h"
+
+// Micro-benchmarks for libkoulouri's hot paths.
+// Numbers are only comparable between runs on the same machine - use them to compare kernels, not hosts.
+
+using Clock = std::chrono::steady_clock;
+
+// Run `fn` repeatedly for (at least) `seconds`, returning how many samples per second it processed.
+double measure(const std::function<void()> &fn, const size_t samplesPerRun, const double seconds) {
+    // warm up caches/branch predictors first
+    for (int i = 0; i < 100; i++) fn();
+
+    size_t runs = 0;
+    const auto start = Clock::now();
+    auto now = start;
+    while (std::chrono::duration<double>(now - start).count() < seconds) {
+        for (int i = 0; i < 100; i++) fn();
+        runs += 100;
+        now = Clock::now();
+    }
+    return static_cast<double>(runs * samplesPerRun) / std::chrono::duration<double>(now - start).count();
+}
+
+void printRate(const std::string &label, const double samplesPerSecond) {
+    std::cout << "  " << std::left << std::setw(28) << label << std::right << std::fixed << std::setprecision(1)
+              << std::setw(10) << samplesPerSecond / 1e6 << " Msamples/s" << std::endl;
+}
+
+void benchVolumeKernels(const size_t samples, const double seconds) {
+    std::cout << "volume kernels (" << samples << " samples per call, active: "
+              << AudioTools::activeKernels().name << ")" << std::endl;
+
+    std::mt19937 rng(1234);
+    std::uniform_int_distribution<int32_t> dist(INT32_MIN, INT32_MAX);
+    std::vector<int16_t> in16(samples), out16(samples);
+    std::vector<Packed24> in24(samples), out24(samples);
+    std::vector<int32_t> in32(samples), out32(samples);
+    std::vector<float> inF(samples), outF(samples);
+    for (size_t i = 0; i < samples; i++) {
+        in32[i] = dist(rng);
+        in16[i] = static_cast<int16_t>(in32[i] >> 16);
+        in24[i] = Packed24::fromInt32(in32[i]);
+        inF[i] = static_cast<float>(in32[i]) / 2147483648.0f;
+    }
+
+    constexpr float gain = 0.7f;
+    const std::vector<float> gainA(samples, 0.6f), gainB(samples, 0.5f);
+    for (const VolumeKernels &kernels : AudioTools::supportedKernels()) {
+        const std::string name = kernels.name;
+        printRate(name + " int16", measure([&] { kernels.int16(in16.data(), out16.data(), samples, gain); }, samples, seconds));
+        printRate(name + " int24 (packed)", measure([&] { kernels.int24(in24.data(), out24.data(), samples, gain); }, samples, seconds));
+        printRate(name + " int32", measure([&] { kernels.int32(in32.data(), out32.data(), samples, gain); }, samples, seconds));
+        printRate(name + " float32", measure([&] { kernels.float32(inF.data(), outF.data(), samples, gain); }, samples, seconds));
+        printRate(name + " unpack24", measure([&] { kernels.unpack24(in24.data(), out32.data(), samples); }, samples, seconds));
+        printRate(name + " mix int16", measure([&] { kernels.mixInt16(in16.data(), in16.data(), gainA.data(), gainB.data(), out16.data(), samples); }, samples, seconds));
+        printRate(name + " mix int24 (packed)", measure([&] { kernels.mixInt24(in24.data(), in24.data(), gainA.data(), gainB.data(), out24.data(), samples); }, samples, seconds));
+        printRate(name + " mix float32", measure([&] { kernels.mixFloat32(inF.data(), inF.data(), gainA.data(), gainB.data(), outF.data(), samples); }, samples, seconds));
+    }
+}
+
+void benchResampler(const double seconds) {
+    constexpr int inputRate = 44100, outputRate = 48000, channels = 2;
+    constexpr double tone = 1000.0, amplitude = 0.5;
+    constexpr size_t blockFrames = 8192; // one StreamDecoder chunk
+    std::cout << "resampler (" << inputRate << " -> " << outputRate << ", stereo, "
+              << blockFrames << " frames per call, SNR against a " << tone << "Hz sine)" << std::endl;
+
+    // one second of the tone, so the accuracy check covers every filter phase
+    const double pi = std::acos(-1.0);
+    std::vector<float> input(inputRate * channels);
+    for (size_t i = 0; i < inputRate; i++) {
+        input[i * channels] = input[i * channels + 1] = static_cast<float>(amplitude * std::sin(2 * pi * tone * i / inputRate));
+    }
+
+    for (const ResamplerQuality quality : {ResamplerQuality::Fast, ResamplerQuality::Balanced, ResamplerQuality::Best}) {
+        Resampler resampler(inputRate, outputRate, channels, quality);
+        std::vector<float> output(resampler.maxOutputFrames(inputRate) * channels);
+        size_t frames = resampler.process(input.data(), inputRate, output.data());
+        frames += resampler.flush(output.data() + frames * channels);
+
+        // skip the edges, where the filter sees the silence around the input
+        double signal = 0.0, noise = 0.0;
+        for (size_t i = 256; i + 256 < frames; i++) {
+            const double expected = amplitude * std::sin(2 * pi * tone * i / outputRate);
+            signal += expected * expected;
+            noise += (output[i * channels] - expected) * (output[i * channels] - expected);
+        }
+
+        std::vector<float> block(resampler.maxOutputFrames(blockFrames) * channels);
+        size_t offset = 0;
+        const double rate = measure([&] {
+            resampler.process(input.data() + offset * channels, blockFrames, block.data());
+            offset = (offset + blockFrames) % (inputRate - blockFrames);
+        }, blockFrames * channels, seconds);
+
+        std::ostringstream label;
+        label << Resampler::qualityName(quality) << " (" << std::fixed << std::setprecision(1)
+              << 10 * std::log10(signal / noise) << "dB)";
+        printRate(label.str(), rate);
+    }
+}
+
+// Seconds of CPU time (user + system) the whole process has used so far.
+double cpuSeconds() {
+    rusage usage{};
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+// Context switches so far - every time a thread goes to sleep and is woken again counts once.
+long contextSwitches() {
+    rusage usage{};
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_nvcsw + usage.ru_nivcsw;
+}
+
+// Streams a file under each latency profile, with a thread standing in for the device: it wakes once per buffer
+// and pulls one buffer out of the decoder, like PortAudio's callback thread would. No audio device needed.
+void benchLatencyProfiles(const double seconds) {
+    constexpr int rate = 44100, channels = 2;
+    const double playSeconds = std::max(2.0, seconds * 4);
+    std::cout << "latency profiles (streamed 16-bit WAV, " << playSeconds << "s of simulated playback each)" << std::endl;
+
+    // longer than the deepest decode-ahead plus the playback, so the decoder never reaches the end
+    const std::string path = (std::filesystem::temp_directory_path() / "koulouri_c-bench-latency.wav").string();
+    {
+        SF_INFO info{};
+        info.samplerate = rate;
+        info.channels = channels;
+        info.format = SF_FORMAT_WAV | SF_FORMAT_PCM_16;
+        SNDFILE *file = sf_open(path.c_str(), SFM_WRITE, &info);
+        if (!file) {
+            std::cout << "  can't write " << path << ": " << sf_strerror(nullptr) << std::endl;
+            return;
+        }
+        std::mt19937 rng(1234);
+        std::uniform_int_distribution<int> dist(INT16_MIN, INT16_MAX);
+        std::vector<int16_t> block(rate * channels);
+        for (int second = 0; second < static_cast<int>(playSeconds) + 15; second++) {
+            for (int16_t &sample : block) sample = static_cast<int16_t>(dist(rng));
+            sf_writef_short(file, block.data(), rate);
+        }
+        sf_close(file);
+    }
+
+    for (const LatencyProfile profile : {LatencyProfile::LowLatency, LatencyProfile::Balanced, LatencyProfile::PowerSaving}) {
+        const LatencySettings latency = LatencySettings::forProfile(profile);
+        SF_INFO info{};
+        SNDFILE *file = sf_open(path.c_str(), SFM_READ, &info);
+        StreamDecoder decoder(file, FormatType::Int16, channels, StreamDecoder::DefaultChunkFrames,
+                              latency.ringChunks(rate, StreamDecoder::DefaultChunkFrames));
+        decoder.setPacing(latency.pacing(rate, channels));
+        decoder.start();
+        std::this_thread::sleep_for(std::chrono::milliseconds(300)); // the initial fill is startup cost, not steady state
+
+        std::vector<int16_t> buffer(latency.framesPerBuffer * channels);
+        const auto period = std::chrono::duration_cast<Clock::duration>(
+            std::chrono::duration<double>(static_cast<double>(latency.framesPerBuffer) / rate));
+        size_t position = 0, callbacks = 0, underruns = 0;
+
+        const double cpuBefore = cpuSeconds();
+        const long switchesBefore = contextSwitches();
+        const auto start = Clock::now();
+        std::thread device([&] {
+            auto deadline = start;
+            while (std::chrono::duration<double>(deadline - start).count() < playSeconds) {
+                deadline += period;
+                std::this_thread::sleep_until(deadline);
+                if (decoder.read(buffer.data(), buffer.size(), position) < buffer.size()) underruns++;
+                callbacks++;
+            }
+        });
+        device.join();
+        const double elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+        const double cpu = cpuSeconds() - cpuBefore;
+        const long switches = contextSwitches() - switchesBefore;
+
+        std::cout << "  " << std::left << std::setw(14) << LatencySettings::name(profile) << std::right << std::fixed
+                  << std::setprecision(1) << std::setw(8) << callbacks / elapsed << " callbacks/s"
+                  << std::setw(8) << switches / elapsed << " wakeups/s"
+                  << std::setprecision(2) << std::setw(8) << 100.0 * cpu / elapsed << "% CPU"
+                  << std::setw(6) << underruns << " underruns" << std::endl;
+    }
+    std::filesystem::remove(path);
+}
+
+int main(int argc, char* argv[]) {
+    CmdParser cmd;
+    cmd.register_argument({"-t", "--time", ArgType::VALUE}); // seconds per measurement
+    cmd.register_argument({"-n", "--samples", ArgType::VALUE}); // samples per kernel call
+
+    ParseResult parsed = cmd.parse_args(argc, argv);
+
+    double seconds = 0.5;
+    size_t samples = 2048; // one 1024 frame stereo callback
+    if (auto lst = parsed.get("--time"); !lst.empty()) {
+        if (auto val = std::get_if<char*>(&lst.at(0).value)) seconds = std::stod(*val);
+    }
+    if (auto lst = parsed.get("--samples"); !lst.empty()) {
+        if (auto val = std::get_if<char*>(&lst.at(0).value)) samples = std::stoul(*val);
+    }
+
+    benchVolumeKernels(samples, seconds);
+    benchResampler(seconds);
+    benchLatencyProfiles(seconds);
+    return 0;
+}
@@ -1,8 +1,11 @@
 #include <algorithm>
+#include <cstdint>
 #include <atomic>
+#include <chrono>
 #include <deque>
 #include <filesystem>
 #include <iostream>
+#include <memory>
 #include <stdexcept>
 #include <string>
 #include <thread>
@@ -12,6 +15,7 @@
 #include "libkoulouri/logger.h"
 #include "libkoulouri/metahandler.h"
 #include "libkoulouri/player.h"
+#include "libkoulouri/renderer.h"
 #include "koulouri_shared/alsasilencer.h"
 #include "koulouri_shared/cmdparser.h"
 
@@ -30,10 +34,17 @@ int main(int argc, char* argv[]) {
     Logger::setOutput(&std::cerr);
 
     int volume = 70;
+    double crossfade = 0.0;
+    long long cacheMiB = -1; // -1 = leave the player's default
+    bool resample = false;
+    ResamplerQuality resampleQuality = ResamplerQuality::Balanced;
+    LatencyProfile latencyProfile = LatencyProfile::Balanced;
+    AudioPlayer::LoadMode loadMode = AudioPlayer::LoadMode::Auto;
 
     CmdParser cmd;
     std::deque<std::string> queue;
     size_t queueIndex = 0;
+    size_t queuedIndex = SIZE_MAX; // queue entry handed to player.queueNext()
 
     // cmd.register_argument({"", "", ArgType::SWITCH});
     cmd.register_argument({"-h", "--help", ArgType::SWITCH});
@@ -41,6 +52,20 @@ int main(int argc, char* argv[]) {
     cmd.register_argument({"-pd", "--playdir", ArgType::APPEND});
     cmd.register_argument({"-d", "--debug", ArgType::SWITCH});
     cmd.register_argument({"-v", "--volume", ArgType::VALUE});
+    cmd.register_argument({"-s", "--stream", ArgType::SWITCH});
+    cmd.register_argument({"-b", "--buffered", ArgType::SWITCH});
+    cmd.register_argument({"-x", "--crossfade", ArgType::VALUE});
+    cmd.register_argument({"-c", "--cache-size", ArgType::VALUE});
+    cmd.register_argument({"-r", "--resample", ArgType::VALUE}); // off, fast, balanced or best
+    cmd.register_argument({"-m", "--compact", ArgType::SWITCH}); // keep lossy files as 16-bit ints
+    cmd.register_argument({"-R", "--realtime", ArgType::SWITCH}); // lock buffers in RAM, raise decoder priority
+    cmd.register_argument({"-L", "--latency", ArgType::VALUE}); // low, balanced or power
+    cmd.register_argument({"-S", "--stats", ArgType::SWITCH}); // dump audio callback timings once done
+    cmd.register_argument({"-o", "--output", ArgType::VALUE}); // 'null', or a .wav file to write instead of playing
+    cmd.register_argument({"-e", "--render", ArgType::VALUE}); // render the queue into this directory, as fast as possible
+    cmd.register_argument({"-E", "--render-format", ArgType::VALUE}); // wav or flac
+    cmd.register_argument({"-rr", "--render-rate", ArgType::VALUE}); // resample rendered tracks to this rate
+    cmd.register_argument({"-j", "--jobs", ArgType::VALUE}); // tracks rendered at once - defaults to every core
 
     ParseResult parsed = cmd.parse_args(argc, argv);
 
@@ -96,6 +121,75 @@ int main(int argc, char* argv[]) {
         }
     }
 
+    if (auto lst = parsed.get("--crossfade"); !lst.empty()) {
+        ArgResult &res = lst.at(0);
+
+        if (auto val = std::get_if<char*>(&res.value)) {
+            try {
+                crossfade = std::stod(*val);
+            } catch (std::invalid_argument &e) {
+                std::cerr << "Bad argument! : " << e.what() << " - '" << *val << "' is not a valid number of seconds!" << std::endl;
+            }
+        }
+    }
+
+    if (auto lst = parsed.get("--cache-size"); !lst.empty()) {
+        ArgResult &res = lst.at(0);
+
+        if (auto val = std::get_if<char*>(&res.value)) {
+            try {
+                cacheMiB = std::max(std::stoll(*val), 0LL);
+            } catch (std::invalid_argument &e) {
+                std::cerr << "Bad argument! : " << e.what() << " - '" << *val << "' is not a valid size (in MiB)!" << std::endl;
+            }
+        }
+    }
+
+    if (auto lst = parsed.get("--resample"); !lst.empty()) {
+        ArgResult &res = lst.at(0);
+
+        if (auto val = std::get_if<char*>(&res.value)) {
+            const std::string mode = *val;
+            if (mode == "off") {
+                resample = false;
+            } else if (mode == "fast") {
+                resample = true;
+                resampleQuality = ResamplerQuality::Fast;
+            } else if (mode == "balanced") {
+                resample = true;
+                resampleQuality = ResamplerQuality::Balanced;
+            } else if (mode == "best") {
+                resample = true;
+                resampleQuality = ResamplerQuality::Best;
+            } else {
+                std::cerr << "Bad argument! : '" << mode << "' is not one of off, fast, balanced or best!" << std::endl;
+            }
+        }
+    }
+
+    if (auto lst = parsed.get("--latency"); !lst.empty()) {
+        ArgResult &res = lst.at(0);
+
+        if (auto val = std::get_if<char*>(&res.value)) {
+            const std::string mode = *val;
+            if (mode == "low") {
+                latencyProfile = LatencyProfile::LowLatency;
+            } else if (mode == "balanced") {
+                latencyProfile = LatencyProfile::Balanced;
+            } else if (mode == "power") {
+                latencyProfile = LatencyProfile::PowerSaving;
+            } else {
+                std::cerr << "Bad argument! : '" << mode << "' is not one of low, balanced or power!" << std::endl;
+            }
+        }
+    }
+
+    if (auto lst = parsed.get("--stream"); !lst.empty()) {
+        loadMode = AudioPlayer::LoadMode::Streaming;
+    } else if (auto lst = parsed.get("--buffered"); !lst.empty()) {
+        loadMode = AudioPlayer::LoadMode::Buffered;
+    }
+
     if (auto lst = parsed.get("--debug"); !lst.empty()) {
         // no point in getting 'res', since we do nothing with the value...
 
@@ -109,8 +203,112 @@ int main(int argc, char* argv[]) {
         AlsaSilencer::supressAlsa();
     }
 
+    if (auto lst = parsed.get("--render"); !lst.empty() && !queue.empty()) {
+        std::string directory;
+        if (auto val = std::get_if<char*>(&lst.at(0).value)) {
+            directory = *val;
+        }
+        RenderOptions options;
+        options.volume = volume;
+        options.quality = resampleQuality;
+        if (auto lst = parsed.get("--compact"); !lst.empty()) {
+            options.storagePolicy = StoragePolicy::Compact;
+        }
+        if (auto lst = parsed.get("--render-format"); !lst.empty()) {
+            if (auto val = std::get_if<char*>(&lst.at(0).value)) {
+                const std::string format = *val;
+                if (format == "flac") {
+                    options.format = RenderFormat::Flac;
+                } else if (format != "wav") {
+                    std::cerr << "Bad argument! : '" << format << "' is not one of wav or flac!" << std::endl;
+                }
+            }
+        }
+        if (auto lst = parsed.get("--render-rate"); !lst.empty()) {
+            if (auto val = std::get_if<char*>(&lst.at(0).value)) {
+                try {
+                    options.sampleRate = std::max(std::stoi(*val), 0);
+                } catch (std::invalid_argument &e) {
+                    std::cerr << "Bad argument! : " << e.what() << " - '" << *val << "' is not a valid sample rate!" << std::endl;
+                }
+            }
+        }
+        if (auto lst = parsed.get("--jobs"); !lst.empty()) {
+            if (auto val = std::get_if<char*>(&lst.at(0).value)) {
+                try {
+                    options.threads = static_cast<unsigned>(std::max(std::stoi(*val), 0));
+                } catch (std::invalid_argument &e) {
+                    std::cerr << "Bad argument! : " << e.what() << " - '" << *val << "' is not a valid integer!" << std::endl;
+                }
+            }
+        }
+
+        try {
+            std::filesystem::create_directories(directory);
+        } catch (std::filesystem::filesystem_error &e) {
+            std::cerr << "Can't create " << directory << ": " << e.what() << std::endl;
+            return 1;
+        }
+        std::vector<RenderJob> jobs;
+        for (size_t i = 0; i < queue.size(); i++) {
+            jobs.push_back({queue.at(i), Renderer::outputPathFor(queue.at(i), directory, options.format, i)});
+        }
+
+        logger.log(Logger::Level::INFO, "Rendering: " + std::to_string(jobs.size()) + " tracks");
+        const auto start = std::chrono::steady_clock::now();
+        const std::vector<RenderResult> results = Renderer(options).render(jobs,
+            [](const RenderResult &result, const size_t done, const size_t total) {
+                std::cout << "[" << done << "/" << total << "] " << result.job.output;
+                if (result.result) {
+                    std::cout << " - " << result.audioSeconds() << "s in " << result.wallSeconds << "s" << std::endl;
+                } else {
+                    std::cout << " - " << result.result.getFriendly() << std::endl;
+                }
+            });
+        const double wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        double audio = 0.0;
+        size_t failed = 0;
+        for (const RenderResult &result : results) {
+            audio += result.audioSeconds();
+            failed += result.result ? 0 : 1;
+        }
+        std::cout << "Rendered " << results.size() - failed << "/" << results.size() << " tracks: " << audio
+                  << "s of audio in " << wall << "s (" << (wall > 0.0 ? audio / wall : 0.0) << "x realtime)" << std::endl;
+        return failed == 0 ? 0 : 1;
+    }
+
     if (queue.size() > 0) {
-        AudioPlayer player;
+        // both simulated sinks run in real time, so the status line (and --stats) behave as they would on a device
+        std::unique_ptr<AudioSink> sink = std::make_unique<PortAudioSink>();
+        if (auto lst = parsed.get("--output"); !lst.empty()) {
+            if (auto val = std::get_if<char*>(&lst.at(0).value)) {
+                const std::string output = *val;
+                if (output == "null") {
+                    sink = std::make_unique<NullSink>();
+                } else {
+                    sink = std::make_unique<WavFileSink>(output, 48000); // one rate for the whole file
+                }
+            }
+        }
+
+        AudioPlayer player(std::move(sink));
+        player.setLoadMode(loadMode);
+        player.setCrossfade(crossfade);
+        player.setResampling(resample, resampleQuality);
+        if (PlayerActionResult result = player.setLatencyProfile(latencyProfile); !result) {
+            std::cerr << "Can't use latency profile: " << result.message << std::endl;
+            return 1;
+        }
+        if (auto lst = parsed.get("--compact"); !lst.empty()) {
+            player.setStoragePolicy(StoragePolicy::Compact);
+        }
+        if (auto lst = parsed.get("--realtime"); !lst.empty()) {
+            player.setRealtime(true);
+        }
+        if (cacheMiB >= 0) {
+            player.setTranscodeCache(TranscodeCache::defaultDirectory(), static_cast<uint64_t>(cacheMiB) * 1024 * 1024);
+        }
 
         logger.log(Logger::Level::INFO, "Playing: " + std::to_string(queue.size()) + " tracks");
 
@@ -127,10 +325,34 @@ int main(int argc, char* argv[]) {
             if (result.result == PlayerActionEnum::PASS) {
                 player.setVolume(volume);
                 PlayerActionResult play = player.play();
-                const size_t maximumPos = player.getMaxPos(); // this doesn't change - get it once!
+                size_t trackChanges = player.getTrackChanges();
+
+                while (running.load()) {
+                    // decode the following track ahead of time, so the player can splice it in without a gap
+                    if (queueIndex + 1 < queue.size() && queuedIndex != queueIndex + 1) {
+                        queuedIndex = queueIndex + 1;
+                        player.queueNext(queue.at(queuedIndex), true);
+                    }
+
+                    if (player.getTrackChanges() != trackChanges) { // queued track took over
+                        trackChanges = player.getTrackChanges();
+                        queueIndex += 1;
+                        std::cout << std::endl;
+                    }
+
+                    if (player.isCompleted()) {
+                        // queued track couldn't be spliced in (different format) - switch over manually
+                        if (queuedIndex == queueIndex + 1 && player.playNext()) {
+                            trackChanges = player.getTrackChanges();
+                            queueIndex += 1;
+                            std::cout << std::endl;
+                            continue;
+                        }
+                        break;
+                    }
 
-                while (!player.isCompleted() && running.load()) {
                     const size_t currentPos = player.getPos();
+                    const size_t maximumPos = player.getMaxPos();
 
                     // TODO: find an efficent way to round up to 2nd decimal!
 
@@ -152,6 +374,11 @@ int main(int argc, char* argv[]) {
             queueIndex += 1;
         }
 
+        if (auto lst = parsed.get("--stats"); !lst.empty()) {
+            const CallbackStats::Snapshot stats = player.getCallbackStats();
+            std::cout << "Callback stats (" << stats.callbacks << " callbacks): " << stats.summary() << std::endl;
+            std::cout << stats.histogramString();
+        }
     }
 
     // for (int i = 1; i < argc; ++i) {
@@ -3,6 +3,7 @@
 #include "libkoulouri/player.h"
 #include <QDebug>
 #include <QDesktopServices>
+#include <QStatusBar>
 #include <QUrl>
 #include <qmessagebox.h>
 #include <random>
@@ -37,6 +38,7 @@ QtMainWindow::QtMainWindow(QWidget *parent)
 
 QtMainWindow::~QtMainWindow()
 {
+    libraryUpdate.waitForFinished(); // it uses the cache and the watcher
     delete ui;
 }
 
@@ -56,6 +58,22 @@ void QtMainWindow::updateProgressBar() {
 
     // std::cout << std::to_string(position) << std::endl;
     ui->progressBar->setValue(position);
+    statusBar()->showMessage(QString::fromStdString(player.getCallbackStats().summary()));
+}
+
+/**
+ * Apply the watcher's changes to the library every second, once the startup scan is done. Reading tags (or a rescan,
+ * after an overflow) can take a while, so it happens off the GUI thread - one apply at a time, and nothing else
+ * touches the cache after startup.
+ */
+void QtMainWindow::startLibraryUpdates() {
+    if (!watcher) return;
+    libraryTimer = new QTimer(this);
+    connect(libraryTimer, &QTimer::timeout, this, [this]() {
+        if (libraryUpdate.isRunning()) return;
+        libraryUpdate = QtConcurrent::run([this] { watcher->apply(mhandler, mcache); });
+    });
+    libraryTimer->start(1000);
 }
 
 /**
@@ -85,7 +103,33 @@ void QtMainWindow::initializePlaybackUI() {
 
     // QPushButton test = QPushButton("hello, world!");
     // std::vector<Track> tracks = mhandler.loadTrackFromDirectory("/home/exii/Music");
-    mhandler.populateMetaCache("/home/exii/Music", &mcache);
+    // a missing (or outdated) cache just makes the rescan a full one
+    std::string cachePath = MetaCache::defaultPath();
+    mcache.loadCache(cachePath);
+    // watch before scanning, so nothing that changes mid-scan is missed
+    try {
+        watcher = std::make_unique<LibraryWatcher>(std::vector<std::string>{"/home/exii/Music"});
+    } catch (std::runtime_error &e) {
+        logger.log(Logger::Level::WARNING, std::string("Not watching the library: ") + e.what());
+    }
+
+    // a large library takes a while to scan - do it on a pool thread, so the window shows up right away.
+    // The cache belongs to that thread until the scan is done; only then does the watcher start applying changes.
+    statusBar()->showMessage("Scanning library...");
+    libraryUpdate = QtConcurrent::run([this, cachePath]() mutable {
+        mhandler.populateMetaCache("/home/exii/Music", &mcache, [this](const ScanProgress &progress) {
+            const QString message = QString("Scanning library... %1/%2 (%3 files/s)")
+                .arg(static_cast<qulonglong>(progress.scanned))
+                .arg(static_cast<qulonglong>(progress.total))
+                .arg(static_cast<qulonglong>(progress.filesPerSecond()));
+            QMetaObject::invokeMethod(this, [this, message] { statusBar()->showMessage(message); });
+        }, MetaHandler::ScanMode::Incremental);
+        mcache.dumpCache(cachePath);
+        QMetaObject::invokeMethod(this, [this] {
+            statusBar()->showMessage("Library scanned", 3000);
+            startLibraryUpdates();
+        });
+    });
 
     // for (const auto &pair : mcache.getCache()){
     //         QListWidgetItem *item = new QListWidgetItem(ui->songList);